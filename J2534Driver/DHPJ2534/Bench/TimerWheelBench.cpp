@@ -0,0 +1,63 @@
+// Jitter benchmark for CTimerWheel. Standard library only, builds outside of Visual Studio:
+//
+//   g++ -std=c++14 -O2 -pthread -I../DHPJ2534 TimerWheelBench.cpp ../DHPJ2534/TimerWheel.cpp -o TimerWheelBench
+//   ./TimerWheelBench [seconds] [spinUs]
+//
+// Runs a mix of periodic timers like a busy J2534 channel would have and prints how late each one fired
+// compared to its exact due time.
+#include "TimerWheel.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+class CBenchSink : public CTimerWheelSink
+{
+public:
+	CBenchSink() { calls = 0; fired = 0; }
+
+	void TimersDue(CWheelTimer ** timers, int count)
+	{
+		calls++;
+		fired += count;
+	}
+
+	unsigned long long calls;
+	unsigned long long fired;
+};
+
+int main(int argc, char * argv[])
+{
+	int seconds = (argc > 1) ? atoi(argv[1]) : 10;
+	unsigned long spinUs = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1000;
+	const unsigned long intervals[] = { 1000, 5000, 10000, 10000, 20000, 50000, 100000, 250000, 1000000, 2000000 };
+	const int n = sizeof(intervals) / sizeof(intervals[0]);
+
+	CBenchSink sink;
+	CTimerWheel wheel(&sink, spinUs);
+	CWheelTimer * timers[n];
+	for (int i = 0; i < n; i++)
+	{
+		timers[i] = new CWheelTimer(intervals[i]);
+		wheel.Add(timers[i], intervals[i]);
+	}
+
+	wheel.Start();
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	wheel.Stop();
+
+	printf("%d s, spin %lu us, %llu sink calls, %llu timers fired\n", seconds, spinUs, sink.calls, sink.fired);
+	printf("%10s %8s %7s %9s %9s %9s\n", "interval", "count", "missed", "min us", "avg us", "max us");
+	for (int i = 0; i < n; i++)
+	{
+		TIMER_JITTER_STATS stats;
+		wheel.GetJitterStats(timers[i], &stats);
+		printf("%7lu us %8llu %7llu %9lld %9.1f %9lld\n", intervals[i], stats.count, stats.missed, stats.minLateUs,
+			stats.count ? (double)stats.totalLateUs / stats.count : 0.0, stats.maxLateUs);
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		wheel.Remove(timers[i]);
+		delete timers[i];
+	}
+	return 0;
+}
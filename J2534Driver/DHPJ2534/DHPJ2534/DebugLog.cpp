@@ -0,0 +1,328 @@
+#include "stdafx.h"
+#include "DebugLog.h"
+#include "helper.h"
+#include "registry.h"
+#include <share.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+namespace debug {
+
+	// Single producer (owning thread), single consumer (log thread) ring
+	typedef struct LogRing {
+		LogRecord records[LOG_RING_SIZE];
+		std::atomic<unsigned int> head;		// advanced by owning thread
+		std::atomic<unsigned int> tail;		// advanced by log thread
+		unsigned int flushHead;				// head snapshot of current flush, log thread only
+		std::atomic<bool> owned;
+		std::atomic<unsigned long> dropped;
+		LogRing * next;
+	} LogRing;
+
+	// rings are never freed, ring of an exited thread is reused by the next new thread
+	std::atomic<LogRing *> rings(NULL);
+	std::atomic<unsigned long long> sequence(0);
+
+	struct RingOwner
+	{
+		LogRing * ring = NULL;
+		~RingOwner()
+		{
+			if (ring)
+				ring->owned.store(false, std::memory_order_release);
+		}
+	};
+	thread_local RingOwner myRing;
+
+	HANDLE hLogThread = NULL;
+	HANDLE ghLogExitEvent = NULL;
+	HANDLE ghLogExitedEvent = NULL;
+
+	std::mutex flushLock;
+	FILE * logFile = NULL;
+	std::wstring logDirectory;
+	std::vector<LogRecord *> pending;
+
+	LogRing * AcquireRing()
+	{
+		for (LogRing * r = rings.load(std::memory_order_acquire); r; r = r->next)
+		{
+			bool expected = false;
+			if (r->owned.compare_exchange_strong(expected, true))
+				return r;
+		}
+
+		LogRing * r = new (std::nothrow) LogRing;
+		if (!r)
+			return NULL;
+		r->head = 0;
+		r->tail = 0;
+		r->flushHead = 0;
+		r->owned = true;
+		r->dropped = 0;
+		r->next = rings.load();
+		while (!rings.compare_exchange_weak(r->next, r))
+			;
+		return r;
+	}
+
+	LogRecord * BeginRecord(unsigned long field)
+	{
+		LogRing * ring = myRing.ring;
+		if (!ring)
+		{
+			ring = myRing.ring = AcquireRing();
+			if (!ring)
+				return NULL;
+		}
+
+		unsigned int h = ring->head.load(std::memory_order_relaxed);
+		if (h - ring->tail.load(std::memory_order_acquire) >= LOG_RING_SIZE)
+		{
+			// log thread is behind, don't block the caller
+			ring->dropped++;
+			return NULL;
+		}
+
+		LogRecord * rec = &ring->records[h & (LOG_RING_SIZE - 1)];
+		rec->sequence = sequence.fetch_add(1, std::memory_order_relaxed);
+		GetSystemTimeAsFileTime(&rec->time);
+		rec->field = field;
+		rec->stringsUsed = 0;
+		return rec;
+	}
+
+	void CommitRecord()
+	{
+		LogRing * ring = myRing.ring;
+		ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	unsigned short CopyString(LogRecord * rec, const void * str, size_t charSize)
+	{
+		if (!str)
+			return 0xFFFF;
+
+		unsigned int offset = (rec->stringsUsed + (unsigned int)charSize - 1) & ~((unsigned int)charSize - 1);
+		if (offset + charSize > LOG_RECORD_STRINGS_SIZE)
+			return 0xFFFF;
+
+		// strings that don't fit are truncated
+		size_t maxChars = (LOG_RECORD_STRINGS_SIZE - offset) / charSize - 1;
+		size_t len = (charSize == sizeof(wchar_t)) ? wcsnlen((const wchar_t *)str, maxChars) : strnlen((const char *)str, maxChars);
+		memcpy(rec->strings + offset, str, len * charSize);
+		memset(rec->strings + offset + len * charSize, 0, charSize);
+		rec->stringsUsed = (unsigned short)(offset + (len + 1) * charSize);
+		return (unsigned short)offset;
+	}
+
+	int FormatBytes(const LogRecord * rec, char * out, size_t size)
+	{
+		unsigned int count = *(const unsigned int *)rec->args;
+		int len = _snprintf_s(out, size, _TRUNCATE, "%d bytes: ", count);
+		for (unsigned int i = 0; (i < rec->stringsUsed) && (len >= 0) && ((size_t)len + 4 < size); i++)
+			len += _snprintf_s(out + len, size - len, _TRUNCATE, "%2x ", (unsigned char)rec->strings[i]);
+		return len;
+	}
+
+	void LogBytes(unsigned long field, unsigned int count, const unsigned char * bytes)
+	{
+		LogRecord * rec = BeginRecord(field);
+		if (!rec)
+			return;
+		unsigned int stored = (count > LOG_RECORD_STRINGS_SIZE) ? LOG_RECORD_STRINGS_SIZE : count;
+		*(unsigned int *)rec->args = count;
+		memcpy(rec->strings, bytes, stored);
+		rec->stringsUsed = (unsigned short)stored;
+		rec->fmt = NULL;
+		rec->format = FormatBytes;
+		CommitRecord();
+	}
+
+	int FormatText(const LogRecord * rec, char * out, size_t size)
+	{
+		return _snprintf_s(out, size, _TRUNCATE, "%s", rec->strings);
+	}
+
+	int FormatTextW(const LogRecord * rec, char * out, size_t size)
+	{
+		int len = WideCharToMultiByte(CP_ACP, 0, (const wchar_t *)rec->strings, -1, out, (int)size, NULL, NULL);
+		return (len > 0) ? len - 1 : 0;
+	}
+
+	void Log(unsigned long field, const char * text)
+	{
+		LogRecord * rec = BeginRecord(field);
+		if (!rec)
+			return;
+		CopyString(rec, text ? text : "", sizeof(char));
+		rec->fmt = NULL;
+		rec->format = FormatText;
+		CommitRecord();
+	}
+
+	void LogW(unsigned long field, const wchar_t * text)
+	{
+		LogRecord * rec = BeginRecord(field);
+		if (!rec)
+			return;
+		CopyString(rec, text ? text : L"", sizeof(wchar_t));
+		rec->fmt = NULL;
+		rec->format = FormatTextW;
+		CommitRecord();
+	}
+
+	int Decorate(char * out, unsigned long field)
+	{
+		int len = 0;
+		if (field == ERR)
+		{
+			memcpy(out, "==>", 3);
+			len += 3;
+		}
+		if (field > INIT)
+			out[len++] = ' ';
+		if (field > MAINFUNC)
+			out[len++] = ' ';
+		if ((field == PROTOCOL_VERBOSE) || (field == PROTOCOL_MSG_VERBOSE) || (field == KEPLER_MSG_VERBOSE))
+			out[len++] = ' ';
+		return len;
+	}
+
+	void WriteRecord(const LogRecord * rec)
+	{
+		char line[LOG_LINE_SIZE + 32];
+		SYSTEMTIME systemTime;
+		FileTimeToSystemTime(&rec->time, &systemTime);
+
+		int len = _snprintf_s(line, sizeof(line), _TRUNCATE, "[%2d:%2d:%2d.%3d] ", systemTime.wHour, systemTime.wMinute, systemTime.wSecond, systemTime.wMilliseconds);
+		len += Decorate(line + len, rec->field);
+		int n = rec->format(rec, line + len, sizeof(line) - len - 1);
+		if (n < 0)
+			n = (int)strlen(line + len);	// truncated
+		len += n;
+		line[len++] = '\n';
+		fwrite(line, 1, len, logFile);
+	}
+
+	// log thread (or StopLog) only, flushLock held
+	void DoFlush()
+	{
+		pending.clear();
+		for (LogRing * r = rings.load(std::memory_order_acquire); r; r = r->next)
+		{
+			r->flushHead = r->head.load(std::memory_order_acquire);
+			for (unsigned int t = r->tail.load(std::memory_order_relaxed); t != r->flushHead; t++)
+				pending.push_back(&r->records[t & (LOG_RING_SIZE - 1)]);
+		}
+
+		// merge threads back into the order the calls were made
+		std::sort(pending.begin(), pending.end(), [](const LogRecord * a, const LogRecord * b) { return a->sequence < b->sequence; });
+
+		if (logFile)
+		{
+			for (size_t i = 0; i < pending.size(); i++)
+				WriteRecord(pending[i]);
+		}
+
+		for (LogRing * r = rings.load(std::memory_order_acquire); r; r = r->next)
+		{
+			r->tail.store(r->flushHead, std::memory_order_release);
+			unsigned long dropped = r->dropped.exchange(0);
+			if (dropped && logFile)
+				fprintf(logFile, "==> %d log records dropped\n", dropped);
+		}
+
+		if (logFile)
+			fflush(logFile);
+	}
+
+	void Flush()
+	{
+		std::lock_guard<std::mutex> guard(flushLock);
+		DoFlush();
+	}
+
+	DWORD WINAPI LogThread(LPVOID lpParam)
+	{
+		while (WaitForSingleObject(ghLogExitEvent, LOG_FLUSH_INTERVAL) == WAIT_TIMEOUT)
+			Flush();
+		Flush();
+		SetEvent(ghLogExitedEvent);
+		return 0;
+	}
+
+	std::wstring ExpandPath(const wchar_t * path)
+	{
+		wchar_t expanded[MAX_PATH];
+		DWORD len = ExpandEnvironmentStringsW(path, expanded, MAX_PATH);
+		if ((len == 0) || (len > MAX_PATH))
+			return std::wstring(path);
+		return std::wstring(expanded);
+	}
+
+	void CreateDirectories(const std::wstring & path)
+	{
+		for (size_t i = path.find(L'\\'); i != std::wstring::npos; i = path.find(L'\\', i + 1))
+			CreateDirectoryW(path.substr(0, i).c_str(), NULL);
+		CreateDirectoryW(path.c_str(), NULL);
+	}
+
+	std::wstring LogFilePath(const wchar_t * fileName)
+	{
+		return logDirectory + L"\\" + fileName;
+	}
+
+	bool StartLog()
+	{
+		pending.reserve(LOG_RING_SIZE * 8);
+
+		unsigned long fields;
+		if (DHPJ2534Registry::GetValueFromRegistry(NULL, TEXT("LOG_FIELDS"), &fields))
+			debug_fields = fields;
+
+		LPTSTR path = NULL;
+		if (DHPJ2534Registry::GetStringFromRegistry(NULL, TEXT("LOG_PATH"), &path))
+		{
+			logDirectory = ExpandPath(path);
+			free(path);
+		}
+		else
+			logDirectory = ExpandPath(DEFAULT_LOG_PATH);
+
+		CreateDirectories(logDirectory);
+		logFile = _wfsopen(LogFilePath(KEPLER_LOG_FILE).c_str(), L"a", _SH_DENYNO);
+
+		if ((ghLogExitEvent = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL)
+			return false;
+		if ((ghLogExitedEvent = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL)
+			return false;
+		hLogThread = CreateThread(NULL, 0, LogThread, NULL, 0, NULL);
+		return (hLogThread != NULL);
+	}
+
+	void StopLog()
+	{
+		if (hLogThread)
+		{
+			// at process exit the thread may already be gone without signaling, so wait for either
+			HANDLE handles[2] = { ghLogExitedEvent, hLogThread };
+			SetEvent(ghLogExitEvent);
+			WaitForMultipleObjects(2, handles, FALSE, 2000);
+			CloseHandle(hLogThread);
+			hLogThread = NULL;
+		}
+
+		// a terminated log thread may have left the lock taken
+		if (flushLock.try_lock())
+		{
+			DoFlush();
+			if (logFile)
+				fclose(logFile);
+			logFile = NULL;
+			flushLock.unlock();
+		}
+	}
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <Windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <new>
+#include <tuple>
+#include <utility>
+#include <string>
+#include <type_traits>
+
+// Asynchronous debug log. LOG() only copies the format string pointer and the arguments into a record in the
+// calling thread's own ring buffer; the log thread formats the records and writes them to file in batches.
+// Strings passed as arguments are copied into the record (truncated to LOG_RECORD_STRINGS_SIZE), since they may
+// be gone by the time it's formatted.
+//
+// Settings (HKLM\Software\PassThruSupport.04.04\Kepler):
+//   LOG_FIELDS  DWORD  bitmask of enabled debug fields (see helper.h)
+//   LOG_PATH    string directory for log files, environment variables are expanded
+
+#define LOG_RING_SIZE 256				// records per thread, power of two
+#define LOG_RECORD_ARGS_SIZE 128
+#define LOG_RECORD_STRINGS_SIZE 256
+#define LOG_LINE_SIZE 1024
+#define LOG_FLUSH_INTERVAL 100			// ms
+#define DEFAULT_LOG_PATH L"%LOCALAPPDATA%\\DHP\\Logs"
+
+namespace debug {
+
+	typedef struct LogRecord LogRecord;
+	typedef int(*LogFormatFunc)(const LogRecord * rec, char * out, size_t size);
+
+	struct LogRecord
+	{
+		unsigned long long sequence;	// global order of records across threads
+		FILETIME time;
+		unsigned long field;
+		const void * fmt;
+		LogFormatFunc format;
+		unsigned short stringsUsed;
+		alignas(8) unsigned char args[LOG_RECORD_ARGS_SIZE];
+		alignas(8) char strings[LOG_RECORD_STRINGS_SIZE];
+	};
+
+	bool StartLog();	// reads settings and starts the log thread
+	void StopLog();		// writes out what's left
+	void Flush();
+
+	std::wstring LogFilePath(const wchar_t * fileName);
+
+	// writer side, used by the templates below
+	LogRecord * BeginRecord(unsigned long field);	// NULL if this thread's ring is full
+	void CommitRecord();
+	unsigned short CopyString(LogRecord * rec, const void * str, size_t charSize);
+
+	// --- argument capture ---
+
+	// plain values are stored as they are
+	template<typename T>
+	struct LogArg
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "LOG arguments must be plain values or strings");
+		typedef T Stored;
+		static T Store(T v, LogRecord *) { return v; }
+		static T Load(const T & v, const LogRecord *) { return v; }
+	};
+
+	// strings are copied into the record. Stored value is offset into record strings, 0xFFFF for NULL.
+	// Byte buffers (unsigned char *) are not strings, they are stored as plain pointers.
+	template<typename C>
+	struct LogStringArg
+	{
+		typedef unsigned short Stored;
+		static unsigned short Store(const C * v, LogRecord * rec) { return CopyString(rec, v, sizeof(C)); }
+		static const C * Load(unsigned short offset, const LogRecord * rec) { return (offset == 0xFFFF) ? NULL : (const C *)(rec->strings + offset); }
+	};
+
+	template<> struct LogArg<char *> : LogStringArg<char> {};
+	template<> struct LogArg<const char *> : LogStringArg<char> {};
+	template<> struct LogArg<wchar_t *> : LogStringArg<wchar_t> {};
+	template<> struct LogArg<const wchar_t *> : LogStringArg<wchar_t> {};
+
+	// --- formatting, done later by the log thread ---
+
+	template<typename... Args>
+	struct LogFormatter
+	{
+		typedef std::tuple<typename LogArg<Args>::Stored...> Stored;
+
+		template<size_t... I>
+		static int Apply(const LogRecord * rec, char * out, size_t size, std::index_sequence<I...>)
+		{
+			const Stored & s = *reinterpret_cast<const Stored *>(rec->args);
+			return _snprintf_s(out, size, _TRUNCATE, (const char *)rec->fmt, LogArg<Args>::Load(std::get<I>(s), rec)...);
+		}
+
+		template<size_t... I>
+		static int ApplyW(const LogRecord * rec, char * out, size_t size, std::index_sequence<I...>)
+		{
+			const Stored & s = *reinterpret_cast<const Stored *>(rec->args);
+			wchar_t wide[LOG_LINE_SIZE];
+			if (_snwprintf_s(wide, LOG_LINE_SIZE, _TRUNCATE, (const wchar_t *)rec->fmt, LogArg<Args>::Load(std::get<I>(s), rec)...) < 0)
+				wide[LOG_LINE_SIZE - 1] = 0;
+			int len = WideCharToMultiByte(CP_ACP, 0, wide, -1, out, (int)size, NULL, NULL);
+			return (len > 0) ? len - 1 : 0;
+		}
+
+		static int Format(const LogRecord * rec, char * out, size_t size)
+		{
+			return Apply(rec, out, size, std::index_sequence_for<Args...>());
+		}
+
+		static int FormatW(const LogRecord * rec, char * out, size_t size)
+		{
+			return ApplyW(rec, out, size, std::index_sequence_for<Args...>());
+		}
+	};
+
+	template<typename... Args>
+	void StoreArgs(LogRecord * rec, Args... args)
+	{
+		typedef typename LogFormatter<Args...>::Stored Stored;
+		static_assert(sizeof(Stored) <= LOG_RECORD_ARGS_SIZE, "too many LOG arguments");
+		new (rec->args) Stored(LogArg<Args>::Store(args, rec)...);
+	}
+
+	template<typename... Args>
+	void Log(unsigned long field, const char * fmt, Args... args)
+	{
+		LogRecord * rec = BeginRecord(field);
+		if (!rec)
+			return;
+		rec->fmt = fmt;
+		rec->format = &LogFormatter<Args...>::Format;
+		StoreArgs(rec, args...);
+		CommitRecord();
+	}
+
+	template<typename... Args>
+	void LogW(unsigned long field, const wchar_t * fmt, Args... args)
+	{
+		LogRecord * rec = BeginRecord(field);
+		if (!rec)
+			return;
+		rec->fmt = fmt;
+		rec->format = &LogFormatter<Args...>::FormatW;
+		StoreArgs(rec, args...);
+		CommitRecord();
+	}
+
+	// messages without arguments are copied as text, so that they can also be built at runtime
+	void Log(unsigned long field, const char * text);
+	void LogW(unsigned long field, const wchar_t * text);
+
+	void LogBytes(unsigned long field, unsigned int count, const unsigned char * bytes);
+}
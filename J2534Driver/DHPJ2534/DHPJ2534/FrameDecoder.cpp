@@ -0,0 +1,87 @@
+#include "stdafx.h"
+#include "FrameDecoder.h"
+#include "helper.h"
+#include <string.h>
+
+CFrameDecoder::CFrameDecoder(void)
+{
+	Reset();
+}
+
+void CFrameDecoder::Reset()
+{
+	readIndex = 0;
+	writeIndex = 0;
+	frameCount = 0;
+	discardedBytes = 0;
+}
+
+char * CFrameDecoder::WriteBuffer()
+{
+	// move the unfinished frame (if any) to the beginning so that there's always room for a maximum sized frame
+	if (readIndex > 0)
+	{
+		unsigned int pending = writeIndex - readIndex;
+		if (pending > 0)
+			memmove(buffer, buffer + readIndex, pending);
+		readIndex = 0;
+		writeIndex = pending;
+	}
+	return buffer + writeIndex;
+}
+
+unsigned int CFrameDecoder::WriteSpace()
+{
+	return FRAME_DECODER_BUFFER_SIZE - writeIndex;
+}
+
+void CFrameDecoder::Commit(unsigned int bytes)
+{
+	if (bytes > WriteSpace())
+	{
+		LOG(ERR, "CFrameDecoder::Commit - %d bytes committed, but only %d bytes of space left!", bytes, WriteSpace());
+		bytes = WriteSpace();
+	}
+	writeIndex += bytes;
+}
+
+bool CFrameDecoder::NextFrame(char ** frame, int * len)
+{
+	while (writeIndex - readIndex > 0)
+	{
+		// resync: skip everything before the next start byte
+		if (buffer[readIndex] != START_BYTE)
+		{
+			char * start = (char*)memchr(buffer + readIndex, START_BYTE, writeIndex - readIndex);
+			unsigned int skip = (start ? (unsigned int)(start - buffer) : writeIndex) - readIndex;
+			LOG(ERR, "CFrameDecoder::NextFrame - no start byte, discarding %d bytes", skip);
+			discardedBytes += skip;
+			readIndex += skip;
+			continue;
+		}
+
+		if (writeIndex - readIndex < KEPLER_FRAME_HEADER_SIZE)
+			return false;	// wait for the length bytes
+
+		unsigned int payloadLength = ((unsigned char)buffer[readIndex + 1] << 8) | (unsigned char)buffer[readIndex + 2];
+		if ((payloadLength == 0) || (payloadLength > KEPLER_MAX_FRAME_PAYLOAD))
+		{
+			// not a real frame header, drop the start byte and look for the next one
+			LOG(ERR, "CFrameDecoder::NextFrame - invalid frame length %d, resyncing", payloadLength);
+			discardedBytes++;
+			readIndex++;
+			continue;
+		}
+
+		unsigned int frameLength = KEPLER_FRAME_HEADER_SIZE + payloadLength;
+		if (writeIndex - readIndex < frameLength)
+			return false;	// wait for the rest of the frame
+
+		*frame = buffer + readIndex;
+		*len = frameLength;
+		readIndex += frameLength;
+		frameCount++;
+		return true;
+	}
+	return false;
+}
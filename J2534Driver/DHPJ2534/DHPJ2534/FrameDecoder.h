@@ -0,0 +1,38 @@
+#pragma once
+
+#include "kepler_defs.h"
+
+// Largest command payload (command byte included) the firmware will ever send in one frame. Matches MESSAGE_BUFFER_SIZE in the firmware.
+#define KEPLER_MAX_FRAME_PAYLOAD 5000
+#define KEPLER_FRAME_HEADER_SIZE 3	// START_BYTE, LenH, LenL
+#define KEPLER_MAX_FRAME_SIZE (KEPLER_FRAME_HEADER_SIZE + KEPLER_MAX_FRAME_PAYLOAD)
+
+#define FRAME_DECODER_BUFFER_SIZE (4 * KEPLER_MAX_FRAME_SIZE)
+
+// Incremental decoder for the Kepler serial stream ( 0x02 LenH LenL <Len bytes> ).
+// Reads are done directly into the decoder buffer (WriteBuffer/WriteSpace/Commit), and complete frames are handed out
+// as views into that same buffer. A partial frame is kept across reads, garbage before a start byte is skipped.
+// Frame views stay valid until the next call to WriteBuffer().
+class CFrameDecoder
+{
+public:
+	CFrameDecoder(void);
+
+	char * WriteBuffer();				// compacts pending bytes to the front and returns where the next read should go
+	unsigned int WriteSpace();			// how many bytes can be read into WriteBuffer()
+	void Commit(unsigned int bytes);	// bytes were read into WriteBuffer()
+
+	bool NextFrame(char ** frame, int * len);	// returns true and a view of the next complete frame, if any
+	void Reset();
+
+	unsigned long FrameCount() { return frameCount; }
+	unsigned long DiscardedBytes() { return discardedBytes; }
+
+private:
+	char buffer[FRAME_DECODER_BUFFER_SIZE];
+	unsigned int readIndex;		// start of the first byte not yet handed out
+	unsigned int writeIndex;	// end of valid data
+
+	unsigned long frameCount;
+	unsigned long discardedBytes;
+};
@@ -4,14 +4,18 @@
 #include <stdio.h>
 #include "Benaphore.h"
 #include "SerialCommunication.h"
+#include "FrameDecoder.h"
 #include <WinSock.h>
 #include <thread>
 #include <queue>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
 
-#define MAX_COLLECTION_BUF_SIZE 1024
-#define MAX_READ_BUF_SIZE 256
-#define MAX_LISTENERS 8
+#define MAX_LISTENERS_PER_KEY 4
+#define MAX_PENDING_REQUESTS 8
+#define MAX_RESPONSE_SIZE 64
 
 namespace Kepler
 {
@@ -26,10 +30,6 @@ namespace Kepler
 	std::mutex myListener;
 	std::mutex myInit;
 
-
-
-	std::queue<TX_QUEUE_MESSAGE*> TransmitQueue;
-
 	bool isConnected = false;
 
 	HANDLE hCommPort = INVALID_HANDLE_VALUE;
@@ -47,59 +47,167 @@ namespace Kepler
 		void * data;
 	} listener_struct;
 
-	listener_struct listeners[MAX_LISTENERS];
-	int listeners_count = 0;
+	typedef struct {
+		int count;
+		listener_struct listeners[MAX_LISTENERS_PER_KEY];
+	} listener_slot;
 
-	char collectionbuf[MAX_COLLECTION_BUF_SIZE + 1];
-	char buffer[MAX_READ_BUF_SIZE];
-	int cbufi = 0;
+	// Listeners indexed by command byte and network type. The table is never modified once published: Register/RemoveListener
+	// build a new copy and swap it in, so the comm thread can dispatch without taking a lock.
+	typedef struct {
+		listener_slot slots[256][KEPLER_MAX_NET_TYPE + 1];
+	} listener_table;
 
-	int RegisterListener(LPKEPLERLISTENER listener, void *data)
+	std::atomic<listener_table *> listenerTable(NULL);
+	listener_table * retiredTable = NULL;		// replaced while a listener was being called from the comm thread itself
+	std::atomic<unsigned long> dispatchEpoch(0);	// odd while the comm thread is dispatching a frame
+	std::atomic<DWORD> dispatchThreadId(0);
+
+	CFrameDecoder decoder;
+	unsigned long frameTime = 0;	// of the frame being dispatched, comm thread only
+	bool deviceClockSynced = false;
+	unsigned long deviceClockOffset = 0;	// GetTime() at device time 0
+
+	// requests waiting for an answer from the device
+	typedef struct {
+		bool inUse;
+		bool completed;
+		unsigned char command;	// command byte of the expected answer
+		unsigned long order;	// to find the oldest pending request
+		int result;
+		char response[MAX_RESPONSE_SIZE];
+		int responseLen;
+	} pending_request;
+
+	pending_request pendingRequests[MAX_PENDING_REQUESTS];
+	unsigned long pendingOrder = 0;
+	std::mutex myPending;
+	std::condition_variable pendingCompleted;
+
+	// myListener must be held
+	void PublishListenerTable(listener_table * table)
 	{
-		LOG(MAINFUNC, "Kepler::RegisterListener");
-		std::lock_guard<std::mutex> guard(myListener);
+		listener_table * old = listenerTable.exchange(table);
+		if (!old)
+			return;
 
-		if (listeners_count < MAX_LISTENERS)
+		if (GetCurrentThreadId() == dispatchThreadId.load())
 		{
-			listeners[listeners_count].callback = listener;
-			listeners[listeners_count].data = data;
-			listeners_count++;
+			// called from a listener: the old table is still in use further up the stack, free it on the next change
+			delete retiredTable;
+			retiredTable = old;
+			return;
+		}
 
-			LOG(MAINFUNC, "Kepler::RegisterListener - added succesfully");
+		// wait for the comm thread to finish the frame it may be dispatching with the old table
+		unsigned long epoch = dispatchEpoch.load();
+		if (epoch & 1)
+		{
+			while (dispatchEpoch.load() == epoch)
+				std::this_thread::yield();
 		}
+		delete old;
+		delete retiredTable;
+		retiredTable = NULL;
+	}
+
+	listener_table * CopyListenerTable()
+	{
+		listener_table * table = new (std::nothrow) listener_table;
+		if (!table)
+			return NULL;
+		listener_table * current = listenerTable.load();
+		if (current)
+			memcpy(table, current, sizeof(listener_table));
 		else
+			memset(table, 0, sizeof(listener_table));
+		return table;
+	}
+
+	int RegisterListener(LPKEPLERLISTENER listener, void *data, unsigned char command, unsigned char networkType)
+	{
+		LOG(MAINFUNC, "Kepler::RegisterListener - command 0x%02x, network type 0x%02x", command, networkType);
+		if (networkType > KEPLER_MAX_NET_TYPE)
+		{
+			LOG(ERR, "Kepler::RegisterListener - invalid network type!");
+			return -1;
+		}
+
+		std::lock_guard<std::mutex> guard(myListener);
+
+		listener_table * current = listenerTable.load();
+		if (current && (current->slots[command][networkType].count >= MAX_LISTENERS_PER_KEY))
 		{
 			LOG(ERR, "Kepler::RegisterListener - too many listeners!");
 			return -1;
 		}
+
+		listener_table * table = CopyListenerTable();
+		if (!table)
+		{
+			LOG(ERR, "Kepler::RegisterListener - Out of memory!");
+			return -1;
+		}
+		listener_slot * slot = &table->slots[command][networkType];
+		slot->listeners[slot->count].callback = listener;
+		slot->listeners[slot->count].data = data;
+		slot->count++;
+		PublishListenerTable(table);
+
+		LOG(MAINFUNC, "Kepler::RegisterListener - added succesfully");
 		return 0;
 	}
 
-	void RemoveListener(LPKEPLERLISTENER listener)
+	void RemoveListener(LPKEPLERLISTENER listener, void * data)
 	{
 		LOG(MAINFUNC, "Kepler::RemoveListener");
 
 		std::lock_guard<std::mutex> guard(myListener);
 
-		int i = 0;
-		while ((i < listeners_count) && (listeners[i].callback != listener))
-			i++;
-		if (listeners[i].callback == listener)
+		if (!listenerTable.load())
+		{
+			LOG(ERR, "Kepler::RemoveListener - no such listener found!");
+			return;
+		}
+
+		listener_table * table = CopyListenerTable();
+		if (!table)
 		{
-			// remove entry so that entries after this are simply moved 1 entry lower
-			while (i < listeners_count - 1)
+			LOG(ERR, "Kepler::RemoveListener - Out of memory!");
+			return;
+		}
+
+		int removed = 0;
+		for (int command = 0; command < 256; command++)
+		{
+			for (int networkType = 0; networkType <= KEPLER_MAX_NET_TYPE; networkType++)
 			{
-				listeners[i].callback = listeners[i + 1].callback;
-				listeners[i].data = listeners[i + 1].data;
-				i++;
+				listener_slot * slot = &table->slots[command][networkType];
+				int i = 0;
+				while (i < slot->count)
+				{
+					if ((slot->listeners[i].callback == listener) && (slot->listeners[i].data == data))
+					{
+						// entries after this are simply moved 1 entry lower
+						for (int j = i; j < slot->count - 1; j++)
+							slot->listeners[j] = slot->listeners[j + 1];
+						slot->count--;
+						removed++;
+					}
+					else
+						i++;
+				}
 			}
-			listeners_count--;
+		}
 
+		if (removed)
+		{
+			PublishListenerTable(table);
 			LOG(MAINFUNC, "Kepler::RemoveListener - removed successfully");
 		}
 		else
 		{
-
+			delete table;
 			LOG(ERR, "Kepler::RemoveListener - no such listener found!");
 		}
 	}
@@ -280,6 +388,8 @@ namespace Kepler
 			return KEPLER_CREATE_EVENT_FAILED;
 		}
 
+		decoder.Reset();
+		deviceClockSynced = false;
 		isConnected = true;
 
 		LOG(MAINFUNC, "Kepler::OpenDevice - port configured");
@@ -301,8 +411,7 @@ namespace Kepler
 	
 	int Send(unsigned char * data, unsigned short len, unsigned long Timeout)
 	{
-		LOG(KEPLER_MSG_VERBOSE, "Kepler::SendMsg - msg: [%s]", data);
-		ready = false;
+		LOG(KEPLER_MSG_VERBOSE, "Kepler::SendMsg - %d bytes, command 0x%02x", len, (len > 3) ? data[3] : 0);
 		
 		//std::lock_guard<std::mutex> guard(myMutex);
 		//write_lock.Lock();
@@ -330,11 +439,101 @@ namespace Kepler
 		//write_lock.Unlock();
 
 		LOG(KEPLER_MSG_VERBOSE, "Kepler::SendMsg - completed succefully: %d bytes written ", dwwritten);
-		ready = true;
 
 		return dwwritten;
 	}
 
+	int Request(unsigned char * msg, unsigned short len, unsigned char responseCommand, unsigned long Timeout, char * response, int * responseLen)
+	{
+		LOG(KEPLER_MSG_VERBOSE, "Kepler::Request - command 0x%02x, waiting for 0x%02x, timeout %d", msg[3], responseCommand, Timeout);
+
+		// slot is taken before sending, so that a fast answer can't be missed
+		int slot;
+		{
+			std::lock_guard<std::mutex> guard(myPending);
+			for (slot = 0; slot < MAX_PENDING_REQUESTS; slot++)
+			{
+				if (!pendingRequests[slot].inUse)
+					break;
+			}
+			if (slot == MAX_PENDING_REQUESTS)
+			{
+				LOG(ERR, "Kepler::Request - too many pending requests!");
+				return KEPLER_REQUEST_BUSY;
+			}
+			pendingRequests[slot].inUse = true;
+			pendingRequests[slot].completed = false;
+			pendingRequests[slot].command = responseCommand;
+			pendingRequests[slot].order = pendingOrder++;
+			pendingRequests[slot].responseLen = 0;
+		}
+
+		int result;
+		if (Send(msg, len, Timeout) != len)
+		{
+			LOG(ERR, "Kepler::Request - sending command 0x%02x failed!", msg[3]);
+			result = KEPLER_REQUEST_SEND_FAILED;
+		}
+		else
+		{
+			std::unique_lock<std::mutex> lock(myPending);
+			if (!pendingCompleted.wait_for(lock, std::chrono::milliseconds(Timeout), [slot] { return pendingRequests[slot].completed; }))
+			{
+				LOG(ERR, "Kepler::Request - no answer to command 0x%02x in %d ms!", msg[3], Timeout);
+				result = KEPLER_REQUEST_TIMEOUT;
+			}
+			else
+			{
+				result = pendingRequests[slot].result;
+				if (response)
+					memcpy(response, pendingRequests[slot].response, pendingRequests[slot].responseLen);
+				if (responseLen)
+					*responseLen = pendingRequests[slot].responseLen;
+			}
+		}
+
+		std::lock_guard<std::mutex> guard(myPending);
+		pendingRequests[slot].inUse = false;
+		return result;
+	}
+
+	// Called by comm thread for every frame. Returns true if the frame was an answer to a pending request.
+	// Error frame completes the request it names (thrower id is the command byte for most commands), otherwise the oldest one.
+	bool CompleteRequest(char * msg_buf, int len)
+	{
+		unsigned char command = (unsigned char)msg_buf[3];
+		// error frames answer the request for the command that threw them, others are asynchronous device errors
+		if (command == KEPLER_ERROR_RESPONSE)
+		{
+			if (len <= 4)
+				return false;
+			command = (unsigned char)msg_buf[4];
+		}
+		std::lock_guard<std::mutex> guard(myPending);
+
+		int match = -1;
+		for (int i = 0; i < MAX_PENDING_REQUESTS; i++)
+		{
+			pending_request * req = &pendingRequests[i];
+			if (!req->inUse || req->completed)
+				continue;
+			if ((req->command == command) && ((match == -1) || ((long)(req->order - pendingRequests[match].order) < 0)))
+				match = i;
+		}
+		if (match == -1)
+			return false;
+
+		pending_request * req = &pendingRequests[match];
+		req->result = ((unsigned char)msg_buf[3] == KEPLER_ERROR_RESPONSE) ? KEPLER_REQUEST_ERROR_RESPONSE : KEPLER_REQUEST_OK;
+		req->responseLen = (len > MAX_RESPONSE_SIZE) ? MAX_RESPONSE_SIZE : len;
+		memcpy(req->response, msg_buf, req->responseLen);
+		req->completed = true;
+		pendingCompleted.notify_all();
+
+		LOG(KEPLER_MSG_VERBOSE, "Kepler::CompleteRequest - frame 0x%02x answers request for 0x%02x", (unsigned char)msg_buf[3], req->command);
+		return true;
+	}
+
 	int Listen(HANDLE CommEventHandle)
 	{
 		memset(&comm_event_overlap, 0, sizeof(comm_event_overlap));
@@ -354,83 +553,234 @@ namespace Kepler
 		return 0;
 	}
 
-	void MsgReceived(char * msg_buf, int len)
+	unsigned long FrameTime()
+	{
+		return frameTime;
+	}
+
+	unsigned long ReadDeviceTime(const unsigned char * msg)
 	{
-		LOG(KEPLER_MSG, "Kepler::MsgReceived: read: %d bytes: [%s]", len, msg_buf);
-		if (listeners_count == 0)
+		return ((unsigned long)msg[0] << 24) | (msg[1] << 16) | (msg[2] << 8) | msg[3];
+	}
+
+	// Device times are put on the GetTime() clock with the smallest offset seen, that of the frame that got here the
+	// fastest. Offsets further off than KEPLER_CLOCK_RESYNC mean the device was reset or the clocks have drifted
+	// apart, the offset is then taken again. Both clocks wrap, the arithmetic is modulo 2^32 throughout.
+	void SyncDeviceTime(unsigned long deviceTime, unsigned long arrival)
+	{
+		unsigned long offset = arrival - deviceTime * 10;		// GetTime() counts 100 ns
+		long diff = (long)(offset - deviceClockOffset);
+		if (!deviceClockSynced || (diff < 0) || (diff > KEPLER_CLOCK_RESYNC))
 		{
-			LOG(KEPLER_MSG, "Kepler::MsgReceived: No listeners");
-			return;
+			deviceClockOffset = offset;
+			deviceClockSynced = true;
 		}
-		// Callback for each listener
-		int accepted = 0;
-		for (int i = 0; i<listeners_count; i++)
+	}
+
+	unsigned long DeviceToHostTime(unsigned long deviceTime)
+	{
+		return deviceTime * 10 + deviceClockOffset;
+	}
+
+	// calls the listeners registered for the command byte and network type of the frame
+	void DispatchFrame(char * msg_buf, int len)
+	{
+		unsigned char command = (unsigned char)msg_buf[3];
+		unsigned char networkType = KEPLER_NET_NONE;
+		if (command == KEPLER_NETWORK_MESSAGE)
 		{
-			if (listeners[i].callback(msg_buf, len, listeners[i].data))
-				accepted++;
+			networkType = (len > 4) ? (unsigned char)msg_buf[4] : 0xFF;
+			if (networkType > KEPLER_MAX_NET_TYPE)
+			{
+				LOG(ERR, "Kepler::MsgReceived: unknown network type 0x%02x", networkType);
+				return;
+			}
 		}
-		if (!accepted)
+
+		dispatchThreadId.store(GetCurrentThreadId(), std::memory_order_relaxed);
+		dispatchEpoch.fetch_add(1);		// entering dispatch, table can't be freed under us
+		listener_table * table = listenerTable.load();
+		int count = table ? table->slots[command][networkType].count : 0;
+		for (int i = 0; i < count; i++)
 		{
-			LOG(ERR, "Kepler::MsgReceived: Warning! None of the listeners accepted the message!");
+			const listener_struct * l = &table->slots[command][networkType].listeners[i];
+			l->callback(msg_buf, len, l->data);
 		}
+		dispatchEpoch.fetch_add(1);
 
+		if (count == 0)
+		{
+			LOG(KEPLER_MSG, "Kepler::MsgReceived: No listeners for command 0x%02x, network type 0x%02x", command, networkType);
+		}
 	}
 
-	VOID CALLBACK ReadRequestCompleted(DWORD errorCode, DWORD bytesRead, LPVOID overlapped)
+	// size of the container record at msg, 0 if it is invalid or cut short
+	int BatchRecordSize(const unsigned char * msg, int len)
 	{
-		buffer[bytesRead] = 0;
-		LOG(KEPLER_MSG_VERBOSE, "Kepler::ReadRequestCompleted: errorCode %d, read: %d bytes: [%s]\n", errorCode, bytesRead, buffer);
-		if (bytesRead > 0)
+		if (len < KEPLER_BATCH_RECORD_HEADER)
+			return 0;
+		int dataLen = msg[0] & 0x0F;
+		int idLen;
+		switch (msg[0] & KEPLER_BATCH_ID_MASK)
 		{
-			unsigned int i = 0;
+		case KEPLER_BATCH_ID_FULL: idLen = 4; break;
+		case KEPLER_BATCH_ID_DELTA: idLen = 1; break;
+		case KEPLER_BATCH_ID_SAME: idLen = 0; break;
+		default: return 0;
+		}
+		int size = KEPLER_BATCH_RECORD_HEADER + idLen + dataLen;
+		if ((dataLen > 8) || (size > len))
+			return 0;
+		return size;
+	}
+
+	// Each record of a KEPLER_NETWORK_BATCH container is dispatched as a KEPLER_NETWORK_MESSAGE frame of its own.
+	// The container has the device time of the first record, the others the time since the record before.
+	void DemuxBatch(char * msg_buf, int len)
+	{
+		const unsigned char * msg = (const unsigned char *)msg_buf;
+		if (len < KEPLER_BATCH_HEADER)
+		{
+			LOG(ERR, "Kepler::DemuxBatch: container of %d bytes", len);
+			return;
+		}
 
-			while (i < bytesRead)
+		// device time of the last record, all of them were received by now
+		unsigned long deviceTime = ReadDeviceTime(msg + 5);
+		int pos = KEPLER_BATCH_HEADER;
+		while (pos < len)
+		{
+			int size = BatchRecordSize(msg + pos, len - pos);
+			if (size == 0)
 			{
-				//Find the start byte
-				if (buffer[i] == START_BYTE)
-				{
-					collectionbuf[cbufi++] = buffer[i++];
-					break;
-				}
+				LOG(ERR, "Kepler::DemuxBatch: invalid record at %d of %d bytes", pos, len);
+				return;
 			}
-			collectionbuf[cbufi++] = buffer[i];
-			collectionbuf[cbufi++] = buffer[i+1];
+			deviceTime += (msg[pos + 1] << 8) | msg[pos + 2];
+			pos += size;
+		}
+		SyncDeviceTime(deviceTime, GetTime());
+
+		deviceTime = ReadDeviceTime(msg + 5);
+		unsigned long id = 0;
+		char frame[KEPLER_NETWORK_HEADER + 4 + 8];
+		frame[0] = 0x02;
+		frame[1] = 0x00;
+		frame[3] = (char)KEPLER_NETWORK_MESSAGE;
+		frame[4] = msg_buf[4];
+
+		pos = KEPLER_BATCH_HEADER;
+		while (pos < len)
+		{
+			const unsigned char * record = msg + pos;
+			int size = BatchRecordSize(record, len - pos);
+			int dataLen = record[0] & 0x0F;
+			int index = KEPLER_BATCH_RECORD_HEADER;
+			switch (record[0] & KEPLER_BATCH_ID_MASK)
+			{
+			case KEPLER_BATCH_ID_FULL:
+				id = ((unsigned long)record[3] << 24) | (record[4] << 16) | (record[5] << 8) | record[6];
+				index += 4;
+				break;
+			case KEPLER_BATCH_ID_DELTA:
+				id += (signed char)record[3];
+				index += 1;
+				break;
+			}
+			deviceTime += (record[1] << 8) | record[2];
+
+			frame[2] = (char)(2 + 4 + dataLen);
+			frame[5] = (char)((id >> 24) & 0xFF);
+			frame[6] = (char)((id >> 16) & 0xFF);
+			frame[7] = (char)((id >> 8) & 0xFF);
+			frame[8] = (char)(id & 0xFF);
+			memcpy(frame + 9, record + index, dataLen);
+
+			frameTime = DeviceToHostTime(deviceTime);
+			DispatchFrame(frame, 9 + dataLen);
+			pos += size;
+		}
+	}
 
+	// Takes the device time out of a KEPLER_NETWORK_MESSAGE frame, so listeners get <network type> <data> as before.
+	// The frame is moved up in its buffer, returns where it starts now.
+	char * TakeDeviceTime(char * msg_buf, int * len)
+	{
+		unsigned long deviceTime = ReadDeviceTime((const unsigned char *)msg_buf + KEPLER_NETWORK_HEADER);
+		SyncDeviceTime(deviceTime, GetTime());
+		frameTime = DeviceToHostTime(deviceTime);
+
+		int frameLen = (((unsigned char)msg_buf[1] << 8) | (unsigned char)msg_buf[2]) - KEPLER_DEVICE_TIME_SIZE;
+		memmove(msg_buf + KEPLER_DEVICE_TIME_SIZE, msg_buf, KEPLER_NETWORK_HEADER);
+		msg_buf += KEPLER_DEVICE_TIME_SIZE;
+		msg_buf[1] = (char)((frameLen >> 8) & 0xFF);
+		msg_buf[2] = (char)(frameLen & 0xFF);
+		*len -= KEPLER_DEVICE_TIME_SIZE;
+		return msg_buf;
+	}
+
+	void MsgReceived(char * msg_buf, int len)
+	{
+		LOG(KEPLER_MSG, "Kepler::MsgReceived: frame of %d bytes, command 0x%02x", len, (unsigned char)msg_buf[3]);
+		if (CompleteRequest(msg_buf, len))
+			return;
 
-			//Next two bytes in buffer are length high and length low
-			unsigned short messageLength = bytesRead - 2;//(collectionbuf[i] << 8) | collectionbuf[i+1];
-			i += 2;
-			//Adjust for offset
-			messageLength += i -1;
-			if (i > bytesRead)
+		unsigned char command = (unsigned char)msg_buf[3];
+		if (command == KEPLER_NETWORK_BATCH)
+		{
+			DemuxBatch(msg_buf, len);
+			return;
+		}
+		if ((command == KEPLER_ERROR_RESPONSE) && (len > 6))
+		{
+			LOG(ERR, "Kepler::MsgReceived: device error, thrower 0x%02x, major 0x%02x, minor 0x%02x", (unsigned char)msg_buf[4], (unsigned char)msg_buf[5], (unsigned char)msg_buf[6]);
+		}
+		if (command == KEPLER_NETWORK_MESSAGE)
+		{
+			if (len < KEPLER_NETWORK_HEADER + KEPLER_DEVICE_TIME_SIZE)
 			{
-				LOG(ERR, "Kepler::ReadRequestCompleted: Buffer underflow. Need %d bytes, have %d", messageLength, bytesRead - i);
+				LOG(ERR, "Kepler::MsgReceived: network message of %d bytes", len);
 				return;
 			}
+			msg_buf = TakeDeviceTime(msg_buf, &len);
+		}
+		else
+		{
+			frameTime = GetTime();
+		}
+		DispatchFrame(msg_buf, len);
+	}
 
-			for ( i; i <= messageLength; i++)
-			{	
-				collectionbuf[cbufi++] = buffer[i];
-			}
+	// Bytes have been read into decoder buffer. Dispatch every frame that is now complete, partial frame is kept for the next read.
+	VOID CALLBACK ReadRequestCompleted(DWORD errorCode, DWORD bytesRead, LPVOID overlapped)
+	{
+		LOG(KEPLER_MSG_VERBOSE, "Kepler::ReadRequestCompleted: errorCode %d, read: %d bytes", errorCode, bytesRead);
+		if (bytesRead == 0)
+			return;
 
-			MsgReceived(collectionbuf, i);
-			cbufi = 0;
+		decoder.Commit(bytesRead);
+
+		char * frame;
+		int len;
+		while (decoder.NextFrame(&frame, &len))
+		{
+			MsgReceived(frame, len);
 		}
 	}
 
 	int BlockingRead(int bytes)
 	{
 		LOG(HELPERFUNC, "Kepler::BlockingRead: read %d bytes", bytes);
-		//	if (!ReadFileEx(hCommPort, buffer,1, &read_overlap, (LPOVERLAPPED_COMPLETION_ROUTINE)&ReadRequestCompleted))
 		DWORD err = 0;
 		DWORD bytesRead;
 		DWORD bytesLeft = bytes;
 		while ((bytesLeft > 0) && (!err))
 		{
-			DWORD bytesToRead = (bytesLeft > MAX_READ_BUF_SIZE ? MAX_READ_BUF_SIZE : bytesLeft);
+			char * readBuffer = decoder.WriteBuffer();
+			DWORD bytesToRead = (bytesLeft > decoder.WriteSpace() ? decoder.WriteSpace() : bytesLeft);
 
 			memset(&read_overlap, 0, sizeof(read_overlap));
-			err = ReadFileEx(hCommPort, buffer, bytesToRead, &read_overlap, NULL);
+			err = ReadFileEx(hCommPort, readBuffer, bytesToRead, &read_overlap, NULL);
 			if (!err)
 			{
 				err = GetLastError();
@@ -442,16 +792,20 @@ namespace Kepler
 				else
 					err = NULL; // omit ERROR_IO_PENDING since we want to continue reading
 			}
+			else
+				err = NULL;
 			if (!GetOverlappedResult(hCommPort, &read_overlap, &bytesRead, TRUE))
 			{
 				LOG(ERR, "Kepler::BlockingRead: GetOverlappedResult error! %d", err = GetLastError());
 				return err;
 			}
-			if (bytesRead != bytes)
+			if (bytesRead != bytesToRead)
 			{
-				LOG(ERR, "Kepler::BlockingRead: bytes read (%d) != bytes requested (%d)! Still handling the bytes we got..", bytesRead, bytes);
+				LOG(ERR, "Kepler::BlockingRead: bytes read (%d) != bytes requested (%d)! Still handling the bytes we got..", bytesRead, bytesToRead);
 			}
 			ReadRequestCompleted(0, bytesRead, &read_overlap);
+			if (bytesRead == 0)
+				break;
 			bytesLeft -= bytesRead;
 		}
 		return STATUS_NOERROR;
@@ -18,18 +18,78 @@ namespace Kepler
 #define KEPLER_SET_COMMMASK_FAILED 6
 #define KEPLER_CREATE_EVENT_FAILED 7
 
+// Request() results
+#define KEPLER_REQUEST_OK 0
+#define KEPLER_REQUEST_ERROR_RESPONSE 1	// device answered with error frame (0xEF)
+#define KEPLER_REQUEST_TIMEOUT 2
+#define KEPLER_REQUEST_SEND_FAILED 3
+#define KEPLER_REQUEST_BUSY 4			// too many requests pending
+
+#define KEPLER_ERROR_RESPONSE 0xEF
+
+// frames from the vehicle network: START_BYTE LenH LenL KEPLER_NETWORK_MESSAGE <network type> <device time> ...
+// Device time is in us, MSB first, when the frame started on the bus. It is taken out before the frames are
+// dispatched, listeners get the time from FrameTime().
+#define KEPLER_NETWORK_MESSAGE 0xAA
+#define KEPLER_NETWORK_HEADER 5
+#define KEPLER_DEVICE_TIME_SIZE 4
+#define KEPLER_CLOCK_RESYNC 500000	// 50 ms in GetTime() units
+#define KEPLER_NET_NONE 0x00		// listener key for commands without network type
+#define KEPLER_NET_VPW 0x01
+#define KEPLER_NET_CAN 0x02
+#define KEPLER_NET_ISOTP 0x03
+#define KEPLER_NET_VPW_STREAM 0x04	// chunk of a long VPW frame: ... <record seq> <status> <data>
+#define KEPLER_MAX_NET_TYPE KEPLER_NET_VPW_STREAM
+
+// VPW stream record status
+#define KEPLER_STREAM_MORE 0x00			// data, frame continues
+#define KEPLER_STREAM_END_OK 0x01		// frame done, CRC ok
+#define KEPLER_STREAM_END_BAD_CRC 0x02
+#define KEPLER_STREAM_ABORTED 0x03		// frame was cut short on the bus
+
+// several received frames in one container: START_BYTE LenH LenL KEPLER_NETWORK_BATCH <network type> <device time> <record> ...
+// record: <header> <us since previous record, 2 bytes> [ID] <data>, header bits 0-3 are the data length and
+// bits 4-5 how the ID is sent. Device time is that of the first record.
+#define KEPLER_NETWORK_BATCH 0xAB
+#define KEPLER_BATCH_HEADER 9
+#define KEPLER_BATCH_RECORD_HEADER 3
+#define KEPLER_BATCH_ID_MASK 0x30
+#define KEPLER_BATCH_ID_FULL 0x00		// 4 byte ID
+#define KEPLER_BATCH_ID_SAME 0x10		// same as the previous record
+#define KEPLER_BATCH_ID_DELTA 0x20		// 1 byte, signed difference to the previous record's ID
+
+#define KEPLER_DEFAULT_REQUEST_TIMEOUT 1000
+
+// result of a sent VPW frame: START_BYTE LenH LenL KEPLER_SEND_RESULT <1 sent, 0 gave up> <attempts>
+#define KEPLER_SEND_RESULT 0xA2
+#define KEPLER_SET_VPW_RETRIES 0xB2
+#define KEPLER_SET_VPW_STREAMING 0xB3
+
+// CAN filters on the device. Create answers with <1 ok, 0 failed> <filter handle>
+#define KEPLER_DELETE_ALL_CAN_FILTERS 0xC3
+#define KEPLER_DELETE_CAN_FILTER 0xC4
+#define KEPLER_CREATE_CAN_FILTER 0xC5
+#define KEPLER_SET_ISOTP_PARAMS 0xC9	// <BS> <STmin> of the flow control frames the device sends
+#define KEPLER_SET_CAN_RX_BATCHING 0xCA	// <flags, bit 0 write at USB start of frame> <latency us H> <latency us L>
+#define KEPLER_DEFAULT_CAN_RX_BATCH_LATENCY_US 1000
+
 
 	int OpenDevice(LPTSTR com_port, int baud_rate, int disable_DTR);
 	bool IsConnected();
 	int CloseDevice();
 	int Listen(HANDLE CommEventHandle);	// non-blocking
 
-	int RegisterListener(LPKEPLERLISTENER listener, void * data);
-	void RemoveListener(LPKEPLERLISTENER listener);
+	// Listener gets the frames with the given command byte (and network type, for KEPLER_NETWORK_MESSAGE frames).
+	// Frames are dispatched from the comm thread without locking, so listeners can be added and removed at any time.
+	int RegisterListener(LPKEPLERLISTENER listener, void * data, unsigned char command, unsigned char networkType);
+	unsigned long FrameTime();	// when the frame being dispatched started on the bus (GetTime()), only valid in a listener
+	void RemoveListener(LPKEPLERLISTENER listener, void * data);	// removes all registrations of this listener & data
 	int Send(unsigned char * msg, unsigned short len, unsigned long Timeout);
 	int Write(char * buf, unsigned int len);
 
-	int HandleCommEvent();
+	// Sends a command and waits max Timeout ms for the device to answer. Answer is the next frame with command byte
+	// responseCommand, or an error frame. Response frame (START_BYTE included) is copied to response, if given.
+	int Request(unsigned char * msg, unsigned short len, unsigned char responseCommand, unsigned long Timeout, char * response, int * responseLen);
 
-static	bool ready = true;
+	int HandleCommEvent();
 }
\ No newline at end of file
@@ -0,0 +1,329 @@
+#include "stdafx.h"
+#include "MsgCapture.h"
+#include "helper.h"
+#include "Benaphore.h"
+#include <shellapi.h>
+#include <share.h>
+#include <stdio.h>
+#include <string.h>
+#include <new>
+
+namespace capture {
+
+	Benaphore buffer_lock;
+	char * buffers[2] = { NULL, NULL };
+	int active = 0;					// buffer being filled, the other one belongs to the capture thread
+	unsigned int used = 0;
+	unsigned long dropped = 0;
+
+	FILE * captureFile = NULL;
+	HANDLE hCaptureThread = NULL;
+	HANDLE ghCaptureExitEvent = NULL;
+	HANDLE ghCaptureDataEvent = NULL;
+
+	void Capture(const PASSTHRU_MSG * pMsg, unsigned char msgType, unsigned long channelId, const char * comment)
+	{
+		if (!captureFile)
+			return;
+
+		CAPTURE_RECORD_HEADER header;
+		FILETIME time;
+		GetSystemTimeAsFileTime(&time);
+
+		unsigned int dataSize = pMsg->DataSize;
+		if (dataSize > sizeof(pMsg->Data))
+			dataSize = sizeof(pMsg->Data);
+		size_t commentSize = comment ? strnlen(comment, MAX_CAPTURE_COMMENT_SIZE) : 0;
+
+		header.RecordSize = (unsigned short)(sizeof(header) + dataSize + commentSize);
+		header.MsgType = msgType;
+		header.CommentSize = (unsigned char)commentSize;
+		header.Time = ((unsigned long long)time.dwHighDateTime << 32) | time.dwLowDateTime;
+		header.Timestamp = pMsg->Timestamp;
+		header.ChannelId = channelId;
+		header.ProtocolID = pMsg->ProtocolID;
+		header.RxStatus = pMsg->RxStatus;
+		header.TxFlags = pMsg->TxFlags;
+		header.ExtraDataIndex = pMsg->ExtraDataIndex;
+		header.DataSize = (unsigned short)dataSize;
+
+		buffer_lock.Lock();
+		if (used + header.RecordSize > CAPTURE_BUFFER_SIZE)
+		{
+			// capture thread hasn't caught up
+			dropped++;
+			buffer_lock.Unlock();
+			SetEvent(ghCaptureDataEvent);
+			return;
+		}
+		char * p = buffers[active] + used;
+		memcpy(p, &header, sizeof(header));
+		memcpy(p + sizeof(header), pMsg->Data, dataSize);
+		if (commentSize)
+			memcpy(p + sizeof(header) + dataSize, comment, commentSize);
+		used += header.RecordSize;
+		bool half = (used > CAPTURE_BUFFER_SIZE / 2);
+		buffer_lock.Unlock();
+
+		if (half)
+			SetEvent(ghCaptureDataEvent);
+	}
+
+	void WriteOut()
+	{
+		buffer_lock.Lock();
+		char * buffer = buffers[active];
+		unsigned int len = used;
+		unsigned long lost = dropped;
+		active ^= 1;
+		used = 0;
+		dropped = 0;
+		buffer_lock.Unlock();
+
+		if (lost)
+			LOG(ERR, "capture::WriteOut - capture buffer full, %d messages not captured", lost);
+		if (len && captureFile)
+		{
+			fwrite(buffer, 1, len, captureFile);
+			fflush(captureFile);
+		}
+	}
+
+	DWORD WINAPI CaptureThread(LPVOID lpParam)
+	{
+		HANDLE events[2] = { ghCaptureExitEvent, ghCaptureDataEvent };
+		while (WaitForMultipleObjects(2, events, FALSE, CAPTURE_FLUSH_INTERVAL) != WAIT_OBJECT_0)
+			WriteOut();
+		return 0;
+	}
+
+	bool StartCapture()
+	{
+		buffers[0] = new (std::nothrow) char[CAPTURE_BUFFER_SIZE];
+		buffers[1] = new (std::nothrow) char[CAPTURE_BUFFER_SIZE];
+		if (!buffers[0] || !buffers[1])
+		{
+			LOG(ERR, "capture::StartCapture - Out of memory!");
+			return false;
+		}
+
+		FILE * file = _wfsopen(debug::LogFilePath(KEPLER_MSG_CAPTURE_FILE).c_str(), L"ab", _SH_DENYWR);
+		if (!file)
+		{
+			LOG(ERR, "capture::StartCapture - cannot open capture file");
+			return false;
+		}
+
+		fseek(file, 0, SEEK_END);
+		if (ftell(file) == 0)
+		{
+			FILETIME time;
+			CAPTURE_FILE_HEADER header;
+			GetSystemTimeAsFileTime(&time);
+			memcpy(header.Magic, CAPTURE_MAGIC, 4);
+			header.Version = CAPTURE_VERSION;
+			header.HeaderSize = sizeof(header);
+			header.StartTime = ((unsigned long long)time.dwHighDateTime << 32) | time.dwLowDateTime;
+			fwrite(&header, sizeof(header), 1, file);
+			fflush(file);
+		}
+
+		if ((ghCaptureExitEvent = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL)
+		{
+			fclose(file);
+			return false;
+		}
+		if ((ghCaptureDataEvent = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL)
+		{
+			fclose(file);
+			return false;
+		}
+		captureFile = file;
+		hCaptureThread = CreateThread(NULL, 0, CaptureThread, NULL, 0, NULL);
+		if (hCaptureThread == NULL)
+		{
+			LOG(ERR, "capture::StartCapture - cannot create capture thread");
+			return false;
+		}
+		LOG(INIT, "capture::StartCapture - capturing messages");
+		return true;
+	}
+
+	void StopCapture()
+	{
+		if (hCaptureThread)
+		{
+			SetEvent(ghCaptureExitEvent);
+			// not INFINITE, this runs from DllMain where a stuck thread would hang the process
+			DWORD ret = WaitForSingleObject(hCaptureThread, 2000);
+			CloseHandle(hCaptureThread);
+			hCaptureThread = NULL;
+			if (ret != WAIT_OBJECT_0)
+			{
+				// the thread may still be in WriteOut, leave the file to it
+				LOG(ERR, "capture::StopCapture - capture thread didn't exit, last records not written");
+				return;
+			}
+		}
+		if (captureFile)
+		{
+			WriteOut();
+			FILE * file = captureFile;
+			captureFile = NULL;
+			fclose(file);
+		}
+	}
+
+	// --- conversion to text ---
+
+	void WriteTextRecord(FILE * out, const CAPTURE_RECORD_HEADER * header, const unsigned char * data, const char * comment)
+	{
+		FILETIME time;
+		SYSTEMTIME systemTime;
+		time.dwLowDateTime = (DWORD)header->Time;
+		time.dwHighDateTime = (DWORD)(header->Time >> 32);
+		FileTimeToSystemTime(&time, &systemTime);
+		fprintf(out, "[%02d:%02d:%02d.%03d] ", systemTime.wHour, systemTime.wMinute, systemTime.wSecond, systemTime.wMilliseconds);
+
+		switch (header->MsgType)
+		{
+		case LogMessageType::RECEIVED:
+			fputs(">>>>", out);
+			break;
+		case LogMessageType::SENT:
+			fputs("<<<<", out);
+			break;
+		case LogMessageType::ISO15765_RECV:
+			fputs("ISO>", out);
+			break;
+		case LogMessageType::ISO15765_SENT:
+			fputs("<ISO", out);
+			break;
+		case LogMessageType::LOOP_BACK:
+			fputs("LOOP", out);
+			break;
+		default:
+			fputs("UDEF", out);
+		}
+
+		fprintf(out, " Ch#%02d", header->ChannelId);
+
+		unsigned long pid = header->ProtocolID;
+		if (pid >= 0x8000)
+		{
+			fputs(" PS ", out);	// pin switching
+			pid -= 0x8000 - 1;  // PS ids start from 0x8000, normal (without pin switching) from 0x0001
+		}
+		else
+			fputs("    ", out);
+		switch (pid)
+		{
+		case J1850VPW:
+			fputs("J1850VPW ", out);
+			break;
+		case J1850PWM:
+			fputs("J1850PWM ", out);
+			break;
+		case ISO9141:
+			fputs("ISO9141  ", out);
+			break;
+		case ISO14230:
+			fputs("ISO14230 ", out);
+			break;
+		case CAN:
+			fputs("CAN      ", out);
+			break;
+		case ISO15765:
+			fputs("ISO15765 ", out);
+			break;
+		default:
+			fputs("UNKNOWN  ", out);
+		}
+
+		unsigned long flags = 0;
+		bool showFlags = false;
+		if ((header->MsgType == RECEIVED) || (header->MsgType == ISO15765_RECV) || (header->MsgType == LOOP_BACK))
+		{
+			flags = header->RxStatus;
+			showFlags = true;
+		}
+		else
+			if ((header->MsgType == SENT) || (header->MsgType == ISO15765_SENT))
+			{
+				flags = header->TxFlags;
+				showFlags = true;
+			}
+		if (showFlags && ((pid == CAN) || (pid == ISO15765)))
+		{
+			fputs((flags & CAN_29BIT_ID) ? "29b " : "11b ", out);
+			fputs((flags & ISO15765_ADDR_TYPE) ? "EXT ADDR " : "STD ADDR ", out);
+		}
+
+		fprintf(out, "DS:%02d EDI:%02d :: ", header->DataSize, header->ExtraDataIndex);
+		for (unsigned int i = 0; i < 4; i++)
+			fprintf(out, "%02x ", (i < header->DataSize) ? data[i] : 0);
+		fputs("| ", out);
+		for (unsigned int i = 4; i < header->DataSize; i++)
+			fprintf(out, "%02x ", data[i]);
+
+		fwrite(comment, 1, header->CommentSize, out);
+		fputs("\n", out);
+	}
+
+	bool ConvertCaptureToText(const wchar_t * capturePath, const wchar_t * textPath)
+	{
+		FILE * in = NULL;
+		FILE * out = NULL;
+		// the capture file may still be open for writing
+		if ((in = _wfsopen(capturePath, L"rb", _SH_DENYNO)) == NULL)
+			return false;
+
+		CAPTURE_FILE_HEADER fileHeader;
+		if ((fread(&fileHeader, sizeof(fileHeader), 1, in) != 1) || (memcmp(fileHeader.Magic, CAPTURE_MAGIC, 4) != 0) || (fileHeader.Version != CAPTURE_VERSION))
+		{
+			fclose(in);
+			return false;
+		}
+		fseek(in, fileHeader.HeaderSize, SEEK_SET);
+
+		if (_wfopen_s(&out, textPath, L"w") != 0)
+		{
+			fclose(in);
+			return false;
+		}
+
+		bool ok = true;
+		CAPTURE_RECORD_HEADER header;
+		unsigned char record[sizeof(((PASSTHRU_MSG*)0)->Data) + MAX_CAPTURE_COMMENT_SIZE];
+		while (fread(&header, sizeof(header), 1, in) == 1)
+		{
+			unsigned int payloadSize = header.RecordSize - (unsigned int)sizeof(header);
+			if ((header.RecordSize < sizeof(header)) || (payloadSize > sizeof(record)) || (payloadSize != (unsigned int)header.DataSize + header.CommentSize)
+				|| (fread(record, 1, payloadSize, in) != payloadSize))
+			{
+				ok = false;	// truncated or corrupt, keep what was converted so far
+				break;
+			}
+			WriteTextRecord(out, &header, record, (const char *)record + header.DataSize);
+		}
+
+		fclose(out);
+		fclose(in);
+		return ok;
+	}
+}
+
+// rundll32 DHPJ2534.dll,ConvertMsgCapture <capture file> <text file>
+extern "C" void CALLBACK ConvertMsgCaptureW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int nCmdShow)
+{
+	int argc = 0;
+	LPWSTR * argv = CommandLineToArgvW(lpszCmdLine, &argc);
+	if (!argv)
+		return;
+	if (argc >= 2)
+	{
+		if (!capture::ConvertCaptureToText(argv[0], argv[1]))
+			LOGW(ERR, L"ConvertMsgCapture - could not convert %s", argv[0]);
+	}
+	LocalFree(argv);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <Windows.h>
+#include "j2534_v0404.h"
+
+// Binary bus traffic capture (replaces the text kepler-msg.log).
+//
+// Capture() only copies the message into an in-memory buffer; the capture thread writes the buffer to file in
+// large chunks. The file is append-only: a CAPTURE_FILE_HEADER followed by records, each a CAPTURE_RECORD_HEADER,
+// DataSize bytes of payload and CommentSize bytes of comment text (not null terminated).
+// ConvertCaptureToText() (or "rundll32 DHPJ2534.dll,ConvertMsgCapture <capture file> <text file>") turns a
+// capture back into the old text format.
+
+#define KEPLER_MSG_CAPTURE_FILE L"kepler-msg.kcap"
+
+#define CAPTURE_MAGIC "KCAP"
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_BUFFER_SIZE (256 * 1024)	// per buffer, one is filled while the other is written
+#define CAPTURE_FLUSH_INTERVAL 250			// ms
+#define MAX_CAPTURE_COMMENT_SIZE 255
+
+#pragma pack(push, 1)
+
+typedef struct {
+	char Magic[4];
+	unsigned short Version;
+	unsigned short HeaderSize;			// sizeof(CAPTURE_FILE_HEADER)
+	unsigned long long StartTime;		// FILETIME (UTC) of the first capture session
+} CAPTURE_FILE_HEADER;
+
+typedef struct {
+	unsigned short RecordSize;			// header + data + comment
+	unsigned char MsgType;				// LogMessageType
+	unsigned char CommentSize;
+	unsigned long long Time;			// FILETIME (UTC) when captured
+	unsigned long Timestamp;			// PASSTHRU_MSG Timestamp
+	unsigned long ChannelId;
+	unsigned long ProtocolID;
+	unsigned long RxStatus;
+	unsigned long TxFlags;
+	unsigned long ExtraDataIndex;
+	unsigned short DataSize;
+} CAPTURE_RECORD_HEADER;
+
+#pragma pack(pop)
+
+namespace capture {
+
+	bool StartCapture();
+	void StopCapture();		// writes out what's left
+
+	void Capture(const PASSTHRU_MSG * pMsg, unsigned char msgType, unsigned long channelId, const char * comment);
+
+	bool ConvertCaptureToText(const wchar_t * capturePath, const wchar_t * textPath);
+}
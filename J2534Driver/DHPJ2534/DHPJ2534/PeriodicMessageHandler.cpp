@@ -21,127 +21,127 @@
 #include "stdafx.h"
 #include "helper.h"
 #include "PeriodicMessageHandler.h"
+#include "Kepler.h"
+#include "registry.h"
+#include <mmsystem.h>
+#include <mutex>
 
-CPeriodicMessageHandler::CPeriodicMessageHandler(void)
-{
-	pMsgNum = 0;
-	hMsgHandlerThread = NULL;
-	stopped = 0;
-}
-
-
-CPeriodicMessageHandler::~CPeriodicMessageHandler(void)
-{
-	RemoveAllPeriodicMessages();
-
-	// notify the other thread to exit gracefully
-	LOG(MAINFUNC, "CPeriodicMessageHandler::~CPeriodicMessageHandler: Signaling child thread to exit");
-	stopped = 1;
-	SetEvent(hMsgHandlerEvent);
-
-	CloseHandle(hMsgHandlerThread);
-	CloseHandle(hMsgHandlerEvent);
-}
-
-DWORD WINAPI MainMsgHandlerThreadFunction(LPVOID lpParam)
-{
-	LOG(MAINFUNC, "CPeriodicMessageHandler::MainThreadFunction");
+#pragma comment(lib, "winmm.lib")
 
-	CPeriodicMessageHandler * me = (CPeriodicMessageHandler*)lpParam;
+namespace PeriodicScheduler {
 
-	// loop until there's error
-	while (me->HandleSignal())
+	// Encodes all messages due in the same tick into one buffer and writes it with a single Kepler::Send
+	class CPeriodicBatchSender : public CTimerWheelSink
 	{
-	}
-	LOG(INIT, "CPeriodicMessageHandler::MainThreadFunction - exiting");
-	return 0;
-}
-
-
-bool CPeriodicMessageHandler::HandleSignal()
-{
-	DWORD ret;
-	LOG(HELPERFUNC, "CPeriodicMessageHandler::HandleSignal - Waiting for signal...");
-
-	ret = WaitForSingleObjectEx(hMsgHandlerEvent, INFINITE, true);
-	if (ret == WAIT_OBJECT_0)
-	{
-		LOG(HELPERFUNC, "CPeriodicMessageHandler::HandleSignal - Signaled!");
-		if (stopped)
-		{
-			// owner thread signaled us to stop
-			return false;
-		}
-		HandlerLock.Lock();
-		for (int i = 0; i<pMsgNum; i++)
+	public:
+		void TimersDue(CWheelTimer ** timers, int count)
 		{
-			if (!periodicMessages[i]->HasTimer())
+			batchLength = 0;
+			batchCount = 0;
+			for (int i = 0; i < count; i++)
 			{
-				LOG(HELPERFUNC, "CPeriodicMessageHandler::HandleSignal - Attaching timer to new periodic message #%d", i);
-				periodicMessages[i]->CreateTimer();
-				// timer handle
+				CPeriodicMsg * msg = (CPeriodicMsg *)timers[i];
+				unsigned short len;
+				int ret = msg->Encode(frame, &len);
+				if (ret != STATUS_NOERROR)
+				{
+					LOG(ERR, "PeriodicScheduler::TimersDue - msg id 0x%x could not be encoded (%d)", msg->Id(), ret);
+					continue;
+				}
+				if ((batchLength + len > PERIODIC_BATCH_BUFFER_SIZE) || (batchCount == MAX_PERIODIC_MSGS))
+					Flush();
+				if (len > PERIODIC_BATCH_BUFFER_SIZE)
+				{
+					// too big to batch, send on its own
+					if (Kepler::Send(frame, len, PERIODIC_SEND_TIMEOUT) == len)
+						msg->Sent();
+					continue;
+				}
+				memcpy(batch + batchLength, frame, len);
+				batchLength += len;
+				batchMsgs[batchCount++] = msg;
 			}
+			Flush();
 		}
 
-		// reset the event, so that WaitForSingleObject will wait again for next event signal
-		ResetEvent(hMsgHandlerEvent);
-
-		HandlerLock.Unlock();
-	}
-	else
-		if (ret == STATUS_USER_APC)
+	private:
+		void Flush()
 		{
-			//		LOG(HELPERFUNC,"CPeriodicMessageHandler::HandleSignal - one of the timers callbacks were called");
-		}
-		else
-		{
-			LOG(ERR, "CPeriodicMessageHandler::HandleSignal - Error in WaitForSingleObject: %d (ret=%d), (stopped=%d)", GetLastError(), ret, stopped);
-			return false;
+			if (batchCount == 0)
+				return;
+			LOG(PROTOCOL_VERBOSE, "PeriodicScheduler::Flush - sending %d periodic messages, %d bytes", batchCount, batchLength);
+			if (Kepler::Send(batch, (unsigned short)batchLength, PERIODIC_SEND_TIMEOUT) == (int)batchLength)
+			{
+				for (int i = 0; i < batchCount; i++)
+					batchMsgs[i]->Sent();
+			}
+			else
+				LOG(ERR, "PeriodicScheduler::Flush - sending %d periodic messages failed!", batchCount);
+			batchLength = 0;
+			batchCount = 0;
 		}
-	return true;
-}
 
-bool CPeriodicMessageHandler::createMsgHandlerThread(int channelId)
-{
-	if (hMsgHandlerThread == NULL)
-	{
-		LOG(MAINFUNC, "CPeriodicMessageHandler::createMsgHandlerhread - Creating init event object");
+		unsigned char frame[MAX_TX_FRAME_SIZE];
+		unsigned char batch[PERIODIC_BATCH_BUFFER_SIZE];
+		unsigned int batchLength;
+		CPeriodicMsg * batchMsgs[MAX_PERIODIC_MSGS];
+		int batchCount;
+	};
 
-		// create unique event name based on channel id
-		//		char eventName[64];
-		//		sprintf_s(eventName,64,"SardineMsgHandlerEvent%x",channelId);
+	CPeriodicBatchSender batchSender;
+	CTimerWheel * wheel = NULL;		// created on first use and never deleted, so nothing is joined at DLL unload
+	std::mutex schedulerLock;
 
-		hMsgHandlerEvent = CreateEventA(
-			NULL,		// default security attributes
-			TRUE,		// manual-reset event
-			FALSE,		// initial state is nonsignaled
-			NULL);		// object name
-
-		if (hMsgHandlerEvent == NULL)
+	void Add(CPeriodicMsg * msg)
+	{
+		std::lock_guard<std::mutex> guard(schedulerLock);
+		if (!wheel)
 		{
-			LOG(ERR, "CPeriodicMessageHandler::createMsgHandlerThread - CreateEvent failed (%d)\n", GetLastError());
-			return false;
+			unsigned long spinUs = DEFAULT_PERIODIC_SPIN_US;
+			DHPJ2534Registry::GetValueFromRegistry(NULL, TEXT("PERIODIC_SPIN_US"), &spinUs);
+			wheel = new CTimerWheel(&batchSender, spinUs);
 		}
-
-		LOG(MAINFUNC, "CPeriodicMessageHandler::createMsgHandlerhread - Creating thread");
-		hMsgHandlerThread = CreateThread(
-			NULL,                   // default security attributes
-			0,                      // use default stack size  
-			MainMsgHandlerThreadFunction,       // thread function name
-			(void*)this, /*pDataArray[i],*/          // argument to thread function 
-			0,                      // use default creation flags 
-			NULL); //&dwThreadIdArray[i]);   // returns the thread identifier 
-		if (hMsgHandlerThread != NULL)
+		wheel->Add(msg, 0);
+		if (!wheel->IsRunning())
 		{
-			LOG(MAINFUNC, "CPeriodicMessageHandler::createMsgHandlerhread - Creating thread success");
+			LOG(PROTOCOL, "PeriodicScheduler::Add - starting scheduler thread");
+			timeBeginPeriod(1);
+			wheel->Start();
 		}
-		else
+	}
+
+	void Remove(CPeriodicMsg * msg)
+	{
+		std::lock_guard<std::mutex> guard(schedulerLock);
+		if (!wheel)
+			return;
+		wheel->Remove(msg);
+
+		TIMER_JITTER_STATS stats;
+		wheel->GetJitterStats(msg, &stats);
+		if (stats.count)
+			LOG(PROTOCOL, "PeriodicScheduler::Remove - msg id 0x%x: sent %d times, late min %d / avg %d / max %d us, %d periods missed",
+				msg->Id(), (unsigned long)stats.count, (long)stats.minLateUs, (long)(stats.totalLateUs / (long long)stats.count), (long)stats.maxLateUs, (unsigned long)stats.missed);
+
+		// thread is stopped here and not at DLL unload, where it couldn't be joined
+		if ((wheel->Count() == 0) && wheel->IsRunning())
 		{
-			LOG(ERR, "CPeriodicMessageHandler::createMsgHandlerhread - Creating thread FAILED!");
-			return false;
+			LOG(PROTOCOL, "PeriodicScheduler::Remove - no periodic messages left, stopping scheduler thread");
+			wheel->Stop();
+			timeEndPeriod(1);
 		}
 	}
-	return true;
+}
+
+CPeriodicMessageHandler::CPeriodicMessageHandler(void)
+{
+	pMsgNum = 0;
+}
+
+
+CPeriodicMessageHandler::~CPeriodicMessageHandler(void)
+{
+	RemoveAllPeriodicMessages();
 }
 
 
@@ -158,9 +158,7 @@ int CPeriodicMessageHandler::AddPeriodicMessage(CPeriodicMsg * msg)
 
 	periodicMessages[pMsgNum] = msg;
 	pMsgNum++;
-
-	// notify our handling thread that we have new periodic message. 
-	SetEvent(hMsgHandlerEvent);
+	PeriodicScheduler::Add(msg);
 
 	HandlerLock.Unlock();
 	return STATUS_NOERROR;
@@ -172,6 +170,7 @@ void CPeriodicMessageHandler::RemoveAllPeriodicMessages()
 	HandlerLock.Lock();
 	for (int i = 0; i<pMsgNum; i++)
 	{
+		PeriodicScheduler::Remove(periodicMessages[i]);
 		delete periodicMessages[i];
 	}
 	pMsgNum = 0;
@@ -192,6 +191,7 @@ int CPeriodicMessageHandler::RemovePeriodicMessage(unsigned long Id)
 		LOG(ERR, "CPeriodicMessageHandler::RemovePeriodicMessage - didn't find msg with id 0x%x", Id);
 		return ERR_INVALID_MSG_ID;
 	}
+	PeriodicScheduler::Remove(periodicMessages[i]);
 	delete periodicMessages[i];
 	for (; i<pMsgNum - 1; i++)
 		periodicMessages[i] = periodicMessages[i + 1];
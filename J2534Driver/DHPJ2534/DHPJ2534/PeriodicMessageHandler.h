@@ -1,10 +1,22 @@
-
 #pragma once
 #include "PeriodicMsg.h"
 #include "Benaphore.h"
 
-#define MAX_PERIODIC_MSGS 10
+#define MAX_PERIODIC_MSGS 128		// per channel
+
+#define PERIODIC_BATCH_BUFFER_SIZE 8192
+#define DEFAULT_PERIODIC_SPIN_US 1000	// see CTimerWheel, PERIODIC_SPIN_US in registry
+#define PERIODIC_SEND_TIMEOUT 100
+
+// All periodic messages of all channels run on one shared timer wheel thread. Messages that are due at the same
+// time are written to the device together.
+namespace PeriodicScheduler {
+
+	void Add(CPeriodicMsg * msg);		// first one is sent right away
+	void Remove(CPeriodicMsg * msg);	// msg is not used by the scheduler anymore after this returns
+}
 
+// Periodic messages of one channel
 class CPeriodicMessageHandler
 {
 public:
@@ -12,19 +24,11 @@ public:
 	~CPeriodicMessageHandler(void);
 	int AddPeriodicMessage(CPeriodicMsg * msg);
 	int RemovePeriodicMessage(unsigned long Id);
-	bool createMsgHandlerThread(int channelId);
 	void RemoveAllPeriodicMessages();
 
-	bool HandleSignal(void);
-
-
 private:
 	CPeriodicMsg * periodicMessages[MAX_PERIODIC_MSGS];
 	int pMsgNum;
-	HANDLE hMsgHandlerThread;
-	HANDLE hMsgHandlerEvent;
 
-	int stopped;
 	Benaphore HandlerLock;
 };
-
@@ -19,32 +19,31 @@
 */
 #pragma once
 #include "kepler_defs.h"
-#include "Benaphore.h"
+#include "TimerWheel.h"
 
 class CPeriodicMsgCallback
 {
 public:
-	virtual int SendPeriodicMsg(PASSTHRU_MSG * pMsg, unsigned long Id) = 0;
+	// called from the periodic scheduler thread when the message is due. Encodes the message into a device frame
+	virtual int EncodePeriodicMsg(const PASSTHRU_MSG * pMsg, unsigned char * frame, unsigned short * len) = 0;
+	// frame has been written to the device
+	virtual void PeriodicMsgSent(const PASSTHRU_MSG * pMsg, unsigned long Id) = 0;
 };
 
-class CPeriodicMsg
+// Periodic message is a timer in the shared periodic scheduler (see PeriodicMessageHandler.h)
+class CPeriodicMsg : public CWheelTimer
 {
 public:
 	CPeriodicMsg(CPeriodicMsgCallback * Callback, unsigned long Id, unsigned long TimeInterval);
 	int AttachMessage(PASSTHRU_MSG * pMsg);
-	int CreateTimer();
-	bool HasTimer();
-	void TimerSignaled();
+	int Encode(unsigned char * frame, unsigned short * len);
+	void Sent();
 	~CPeriodicMsg(void);
 	const unsigned long Id() { return id; }
 
-	HANDLE Handle();
 private:
 	CPeriodicMsgCallback * callback;
-	HANDLE hTimer;
 	PASSTHRU_MSG * msg;
 	unsigned long id;
-	unsigned long timeInterval;
-	Benaphore lock;
+	unsigned long timeInterval;	// ms
 };
-
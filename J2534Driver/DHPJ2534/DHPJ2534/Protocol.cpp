@@ -24,28 +24,20 @@
 #include "helper.h"
 #include "Kepler.h"
 #include "shim_debug.h"
+#include "registry.h"
 #include <string.h>
 #include <new>
 #include <thread>
+#include <chrono>
 
 #define MAX_FLAGS_LEN 32
 
+// frames are routed here by Kepler only for the network types this channel registered with ListenTo()
 bool WINAPI KeplerListener(char * msg, int len, void * data)
 {
 	CProtocol * me = (CProtocol*)data;
 	if (me->IsListening())
-	{
-		
-		if (msg[3] == (char)0xaa)
-		{
-			return me->ParseMsg(msg, len);
-		}
-		else
-		{
-			LOG(ERR, "CProtocol::KeplerListener: Ignoring [%s]", msg);
-			return false;
-		}
-	}
+		return me->ParseMsg(msg, len);
 	return false;
 }
 
@@ -60,57 +52,97 @@ CProtocol::CProtocol(int ProtocolID)
 	_dummy_filter_id = 0xf1f10001;
 	rollingPeriodicMsgId = 0xbebe0001;
 
-	rxBufferSize = 0;
-	rxBufferOverflow = false;
-	hiIndex = lowIndex = 0;
+	// message slots for received messages are allocated once here, depth can be tuned with RX_BUFFER_DEPTH in registry
+	unsigned long rxDepth = DEFAULT_RX_BUFFER_DEPTH;
+	DHPJ2534Registry::GetValueFromRegistry(NULL, TEXT("RX_BUFFER_DEPTH"), &rxDepth);
+	rxRing = new CRxRing(rxDepth);
+	rxWaitCount = 0;
+	if ((rxEvent = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL)
+		LOG(ERR, "CProtocol::CProtocol - Create 'RX Event' failed (%d)", GetLastError());
+
 	datarate = SARDINE_DEFAULT_CAN_BAUD_RATE;
 	listening = false;
 	loopback = false;
-	Kepler::RegisterListener((LPKEPLERLISTENER)KeplerListener, this);
 	periodicMsgHandler = NULL;
-	//std::thread SenderThraed(std::bind(&CProtocol::SendMessages, this));
+
+	txQueuedSeq = 0;
+	txSentSeq = 0;
+	txFailedSeq = 0;
+	txStop = false;
 }
 
 CProtocol::~CProtocol(void)
 {
-	Kepler::RemoveListener((LPKEPLERLISTENER)KeplerListener);
+	StopTXThread();
+	Kepler::RemoveListener((LPKEPLERLISTENER)KeplerListener, this);
 	if (periodicMsgHandler)
 		delete periodicMsgHandler;
-	
+	delete rxRing;
+	if (rxEvent)
+		CloseHandle(rxEvent);
 }
 
-// callback from CPeriodicMsgCallback, when timer has gone off in one of CPeriodicMsg instances
-int CProtocol::SendPeriodicMsg(PASSTHRU_MSG * pMsg, unsigned long Id)
+// callback from CPeriodicMsgCallback, when one of CPeriodicMsg instances is due
+int CProtocol::EncodePeriodicMsg(const PASSTHRU_MSG * pMsg, unsigned char * frame, unsigned short * len)
 {
-	LOG(PROTOCOL, "CProtocol::SendPeriodicMsg: msg id 0x%x", Id);
 	if (!IsConnected())
 	{
-		LOG(ERR, "CProtocol::SendPeriodicMsg - not connected!");
+		LOG(ERR, "CProtocol::EncodePeriodicMsg - not connected!");
 		return ERR_DEVICE_NOT_CONNECTED;
 	}
-	while (!Kepler::ready)
-	{
+	return EncodeFrame(pMsg, frame, len);
+}
 
+// callback from CPeriodicMsgCallback, after the periodic message has been written to the device
+void CProtocol::PeriodicMsgSent(const PASSTHRU_MSG * pMsg, unsigned long Id)
+{
+	LOG(PROTOCOL_VERBOSE, "CProtocol::PeriodicMsgSent: msg id 0x%x", Id);
+	if (IsLoopback())
+	{
+		PASSTHRU_MSG loopbackMsg;
+		CopyPassThruMsg(&loopbackMsg, pMsg);
+		loopbackMsg.RxStatus = TX_MSG_TYPE;
+		loopbackMsg.ExtraDataIndex = loopbackMsg.DataSize;
+		loopbackMsg.Timestamp = GetTime();
+		AddToRXBuffer(&loopbackMsg);
 	}
-	// Write message (blocking)
-	return WriteMsg(pMsg, 0);
 }
 
-bool CProtocol::ParseMsg(char * msg, int len)
+int CProtocol::WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout)
 {
-	PASSTHRU_MSG * pMsg = new (std::nothrow) PASSTHRU_MSG;
+	unsigned char frame[MAX_TX_FRAME_SIZE];
+	unsigned short len = 0;
+	int ret = EncodeFrame(pMsg, frame, &len);
+	if (ret != STATUS_NOERROR)
+		return ret;
+	return QueueFrame(frame, len, pMsg, Timeout);
+}
 
-	if (!pMsg)
+int CProtocol::ListenTo(unsigned char networkType)
+{
+	return Kepler::RegisterListener((LPKEPLERLISTENER)KeplerListener, this, KEPLER_NETWORK_MESSAGE, networkType);
+}
+
+bool CProtocol::ParseMsg(char * msg, int len)
+{
+	if ((len < 5) || (len - 5 > (int)sizeof(((PASSTHRU_MSG*)0)->Data)))
 	{
-		LOG(ERR, "Cprotocol:ParseMsg - Could not create PASSTHU_MSG object. Out of memory!");
+		LOG(ERR, "CProtocol::ParseMsg - invalid frame length %d", len);
 		return false;
 	}
 
-	memcpy(pMsg->Data, msg+4, len - 5);
+	// Built here and copied into the receive ring once accepted, so that the ring's writer lock isn't held while
+	// HandleMsg and LogMessage run. Only the used part of Data is copied.
+	PASSTHRU_MSG msgBuf;
+	PASSTHRU_MSG * pMsg = &msgBuf;
+
+	// skip START_BYTE, LenH, LenL, command byte and network type
+	memcpy(pMsg->Data, msg + 5, len - 5);
 	pMsg->DataSize = len - 5;
-	pMsg->Timestamp = GetTime();
+	pMsg->Timestamp = Kepler::FrameTime();
 	pMsg->ProtocolID = this->protocolID;
 	pMsg->RxStatus = 0;
+	pMsg->TxFlags = 0;
 	pMsg->ExtraDataIndex = pMsg->DataSize;
 	
 	char flags[MAX_FLAGS_LEN + 1];
@@ -119,7 +151,12 @@ bool CProtocol::ParseMsg(char * msg, int len)
 		{
 			LOG(PROTOCOL, "CProtocol::ParseMsg: Message accepted - adding to rx buffer");
 			LogMessage(pMsg, RECEIVED, channelId, "");
-			AddToRXBuffer(pMsg);
+			if (rxRing->Push(pMsg) != STATUS_NOERROR)
+			{
+				LOG(ERR, "CProtocol::ParseMsg - receive buffer full, message lost!");
+				return false;
+			}
+			SignalRXWaiter();
 		}
 		else
 		{
@@ -128,13 +165,10 @@ bool CProtocol::ParseMsg(char * msg, int len)
 			if ((pMsg->ProtocolID == J1850VPW) || (pMsg->ProtocolID == J1850VPW))
 			{
 				LogMessage(pMsg, ISO15765_RECV, channelId, " ignored before final assembly");
-				// ISO15765 handler copied the contents from this msg. We can delete this, since we don't push it to rxbuffer 
-				delete pMsg;
 			}
 			else
 			{
 				// not handled by this protocol, do not log.
-				delete pMsg;
 				return false;
 			}
 		}
@@ -195,101 +229,267 @@ void CProtocol::SetToListen(bool listen)
 void CProtocol::ClearRXBuffer()
 {
 	LOG(PROTOCOL, "CProtocol::ClearRXBuffer");
-	rx_lock.Lock();
-	rxBufferOverflow = false;
-	lowIndex = 0;
-	hiIndex = 0;
-	rxBufferSize = 0;
-	rx_lock.Unlock();
+	rxRing->Clear();
 }
 
 void CProtocol::ClearTXBuffer()
 {
-	LOG(PROTOCOL, "CProtocol::ClearTXBuffer -- FIXME: not implemented!---");
+	LOG(PROTOCOL, "CProtocol::ClearTXBuffer");
+	std::lock_guard<std::mutex> guard(tx_lock);
+
+	size_t cleared = txBuffer.size();
+	while (!txBuffer.empty())
+	{
+		FreeTXQueueMessage(txBuffer.front());
+		txBuffer.pop();
+	}
+	if (cleared > 0)
+	{
+		LOG(PROTOCOL, "CProtocol::ClearTXBuffer - %d messages removed from queue", (int)cleared);
+		// release WriteMsgs callers waiting for cleared messages. They never made it to the wire
+		txSentSeq = txQueuedSeq;
+		txFailedSeq = txQueuedSeq;
+		txSent.notify_all();
+	}
 }
 
-int CProtocol::DoAddToRXBuffer(PASSTHRU_MSG * pMsg)
+void CProtocol::FreeTXQueueMessage(TX_QUEUE_MESSAGE * pMsg)
 {
-	if (rxBufferSize >= MAX_RX_BUFFER_SIZE)
+	delete[] pMsg->data;
+	delete pMsg->loopback;
+	delete pMsg;
+}
+
+int CProtocol::QueueFrame(unsigned char * frame, unsigned short len, const PASSTHRU_MSG * pMsg, unsigned long Timeout)
+{
+	LOG(PROTOCOL_VERBOSE, "CProtocol::QueueFrame - %d bytes", len);
+
+	TX_QUEUE_MESSAGE * txMsg = new (std::nothrow) TX_QUEUE_MESSAGE;
+	if (!txMsg)
 	{
-		LOG(ERR, "CProtocol::DoAddToRXBuffer -- buffer overflow!---");
-		rxBufferOverflow = true;
+		LOG(ERR, "CProtocol::QueueFrame - Could not create TX_QUEUE_MESSAGE object. Out of memory!");
+		return ERR_FAILED;
+	}
+	txMsg->data = new (std::nothrow) char[len];
+	txMsg->flags = NULL;
+	txMsg->dataLength = len;
+	txMsg->timeout = Timeout;
+	txMsg->sequence = 0;
+	txMsg->loopback = NULL;
 
-		// we get rid of our oldest message
-		PASSTHRU_MSG * oldMsg = rxbuffer[lowIndex];
-		delete oldMsg;
-		lowIndex++;
-		lowIndex %= MAX_RX_BUFFER_SIZE;
+	if (!txMsg->data)
+	{
+		LOG(ERR, "CProtocol::QueueFrame - Could not allocate memory for frame. Out of memory!");
+		FreeTXQueueMessage(txMsg);
+		return ERR_FAILED;
+	}
+	memcpy(txMsg->data, frame, len);
 
-		rxbuffer[hiIndex] = pMsg;
-		hiIndex++;
-		hiIndex %= MAX_RX_BUFFER_SIZE;
-		return ERR_BUFFER_OVERFLOW;
+	if (IsLoopback())
+	{
+		txMsg->loopback = new (std::nothrow) PASSTHRU_MSG;
+		if (!txMsg->loopback)
+		{
+			LOG(ERR, "CProtocol::QueueFrame - Could not create loopback message. Out of memory!");
+			FreeTXQueueMessage(txMsg);
+			return ERR_FAILED;
+		}
+		CopyPassThruMsg(txMsg->loopback, pMsg);
+		txMsg->loopback->RxStatus = TX_MSG_TYPE;
+		txMsg->loopback->ExtraDataIndex = txMsg->loopback->DataSize;
 	}
-	else
+
+	if (!AddMsgToQueue(txMsg))
+	{
+		FreeTXQueueMessage(txMsg);
+		return ERR_BUFFER_FULL;
+	}
+	return STATUS_NOERROR;
+}
+
+bool CProtocol::AddMsgToQueue(TX_QUEUE_MESSAGE * pMsg)
+{
+	std::lock_guard<std::mutex> guard(tx_lock);
+	if (txBuffer.size() >= MAX_TX_BUFFER_SIZE)
+	{
+		LOG(ERR, "CProtocol::AddMsgToQueue -- transmit queue full!---");
+		return false;
+	}
+	pMsg->sequence = ++txQueuedSeq;
+	txBuffer.push(pMsg);
+	txQueued.notify_one();
+	return true;
+}
+
+void CProtocol::StartTXThread()
+{
+	LOG(PROTOCOL, "CProtocol::StartTXThread");
+	txStop = false;
+	txThread = std::thread(&CProtocol::SendMessages, this);
+}
+
+void CProtocol::StopTXThread()
+{
+	if (!txThread.joinable())
+		return;
+
+	LOG(PROTOCOL, "CProtocol::StopTXThread");
+	{
+		std::lock_guard<std::mutex> guard(tx_lock);
+		txStop = true;
+	}
+	txQueued.notify_one();
+	txThread.join();
+
+	// whatever was still queued is not going to be sent anymore
+	ClearTXBuffer();
+}
+
+// Writer thread. Everything queued at the moment is packed into one buffer and sent with a single write,
+// so a WriteMsgs batch costs one USB transaction instead of one per frame. Firmware handles several commands per packet.
+void CProtocol::SendMessages()
+{
+	LOG(PROTOCOL, "CProtocol::SendMessages - writer thread started for channel %d", channelId);
+
+	TX_QUEUE_MESSAGE * batch[MAX_TX_COALESCE_MSGS];
+	unsigned char coalesceBuffer[TX_COALESCE_BUFFER_SIZE];
+
+	std::unique_lock<std::mutex> lock(tx_lock);
+	while (!txStop)
+	{
+		if (txBuffer.empty())
+		{
+			txQueued.wait(lock);
+			continue;
+		}
+
+		// frames are never bigger than the coalesce buffer, so the first one always fits
+		int batchCount = 0;
+		unsigned int batchLength = 0;
+		unsigned long timeout = 0;
+		while (!txBuffer.empty() && (batchCount < MAX_TX_COALESCE_MSGS) && (batchLength + txBuffer.front()->dataLength <= TX_COALESCE_BUFFER_SIZE))
+		{
+			TX_QUEUE_MESSAGE * txMsg = txBuffer.front();
+			txBuffer.pop();
+			memcpy(coalesceBuffer + batchLength, txMsg->data, txMsg->dataLength);
+			batchLength += txMsg->dataLength;
+			if (txMsg->timeout > timeout)
+				timeout = txMsg->timeout;
+			batch[batchCount++] = txMsg;
+		}
+		lock.unlock();
+
+		LOG(PROTOCOL_VERBOSE, "CProtocol::SendMessages - sending %d frames, %d bytes", batchCount, batchLength);
+		bool sent = (Kepler::Send(coalesceBuffer, (unsigned short)batchLength, timeout) == (int)batchLength);
+		if (!sent)
+		{
+			LOG(ERR, "CProtocol::SendMessages - sending messages #%d-#%d failed!", batch[0]->sequence, batch[batchCount - 1]->sequence);
+		}
+
+		unsigned long sequence = batch[batchCount - 1]->sequence;
+		for (int i = 0; i < batchCount; i++)
+		{
+			if (sent && batch[i]->loopback)
+			{
+				batch[i]->loopback->Timestamp = GetTime();
+				AddToRXBuffer(batch[i]->loopback);
+			}
+			FreeTXQueueMessage(batch[i]);
+		}
+
+		lock.lock();
+		// ClearTXBuffer may already have moved txSentSeq past these messages
+		if ((long)(sequence - txSentSeq) > 0)
+			txSentSeq = sequence;
+		if (!sent)
+			txFailedSeq = sequence;
+		txSent.notify_all();
+	}
+	LOG(PROTOCOL, "CProtocol::SendMessages - writer thread exiting");
+}
+
+int CProtocol::WaitForTXComplete(unsigned long firstSeq, unsigned long lastSeq, unsigned long * pNumMsgs, unsigned long Timeout)
+{
+	std::unique_lock<std::mutex> lock(tx_lock);
+	bool done = txSent.wait_for(lock, std::chrono::milliseconds(Timeout), [&] { return (long)(txSentSeq - lastSeq) >= 0; });
+	if (!done)
 	{
-		rxbuffer[hiIndex] = pMsg;
-		hiIndex++;
-		hiIndex %= MAX_RX_BUFFER_SIZE;
-		rxBufferSize++;
+		unsigned long sent = ((long)(txSentSeq - firstSeq) >= 0) ? txSentSeq - firstSeq + 1 : 0;
+		if (sent < *pNumMsgs)
+			*pNumMsgs = sent;
+		LOG(ERR, "CProtocol::WaitForTXComplete - timeout, only %d messages sent", *pNumMsgs);
+		return ERR_TIMEOUT;
+	}
+	if ((long)(txFailedSeq - firstSeq) >= 0)
+	{
+		LOG(ERR, "CProtocol::WaitForTXComplete - some of the messages were not sent!");
+		return ERR_FAILED;
 	}
 	return STATUS_NOERROR;
 }
 
-int CProtocol::AddToRXBuffer(PASSTHRU_MSG * pMsg)
+int CProtocol::AddToRXBuffer(const PASSTHRU_MSG * pMsg)
 {
 	LOG(PROTOCOL, "CProtocol::AddToRXBuffer");
-	rx_lock.Lock();
-	unsigned int ret = DoAddToRXBuffer(pMsg);
-	rx_lock.Unlock();
+	int ret = rxRing->Push(pMsg);
+	if (ret == STATUS_NOERROR)
+		SignalRXWaiter();
 	return ret;
 }
 
-void CProtocol::SetRXBufferOverflow(bool status)
+void CProtocol::SignalRXWaiter()
 {
-	rx_lock.Lock();
-	LOG(HELPERFUNC, "CProtocol::SetRXBufferOverflow %d", status);
-	rxBufferOverflow = status;
-	rx_lock.Unlock();
+	// publishing the message must be visible before we look at the waiter, otherwise ReadMsgs could miss the wakeup
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	unsigned long waitCount = rxWaitCount.load();
+	if ((waitCount > 0) && (rxRing->Count() >= waitCount))
+		SetEvent(rxEvent);
 }
 
-int CProtocol::GetRXMessageCount()
+unsigned long CProtocol::WaitForRXMessages(unsigned long numMsgs, unsigned long Timeout)
 {
-	rx_lock.Lock();
-	LOG(HELPERFUNC, "CProtocol::GetRXMessageCount: %d", rxBufferSize);
+	ULONGLONG deadline = GetTickCount64() + Timeout;
+	unsigned long count;
 
-	if ((rxBufferSize == ((hiIndex - lowIndex) % MAX_RX_BUFFER_SIZE)) == 0)
+	rxWaitCount.store(numMsgs);
+	while ((count = GetRXMessageCount()) < numMsgs)
 	{
-		LOG(ERR, "CProtocol::GetRXMessageCount: %d", rxBufferSize);
-		LOG(ERR, "CProtocol::GetRXMessageCount: hiIndex %d", hiIndex);
-		LOG(ERR, "CProtocol::GetRXMessageCount: lowIndex %d", lowIndex);
+		ULONGLONG now = GetTickCount64();
+		if ((now >= deadline) || (rxEvent == NULL))
+			break;
+		// a stale signal from earlier wait just makes us check the count again
+		WaitForSingleObject(rxEvent, (DWORD)(deadline - now));
 	}
+	rxWaitCount.store(0);
+	return count;
+}
 
-	assert(rxBufferSize == ((hiIndex - lowIndex) % MAX_RX_BUFFER_SIZE));	// sanity check
-	int s = rxBufferSize;
-	rx_lock.Unlock();
+void CProtocol::SetRXBufferOverflow(bool status)
+{
+	LOG(HELPERFUNC, "CProtocol::SetRXBufferOverflow %d", status);
+	rxRing->SetOverflow(status);
+}
+
+int CProtocol::GetRXMessageCount()
+{
+	int s = rxRing->Count();
+	LOG(HELPERFUNC, "CProtocol::GetRXMessageCount: %d", s);
 	return s;
 }
 
-PASSTHRU_MSG * CProtocol::PopMessage()
+bool CProtocol::PopMessage(PASSTHRU_MSG * pDest)
 {
 	LOG(PROTOCOL, "CProtocol::PopMessage");
-	rx_lock.Lock();
-	PASSTHRU_MSG * msg = rxbuffer[lowIndex++];
-	lowIndex %= MAX_RX_BUFFER_SIZE;
-	rxBufferSize--;
-	rxBufferOverflow = false;
-	rx_lock.Unlock();
-	return msg;
+	if (!rxRing->Pop(pDest))
+		return false;
+	rxRing->SetOverflow(false);
+	return true;
 }
 
 bool CProtocol::IsRXBufferOverflow()
 {
-	rx_lock.Lock();
 	LOG(HELPERFUNC, "CProtocol::IsBufferOverflow");
-	bool rxoverflow = rxBufferOverflow;
-	rx_lock.Unlock();
-	return rxoverflow;
+	return rxRing->IsOverflow();
 }
 
 bool CProtocol::IsConnected()
@@ -310,10 +510,16 @@ int CProtocol::WriteMsgs(PASSTHRU_MSG * pMsgs, unsigned long * pNumMsgs, unsigne
 
 	if (*pNumMsgs > MAX_J2534_MESSAGES)
 	{
-		LOG(ERR, "CProtocol::WriteMsgs - tried sending too many messages (according to specs limit is 10)");
+		LOG(ERR, "CProtocol::WriteMsgs - tried sending too many messages (limit is %d)", MAX_J2534_MESSAGES);
 		return ERR_EXCEEDED_LIMIT;
 	}
 
+	unsigned long firstSeq;
+	{
+		std::lock_guard<std::mutex> guard(tx_lock);
+		firstSeq = txQueuedSeq + 1;
+	}
+
 	for (unsigned int i = 0; i<*pNumMsgs; i++)
 	{
 		PASSTHRU_MSG * curr_msg = &pMsgs[i];
@@ -330,12 +536,28 @@ int CProtocol::WriteMsgs(PASSTHRU_MSG * pMsgs, unsigned long * pNumMsgs, unsigne
 		if (err != STATUS_NOERROR)
 		{
 			LOG(ERR, "CPRotocol::WriteMsgs - error while writing msg -> aborting!");
+			*pNumMsgs = i;
 			return err;
 		}
 
 	}
-	LOG(PROTOCOL_VERBOSE, "CProtocol::WriteMsgs: writing %d messages successful!", *pNumMsgs);
-	return STATUS_NOERROR;
+
+	// Timeout 0: messages are queued and we return immediately, as specified in J2534-1
+	if (Timeout == 0)
+	{
+		LOG(PROTOCOL_VERBOSE, "CProtocol::WriteMsgs: %d messages queued", *pNumMsgs);
+		return STATUS_NOERROR;
+	}
+
+	unsigned long lastSeq;
+	{
+		std::lock_guard<std::mutex> guard(tx_lock);
+		lastSeq = txQueuedSeq;
+	}
+	err = WaitForTXComplete(firstSeq, lastSeq, pNumMsgs, Timeout);
+	if (err == STATUS_NOERROR)
+		LOG(PROTOCOL_VERBOSE, "CProtocol::WriteMsgs: writing %d messages successful!", *pNumMsgs);
+	return err;
 }
 
 int CProtocol::GetIOCTLParam(SCONFIG * pConfig)
@@ -535,12 +757,7 @@ int CProtocol::Connect(unsigned long _channelId, unsigned long Flags, unsigned l
 	if (periodicMsgHandler == NULL)
 		return ERR_FAILED;
 
-	if (!periodicMsgHandler->createMsgHandlerThread(channelId))
-	{
-		delete periodicMsgHandler;
-		periodicMsgHandler = NULL;
-		return ERR_FAILED;
-	}
+	StartTXThread();
 
 	/*if (CInterceptor::UseInterceptor())
 	{
@@ -564,6 +781,7 @@ int CProtocol::Disconnect()
 	// Delete existing message filters for this protocol and stop periodic messages, as specified in J2534-1
 	StopPeriodicMessages();
 	DeleteFilters();
+	StopTXThread();
 
 	delete periodicMsgHandler;
 	periodicMsgHandler = NULL;
@@ -576,12 +794,11 @@ int CProtocol::DoReadMsgs(PASSTHRU_MSG * pMsgs, unsigned int count, bool overflo
 	for (unsigned int i = 0; i<count; i++)
 	{
 		LOG(PROTOCOL_VERBOSE, "CProtocol::DoReadMsg - reading msg #%d", i);
-		PASSTHRU_MSG * curr_msg = PopMessage();
-	//	dbug_printmsg(curr_msg, _T("ReadMsg"), 1, false);
-		PASSTHRU_MSG * pDestMsg = &pMsgs[i];
-		LOG(PROTOCOL_VERBOSE, "CProtocol::DoReadMsg - copying msg #%d", i);
-		memcpy(pDestMsg, curr_msg, sizeof(PASSTHRU_MSG));
-		
+		if (!PopMessage(&pMsgs[i]))
+		{
+			LOG(ERR, "CProtocol::DoReadMsg - buffer emptied while reading msg #%d", i);
+			break;
+		}
 	}
 	if (overflow)
 	{
@@ -622,18 +839,20 @@ int CProtocol::ReadMsgs(PASSTHRU_MSG * pMsgs, unsigned long * pNumMsgs, unsigned
 	}
 	else
 	{
-		LOG(PROTOCOL_VERBOSE, "CProtocol::ReadMsgs: sleeping for %d milliseconds while waiting for new messages", Timeout);
-		// sleep here
-		SleepEx(Timeout, FALSE);	// FIXME: need better time handling: sleep MAXIMUM of timeout, in case enough messages will come before that
-		count = GetRXMessageCount();
+		LOG(PROTOCOL_VERBOSE, "CProtocol::ReadMsgs: waiting max %d milliseconds for %d messages", Timeout, *pNumMsgs);
+		// returns as soon as enough messages have arrived
+		count = WaitForRXMessages(*pNumMsgs, Timeout);
 		if (count>0)
 		{
 			// read MIN(*pNumMsgs,count) messages
 			*pNumMsgs = (count > *pNumMsgs) ? *pNumMsgs : count;
-			return DoReadMsgs(pMsgs, *pNumMsgs, overflow);
+			return DoReadMsgs(pMsgs, *pNumMsgs, IsRXBufferOverflow());
 		}
 		else
+		{
+			*pNumMsgs = 0;
 			return ERR_BUFFER_EMPTY;
+		}
 	}
 	// we shouldn't reach this
 	LOG(PROTOCOL_VERBOSE, "CProtocol::ReadMsgs: Shouldn't hit this... ever...", Timeout); 
@@ -641,31 +860,11 @@ int CProtocol::ReadMsgs(PASSTHRU_MSG * pMsgs, unsigned long * pNumMsgs, unsigned
 	return ERR_NOT_SUPPORTED;
 }
 
-bool WINAPI KeplerSystemListener(char *msg, int len, void *data)
-{
-	CProtocol * me = (CProtocol*)data;
-	if (me->IsListening())
-	{
-
-		if (msg[3] == (char)0xC0 || msg[3] == (char)0xEF)
-		{
-			return me->SetFilterSuccess(msg, len);
-		}
-		else
-		{
-			LOG(ERR, "CProtocol::KeplerSystemListener: Ignoring [%s]", msg);
-			return false;
-		}
-	}
-	return false;
-}
-
 int CProtocol::StartMsgFilter(unsigned long FilterType, PASSTHRU_MSG * pMaskMsg, PASSTHRU_MSG * pPatternMsg, PASSTHRU_MSG * pFlowControlMsg, unsigned long * pFilterID)
 {
 	char tmpFilterType;
 	unsigned char * FilterMessage;
 	USHORT FilterMessageLength;
-	FilterSetSuccessfull = 0;
 	LOG(PROTOCOL_MSG, "CProtocolJ1850VPW::StartMsgFilter - Attempting to set a message filter");
 	LOG(PROTOCOL_MSG, "CProtocolJ1850VPW::StartMsgFilter - FilterType: %d", FilterType);
 
@@ -678,11 +877,6 @@ int CProtocol::StartMsgFilter(unsigned long FilterType, PASSTHRU_MSG * pMaskMsg,
 	LogMessage(pMaskMsg, FILTER, 1, "Filter Mask");
 	LogMessage(pPatternMsg, FILTER, 1, "Pattern message");
 
-	LOG(PROTOCOL_MSG, "CProtocolJ1850VPW::StartMsgFilter - Registering system listener");
-
-
-	Kepler::RegisterListener((LPKEPLERLISTENER)KeplerSystemListener, this);
-
 	if (FilterType == 1)
 	{
 		tmpFilterType = 1;
@@ -721,25 +915,20 @@ int CProtocol::StartMsgFilter(unsigned long FilterType, PASSTHRU_MSG * pMaskMsg,
 		memset(FilterMessage + 7 + pMaskMsg->DataSize + pMaskMsg->DataSize, 0x00, pMaskMsg->DataSize);
 	}
 
-	Kepler::Send(FilterMessage, FilterMessageLength, 1000);
-
-	LOG(PROTOCOL_MSG, "CProtocolJ1850VPW::StartMsgFilter - Waiting for response FIXME: ADD TIMEOUT HERE (ProtocolJ1850VPW.cpp L177)");
+	LOG(PROTOCOL_MSG, "CProtocolJ1850VPW::StartMsgFilter - Waiting for response");
 
-
-	//TODO: Add timeout here
-	while (FilterSetSuccessfull == 0);
-
-	if (FilterSetSuccessfull == 2)
+	// device answers with 0xC0 0x01 on success, or with an error frame
+	char response[8];
+	int responseLen = 0;
+	int ret = Kepler::Request(FilterMessage, FilterMessageLength, 0xC0, KEPLER_DEFAULT_REQUEST_TIMEOUT, response, &responseLen);
+	if ((ret != KEPLER_REQUEST_OK) || (responseLen < 5) || (response[4] != 0x01))
 	{
-		LOG(PROTOCOL_MSG, "CProtocolJ1850VPW::StartMsgFilter - Failed");
-
-		return ERR_FAILED;
+		LOG(PROTOCOL_MSG, "CProtocolJ1850VPW::StartMsgFilter - Failed (%d)", ret);
+		delete[] FilterMessage;
+		return (ret == KEPLER_REQUEST_TIMEOUT) ? ERR_TIMEOUT : ERR_FAILED;
 	}
 	LOG(PROTOCOL_MSG, "CProtocolJ1850VPW::StartMsgFilter - Success");
 
-	LOG(PROTOCOL_MSG, "CProtocolJ1850VPW::StartMsgFilter - Removing system listener");
-	Kepler::RemoveListener((LPKEPLERLISTENER)KeplerSystemListener);
-
 	FilterMessage[0] = 0x02;
 	FilterMessage[1] = ((FilterMessageLength - 8) & 0xFF00) >> 8;
 	FilterMessage[2] = (FilterMessageLength - 8) & 0x00FF;
@@ -750,29 +939,11 @@ int CProtocol::StartMsgFilter(unsigned long FilterType, PASSTHRU_MSG * pMaskMsg,
 	memcpy(FilterMessage + 6 + pMaskMsg->DataSize, pPatternMsg->Data, pPatternMsg->DataSize);
 
 	Kepler::Send(FilterMessage, 14, 1000);
+	delete[] FilterMessage;
 
 	return STATUS_NOERROR;
 }
 
-bool CProtocol::SetFilterSuccess(char * msg, int len)
-{
-	if (msg[3] == (char)0xC0 && msg[4] == (char)0x01)
-	{
-		LOG(ERR, "CProtocol::SetFilterSuccess: Sucess");
-		FilterSetSuccessfull = 1;
-		return true;
-	}
-
-	if (msg[3] == (char)0xEF)
-	{
-		LOG(ERR, "CProtocol::SetFilterSuccess: Error!");
-		FilterSetSuccessfull = 2;
-		return true;
-	}
-
-	return false;
-}
-
 int CProtocol::StopMsgFilter(unsigned long FilterID)
 {
 	LOG(PROTOCOL, "CProtocol::StopMsgFilter - filter id 0x%x", FilterID);
@@ -4,10 +4,16 @@
 #include "Benaphore.h"
 #include "PeriodicMsg.h"
 #include "PeriodicMessageHandler.h"
+#include "RxRing.h"
 #include <queue>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
-#define MAX_RX_BUFFER_SIZE 256
 #define MAX_TX_BUFFER_SIZE 256
+#define TX_COALESCE_BUFFER_SIZE 8192	// must fit the largest single frame
+#define MAX_TX_COALESCE_MSGS 64
 
 
 class CProtocol : CPeriodicMsgCallback
@@ -23,24 +29,29 @@ public:
 	virtual int WriteMsgs(PASSTHRU_MSG * pMsg, unsigned long * pNumMsgs, unsigned long Timeout);
 	virtual int StartPeriodicMsg(PASSTHRU_MSG * pMsg, unsigned long * pMsgID, unsigned long TimeInterval);
 	virtual int StopPeriodicMsg(unsigned long MsgID);
-	int StartMsgFilter(unsigned long FilterType, PASSTHRU_MSG * pMaskMsg, PASSTHRU_MSG * pPatternMsg, PASSTHRU_MSG * pFlowControlMsg, unsigned long * pFilterID);
-	bool SetFilterSuccess(char * msg, int len);
+	virtual int StartMsgFilter(unsigned long FilterType, PASSTHRU_MSG * pMaskMsg, PASSTHRU_MSG * pPatternMsg, PASSTHRU_MSG * pFlowControlMsg, unsigned long * pFilterID);
 	virtual int StopMsgFilter(unsigned long FilterID);
 	virtual int IOCTL(unsigned long IoctlID, void *pInput, void *pOutput);
 
-	// Higher level function will interpret the message
+	// Higher level function will interpret the message. Called on the comm thread with a message that isn't in the
+	// receive ring yet, it is only added if this returns true.
 	virtual bool HandleMsg(PASSTHRU_MSG * pMsg, char * flags) = 0;
 
 	// --- Message writing functions ---
 
-	// higher level function provides the necessary flags for constructing message, then calls DoWriteMsg below
-	virtual int WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout) = 0;
-	
-	bool AddMsgToQueue(TX_QUEUE_MESSAGE *pMsg);
+	// encodes the message with EncodeFrame and queues it with QueueFrame
+	int WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout);
+
+	// higher level protocol encodes the message into a device frame of at most MAX_TX_FRAME_SIZE bytes
+	virtual int EncodeFrame(const PASSTHRU_MSG * pMsg, unsigned char * frame, unsigned short * len) = 0;
+
+	// Copies the encoded frame (and pMsg for loopback) to the transmit queue. Frame is sent by the writer thread.
+	int QueueFrame(unsigned char * frame, unsigned short len, const PASSTHRU_MSG * pMsg, unsigned long Timeout);
+	bool AddMsgToQueue(TX_QUEUE_MESSAGE *pMsg);	// takes ownership
 
 	// receive buffer handlers
-	PASSTHRU_MSG * PopMessage();			// releases ownership
-	int AddToRXBuffer(PASSTHRU_MSG * pMsg);	// takes ownership
+	bool PopMessage(PASSTHRU_MSG * pDest);			// copies oldest message to pDest
+	int AddToRXBuffer(const PASSTHRU_MSG * pMsg);	// copies the message into a free slot
 	void ClearRXBuffer();
 	void ClearTXBuffer();
 
@@ -64,13 +75,16 @@ public:
 	int SetJ1962Pins(unsigned long pin1, unsigned long pin2);
 	int GetJ1962Pins(unsigned long * pin1, unsigned long * pin2);
 
+	int ListenTo(unsigned char networkType);	// route received frames of this network type (KEPLER_NET_*) to ParseMsg
 	bool ParseMsg(char * msg, int len);
 
 	PASSTHRU_MSG * DoParseSardineMsg(char * msg, int len, char * flags);
 	PASSTHRU_MSG * DoParseUSBCANMsg(char * msg, int len, char * flags);
 
-	// callback from CPeriodicMsgCallback, when timer has gone off in one of CPeriodicMsg instances
-	int SendPeriodicMsg(PASSTHRU_MSG * pMsg, unsigned long Id);
+	// callbacks from CPeriodicMsgCallback, called from the periodic scheduler thread. Periodic frames are written
+	// by the scheduler directly and don't go through the transmit queue
+	int EncodePeriodicMsg(const PASSTHRU_MSG * pMsg, unsigned char * frame, unsigned short * len);
+	void PeriodicMsgSent(const PASSTHRU_MSG * pMsg, unsigned long Id);
 
 	// callback from CInterceptorCallback. Used when we are sending reactive loopback messages signaled by intercepted message
 	// Message is handled as a normal message received 
@@ -89,21 +103,37 @@ private:
 	// Create copy of the outgoing message and put it in the receiving buffer
 	int AddLoopbackMsg(PASSTHRU_MSG * pMsg); // doesn't take ownership
 
-	int DoAddToRXBuffer(PASSTHRU_MSG * pMsg);	// takes ownership
-	
+	// transmit queue
+	void SendMessages();						// writer thread
+	void StartTXThread();
+	void StopTXThread();
+	int WaitForTXComplete(unsigned long firstSeq, unsigned long lastSeq, unsigned long * pNumMsgs, unsigned long Timeout);
+	static void FreeTXQueueMessage(TX_QUEUE_MESSAGE * pMsg);
+
+	// Blocks until at least numMsgs messages are in receive buffer or Timeout (ms) has passed. Returns message count.
+	unsigned long WaitForRXMessages(unsigned long numMsgs, unsigned long Timeout);
+	// Wakes up ReadMsgs if it's waiting and enough messages have arrived. Called after every message added to receive buffer.
+	void SignalRXWaiter();
+
 
 	CPeriodicMessageHandler * periodicMsgHandler;
 
 	int protocolID;
 	Benaphore rx_lock;
-	Benaphore tx_lock;
-	PASSTHRU_MSG * rxbuffer[MAX_RX_BUFFER_SIZE];
-	//PASSTHRU_MSG * txbuffer[MAX_RX_BUFFER_SIZE];
-	std::queue<PASSTHRU_MSG*> txBuffer;
-
-	int lowIndex, hiIndex;
-	int rxBufferSize;
-	bool rxBufferOverflow;
+	CRxRing * rxRing;
+	HANDLE rxEvent;							// auto-reset, signaled when ReadMsgs waiter has enough messages
+	std::atomic<unsigned long> rxWaitCount;	// number of messages ReadMsgs is waiting for, 0 if nobody is waiting
+
+	std::mutex tx_lock;							// guards everything below up to txStop
+	std::condition_variable txQueued;			// writer thread waits for new messages
+	std::condition_variable txSent;				// WriteMsgs waits for its messages to be on the wire
+	std::queue<TX_QUEUE_MESSAGE*> txBuffer;
+	unsigned long txQueuedSeq;					// sequence of last queued message
+	unsigned long txSentSeq;					// sequence of last message that left the queue (sent, failed or cleared)
+	unsigned long txFailedSeq;					// sequence of last message that was not sent
+	bool txStop;
+	std::thread txThread;
+
 	bool listening;
 	bool loopback;
 	unsigned long datarate;
@@ -118,8 +148,6 @@ private:
 	int _dummy_filter_id;
 
 	unsigned long channelId;
-
-	int FilterSetSuccessfull; //0 - waiting 1 - success 2 - failed
 	
 };
 
@@ -2,9 +2,11 @@
 #include "ProtocolCAN.h"
 #include "helper.h"
 #include "Kepler.h"
+#include "registry.h"
 
 CProtocolCAN::CProtocolCAN(int ProtocolID) : CProtocol(ProtocolID)
 {
+	ListenTo(KEPLER_NET_CAN);
 }
 
 
@@ -19,6 +21,29 @@ int CProtocolCAN::Connect(unsigned long channelId, unsigned long Flags, unsigned
 	unsigned char CANMode[] = { 0x02, 0x00, 0x03, 0xA0, 0x02, 0x02 };
 	Kepler::Send(CANMode, 6, 1000);
 
+	// received frames come in KEPLER_NETWORK_BATCH containers, device defaults are used if not set
+	unsigned long latencyUs = KEPLER_DEFAULT_CAN_RX_BATCH_LATENCY_US;
+	unsigned long atSof = 1;
+	bool setLatency = DHPJ2534Registry::GetValueFromRegistry(NULL, TEXT("CAN_RX_BATCH_LATENCY_US"), &latencyUs) ? true : false;
+	bool setSof = DHPJ2534Registry::GetValueFromRegistry(NULL, TEXT("CAN_RX_BATCH_AT_SOF"), &atSof) ? true : false;
+	if (setLatency || setSof)
+	{
+		if (latencyUs > 0xFFFF)
+			latencyUs = 0xFFFF;
+		unsigned char SetBatching[] = { 0x02, 0x00, 0x04, KEPLER_SET_CAN_RX_BATCHING, (unsigned char)(atSof ? 0x01 : 0x00),
+			(unsigned char)(latencyUs >> 8), (unsigned char)(latencyUs & 0xFF) };
+
+		// device answers with 0xCA 0x01, or with an error frame
+		char response[8];
+		int responseLen = 0;
+		int ret = Kepler::Request(SetBatching, 7, KEPLER_SET_CAN_RX_BATCHING, KEPLER_DEFAULT_REQUEST_TIMEOUT, response, &responseLen);
+		if ((ret != KEPLER_REQUEST_OK) || (responseLen < 5) || (response[4] != 0x01))
+		{
+			LOG(ERR, "CProtocolCAN::Connect - setting the receive batching failed (%d)", ret);
+			return (ret == KEPLER_REQUEST_TIMEOUT) ? ERR_TIMEOUT : ERR_FAILED;
+		}
+	}
+
 	// call base class implementation for general settings
 	return CProtocol::Connect(channelId, Flags, 0);
 }
@@ -30,20 +55,23 @@ int CProtocolCAN::Disconnect()
 	return CProtocol::Disconnect();
 }
 
-int CProtocolCAN::WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout)
+int CProtocolCAN::EncodeFrame(const PASSTHRU_MSG * pMsg, unsigned char * message, unsigned short * len)
 {
 
 	char MessageIndex = 0;
 
-	LOG(PROTOCOL_MSG, "CProtocolCAN::DoWriteMsg - timeout %d", Timeout);
-	LOG(ERR, "CProtocolCAN::DoWriteMsg  --- FIXME -- We ignore Timeout for now - call will be blocking");
-
 	if (pMsg->ProtocolID != ProtocolID())
 	{
 		LOG(ERR, "CProtocolCAN::DoWriteMsg - invalid protocol id %d != J1850VPW", pMsg->ProtocolID);
 		return ERR_MSG_PROTOCOL_ID;
 	}
 
+	if (pMsg->DataSize > 12)
+	{
+		LOG(ERR, "CProtocolCAN::DoWriteMsg - invalid data length: %d", pMsg->DataSize);
+		return ERR_INVALID_MSG;
+	}
+
 	char can_29bit_id = (pMsg->TxFlags & 0x100) >> 8;
 
 	if (can_29bit_id)
@@ -56,17 +84,7 @@ int CProtocolCAN::WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout)
 	char iso15765_frame_pad = (pMsg->TxFlags & 0x40) >> 6;
 	LOG(PROTOCOL_MSG, "CProtocolCAN::DoWriteMsg - 29 Bit: %d Addr Type: %d Frame Pad: %d", can_29bit_id, iso15765_addr_type, iso15765_frame_pad)
 
-		unsigned char* message;
-	unsigned int messageSize = 0;
-
-	message = new (std::nothrow) unsigned char[pMsg->DataSize + 4];
-
-	if (!message)
-	{
-		LOG(ERR, "CProtocolCAN:DoWriteMsg - Could not allocate memory for message");
-		return ERR_FAILED;
-	}
-
+	// START_BYTE, LenH, LenL, command, network type, addressing, 4 byte ID + 8 data bytes
 	char LenH = ((12 + 3) & 0xFF00) >> 8;
 	char LenL = (12 + 3) & 0x00FF;
 
@@ -86,22 +104,7 @@ int CProtocolCAN::WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout)
 		memset(message + MessageIndex + pMsg->DataSize, 0x00, 12 - pMsg->DataSize);
 	}
 
-	if (Kepler::Send(message, pMsg->DataSize + 6, Timeout) != pMsg->DataSize + 6)
-	{
-		LOG(ERR, "CProtocol:DoWriteMsg - sending message failed!");
-		free(message);
-		return ERR_FAILED;
-	}
-
-	if (this->IsLoopback())
-	{
-		pMsg->RxStatus = 0x01;
-		pMsg->DataSize = 12;
-		pMsg->ExtraDataIndex = 12;
-
-		AddToRXBuffer(pMsg);
-	}
-
+	*len = 6 + 12;
 	return STATUS_NOERROR;
 
 }
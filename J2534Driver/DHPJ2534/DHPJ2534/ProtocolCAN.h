@@ -10,6 +10,6 @@ public:
 	int Connect(unsigned long channelId, unsigned long Flags, unsigned long Baudrate);
 	int Disconnect();
 	bool HandleMsg(PASSTHRU_MSG * pMsg, char * flags);
-	int WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout);
+	int EncodeFrame(const PASSTHRU_MSG * pMsg, unsigned char * frame, unsigned short * len);
 };
 
@@ -2,6 +2,9 @@
 #include "protocol.h"
 #include "stdafx.h"
 #include "Protocol.h"
+#include <mutex>
+
+#define J15765_MAX_DEVICE_FILTERS 16	// CAN_MAX_RX_FILTERS in the firmware
 
 class CProtocolJ15765 :
 	public CProtocol
@@ -15,13 +18,29 @@ public:
 	int Disconnect();
 	bool HandleMsg(PASSTHRU_MSG * pMsg, char * flags);
 	
-	int WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout);
+	int EncodeFrame(const PASSTHRU_MSG * pMsg, unsigned char * frame, unsigned short * len);
+
+	// flow control filters are set on the device, it sends the flow control frames and reassembles the messages
+	int StartMsgFilter(unsigned long FilterType, PASSTHRU_MSG * pMaskMsg, PASSTHRU_MSG * pPatternMsg, PASSTHRU_MSG * pFlowControlMsg, unsigned long * pFilterID);
+	int StopMsgFilter(unsigned long FilterID);
 	
 
 protected:
+	int GetIOCTLParam(SCONFIG * pConfig);
+	int SetIOCTLParam(SCONFIG * pConfig);
 
 private:
+	int SendFlowControlParams();
+	bool IsExtendedAddressing(const PASSTHRU_MSG * pMsg);
 
+	unsigned long blockSize;	// ISO15765_BS
+	unsigned long stMin;		// ISO15765_STMIN
 
+	// Flow control filters with extended addressing, by device filter id. The device doesn't mark which filter a
+	// reassembled message came through, so HandleMsg finds it by matching ID and address byte.
+	std::mutex filter_lock;
+	bool extFilterUsed[J15765_MAX_DEVICE_FILTERS];
+	unsigned char extFilterMask[J15765_MAX_DEVICE_FILTERS][5];
+	unsigned char extFilterPattern[J15765_MAX_DEVICE_FILTERS][5];
 
 };
@@ -7,6 +7,11 @@ int time;
 CProtocolJ15765::CProtocolJ15765(int ProtocolID)
 	:CProtocol(ProtocolID)
 {
+	// the device reassembles the messages of flow control filters, single frames included
+	ListenTo(KEPLER_NET_ISOTP);
+	blockSize = 0;
+	stMin = 0;
+	memset(extFilterUsed, 0, sizeof(extFilterUsed));
 }
 
 
@@ -20,6 +25,9 @@ int CProtocolJ15765::Connect(unsigned long channelId, unsigned long Flags, unsig
 
 	unsigned char CANMode[] = { 0x02, 0x00, 0x03, 0xA0, 0x02, 0x02 };
 	Kepler::Send(CANMode, 6, 1000);
+	int ret = SendFlowControlParams();
+	if (ret != STATUS_NOERROR)
+		return ret;
 
 	// call base class implementation for general settings
 	return CProtocol::Connect(channelId, Flags, 0);
@@ -33,14 +41,10 @@ int CProtocolJ15765::Disconnect()
 	return CProtocol::Disconnect();
 }
 
-int CProtocolJ15765::WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout)
+int CProtocolJ15765::EncodeFrame(const PASSTHRU_MSG * pMsg, unsigned char * message, unsigned short * len)
 {
 
 	char MessageIndex = 0;
-	PASSTHRU_MSG rtnMsg;
-
-	LOG(PROTOCOL_MSG, "CProtocolCAN::DoWriteMsg - timeout %d", Timeout);
-	LOG(ERR, "CProtocolCAN::DoWriteMsg  --- FIXME -- We ignore Timeout for now - call will be blocking");
 
 	if (pMsg->ProtocolID != ProtocolID())
 	{
@@ -48,6 +52,12 @@ int CProtocolJ15765::WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout)
 		return ERR_MSG_PROTOCOL_ID;
 	}
 
+	if ((pMsg->DataSize < 4) || (pMsg->DataSize > sizeof(pMsg->Data)))
+	{
+		LOG(ERR, "CProtocolCAN::DoWriteMsg - invalid data length: %d", pMsg->DataSize);
+		return ERR_INVALID_MSG;
+	}
+
 	char can_29bit_id = (pMsg->TxFlags & 0x100) >> 8;
 
 	if (can_29bit_id)
@@ -60,17 +70,7 @@ int CProtocolJ15765::WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout)
 	char iso15765_frame_pad = (pMsg->TxFlags & 0x40) >> 6;
 	LOG(PROTOCOL_MSG, "CProtocolCAN::DoWriteMsg - 29 Bit: %d Addr Type: %d Frame Pad: %d", can_29bit_id, iso15765_addr_type, iso15765_frame_pad)
 
-	unsigned char* message;
-	unsigned int messageSize = 0;
-
-	message = new (std::nothrow) unsigned char[pMsg->DataSize + 4];
-
-	if (!message)
-	{
-		LOG(ERR, "CProtocolCAN:DoWriteMsg - Could not allocate memory for message");
-		return ERR_FAILED;
-	}
-
+	// START_BYTE, LenH, LenL, command, network type, addressing + data
 	char LenH = ((pMsg->DataSize + 3) & 0xFF00) >> 8;
 	char LenL = (pMsg->DataSize + 3) & 0x00FF;
 
@@ -81,6 +81,11 @@ int CProtocolJ15765::WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout)
 	message[MessageIndex++] = 0x01; //ISO15765 Message
 	if (iso15765_addr_type)
 	{
+		if (pMsg->DataSize < 5)
+		{
+			LOG(ERR, "CProtocolCAN::DoWriteMsg - extended address missing, data length: %d", pMsg->DataSize);
+			return ERR_INVALID_MSG;
+		}
 		message[MessageIndex++] = 1;
 		message[MessageIndex++] = pMsg->Data[4];
 		memcpy(message + MessageIndex, pMsg->Data, 4);
@@ -103,21 +108,188 @@ int CProtocolJ15765::WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout)
 	
 
 
-	if (Kepler::Send(message, pMsg->DataSize + 6, Timeout) != pMsg->DataSize + 6)
+	*len = (unsigned short)(pMsg->DataSize + 6);
+	return STATUS_NOERROR;
+
+}
+
+bool CProtocolJ15765::HandleMsg(PASSTHRU_MSG * pMsg, char * flags)
+{
+	if (IsExtendedAddressing(pMsg))
+		pMsg->RxStatus |= ISO15765_ADDR_TYPE;
+	return true;
+}
+
+// 4 byte CAN ID and address byte match an extended addressing flow control filter
+bool CProtocolJ15765::IsExtendedAddressing(const PASSTHRU_MSG * pMsg)
+{
+	if (pMsg->DataSize < 5)
+		return false;
+	std::lock_guard<std::mutex> guard(filter_lock);
+	for (int i = 0; i < J15765_MAX_DEVICE_FILTERS; i++)
+	{
+		if (!extFilterUsed[i])
+			continue;
+		int j;
+		for (j = 0; j < 5; j++)
+		{
+			if ((pMsg->Data[j] ^ extFilterPattern[i][j]) & extFilterMask[i][j])
+				break;
+		}
+		if (j == 5)
+			return true;
+	}
+	return false;
+}
+
+int CProtocolJ15765::StartMsgFilter(unsigned long FilterType, PASSTHRU_MSG * pMaskMsg, PASSTHRU_MSG * pPatternMsg, PASSTHRU_MSG * pFlowControlMsg, unsigned long * pFilterID)
+{
+	LOG(PROTOCOL_MSG, "CProtocolJ15765::StartMsgFilter - FilterType: %d", FilterType);
+
+	// 4 byte CAN ID, plus the address byte for extended addressing
+	unsigned long len = pMaskMsg->DataSize;
+	if ((len < 4) || (len > 5) || (pPatternMsg->DataSize != len) || ((FilterType == FLOW_CONTROL_FILTER) && (pFlowControlMsg->DataSize != len)))
 	{
-		LOG(ERR, "CProtocol:DoWriteMsg - sending message failed!");
-		free(message);
-		return ERR_FAILED;
+		LOG(ERR, "CProtocolJ15765::StartMsgFilter - invalid filter length: %d", len);
+		return ERR_INVALID_MSG;
 	}
-	
 
-		
-	
+	// device filter types
+	unsigned char type;
+	switch (FilterType)
+	{
+	case PASS_FILTER:
+		type = 1;
+		break;
+	case BLOCK_FILTER:
+		type = 0;
+		break;
+	case FLOW_CONTROL_FILTER:
+		type = 3;
+		break;
+	default:
+		LOG(ERR, "CProtocolJ15765::StartMsgFilter - FilterType unsupported for this protocol!");
+		return ERR_INVALID_FILTER_ID;
+	}
+
+	// START_BYTE, LenH, LenL, command, filter length (2), type, 29 bit, mask, pattern, flow control
+	unsigned char frame[8 + 3 * 5];
+	unsigned short frameLen = (unsigned short)(8 + 3 * len);
+	frame[0] = 0x02;
+	frame[1] = ((frameLen - 3) >> 8) & 0xFF;
+	frame[2] = (frameLen - 3) & 0xFF;
+	frame[3] = KEPLER_CREATE_CAN_FILTER;
+	frame[4] = 0x00;
+	frame[5] = (unsigned char)len;
+	frame[6] = type;
+	frame[7] = (pPatternMsg->TxFlags & CAN_29BIT_ID) ? 1 : 0;
+	memcpy(frame + 8, pMaskMsg->Data, len);
+	memcpy(frame + 8 + len, pPatternMsg->Data, len);
+	if (FilterType == FLOW_CONTROL_FILTER)
+		memcpy(frame + 8 + 2 * len, pFlowControlMsg->Data, len);
+	else
+		memset(frame + 8 + 2 * len, 0x00, len);
+
+	char response[8];
+	int responseLen = 0;
+	int ret = Kepler::Request(frame, frameLen, KEPLER_CREATE_CAN_FILTER, KEPLER_DEFAULT_REQUEST_TIMEOUT, response, &responseLen);
+	if ((ret != KEPLER_REQUEST_OK) || (responseLen < 6) || (response[4] != 0x01))
+	{
+		LOG(ERR, "CProtocolJ15765::StartMsgFilter - Failed (%d)", ret);
+		return (ret == KEPLER_REQUEST_TIMEOUT) ? ERR_TIMEOUT : ERR_EXCEEDED_LIMIT;
+	}
+
+	*pFilterID = (unsigned char)response[5];
+	if (*pFilterID < J15765_MAX_DEVICE_FILTERS)
+	{
+		std::lock_guard<std::mutex> guard(filter_lock);
+		extFilterUsed[*pFilterID] = (FilterType == FLOW_CONTROL_FILTER) && (len == 5);
+		memcpy(extFilterMask[*pFilterID], pMaskMsg->Data, len);
+		memcpy(extFilterPattern[*pFilterID], pPatternMsg->Data, len);
+	}
+	LOG(PROTOCOL_MSG, "CProtocolJ15765::StartMsgFilter - filter id %d", *pFilterID);
 	return STATUS_NOERROR;
+}
+
+int CProtocolJ15765::StopMsgFilter(unsigned long FilterID)
+{
+	LOG(PROTOCOL, "CProtocolJ15765::StopMsgFilter - filter id 0x%x", FilterID);
+	if (FilterID > 0xFF)
+		return ERR_INVALID_FILTER_ID;
+	unsigned char DeleteFilter[] = { 0x02, 0x00, 0x02, KEPLER_DELETE_CAN_FILTER, (unsigned char)FilterID };
 
+	// device answers with 0xC4 <1 removed, 0 no such filter> <filter id>, or with an error frame
+	char response[8];
+	int responseLen = 0;
+	int ret = Kepler::Request(DeleteFilter, 5, KEPLER_DELETE_CAN_FILTER, KEPLER_DEFAULT_REQUEST_TIMEOUT, response, &responseLen);
+	if ((ret != KEPLER_REQUEST_OK) || (responseLen < 5))
+	{
+		LOG(ERR, "CProtocolJ15765::StopMsgFilter - Failed (%d)", ret);
+		return (ret == KEPLER_REQUEST_TIMEOUT) ? ERR_TIMEOUT : ERR_FAILED;
+	}
+	if (FilterID < J15765_MAX_DEVICE_FILTERS)
+	{
+		std::lock_guard<std::mutex> guard(filter_lock);
+		extFilterUsed[FilterID] = false;
+	}
+	if (response[4] != 0x01)
+	{
+		LOG(ERR, "CProtocolJ15765::StopMsgFilter - no filter id 0x%x on the device", FilterID);
+		return ERR_INVALID_FILTER_ID;
+	}
+	return STATUS_NOERROR;
 }
 
-bool CProtocolJ15765::HandleMsg(PASSTHRU_MSG * pMsg, char * flags)
+int CProtocolJ15765::GetIOCTLParam(SCONFIG * pConfig)
 {
-	return true;
+	switch (pConfig->Parameter)
+	{
+	case ISO15765_BS:
+		pConfig->Value = blockSize;
+		return STATUS_NOERROR;
+	case ISO15765_STMIN:
+		pConfig->Value = stMin;
+		return STATUS_NOERROR;
+	default:
+		return CProtocol::GetIOCTLParam(pConfig);
+	}
+}
+
+int CProtocolJ15765::SetIOCTLParam(SCONFIG * pConfig)
+{
+	switch (pConfig->Parameter)
+	{
+	case ISO15765_BS:
+	case ISO15765_STMIN:
+		if (pConfig->Value > 0xFF)
+		{
+			LOG(ERR, "CProtocolJ15765::SetIOCTLParam - invalid value %d", pConfig->Value);
+			return ERR_INVALID_IOCTL_VALUE;
+		}
+		if (pConfig->Parameter == ISO15765_BS)
+			blockSize = pConfig->Value;
+		else
+			stMin = pConfig->Value;
+		return SendFlowControlParams();
+	default:
+		return CProtocol::SetIOCTLParam(pConfig);
+	}
+}
+
+// BS and STmin go into the flow control frames the device sends
+int CProtocolJ15765::SendFlowControlParams()
+{
+	LOG(PROTOCOL, "CProtocolJ15765::SendFlowControlParams - BS: %d STmin: %d", blockSize, stMin);
+	unsigned char SetParams[] = { 0x02, 0x00, 0x03, KEPLER_SET_ISOTP_PARAMS, (unsigned char)blockSize, (unsigned char)stMin };
+
+	// device answers with 0xC9 0x01, or with an error frame
+	char response[8];
+	int responseLen = 0;
+	int ret = Kepler::Request(SetParams, 6, KEPLER_SET_ISOTP_PARAMS, KEPLER_DEFAULT_REQUEST_TIMEOUT, response, &responseLen);
+	if ((ret != KEPLER_REQUEST_OK) || (responseLen < 5) || (response[4] != 0x01))
+	{
+		LOG(ERR, "CProtocolJ15765::SendFlowControlParams - Failed (%d)", ret);
+		return (ret == KEPLER_REQUEST_TIMEOUT) ? ERR_TIMEOUT : ERR_FAILED;
+	}
+	return STATUS_NOERROR;
 }
@@ -22,15 +22,117 @@
 #include "ProtocolJ1850VPW.h"
 #include "helper.h"
 #include "Kepler.h"
+#include "registry.h"
+
+// device retries frames itself after losing arbitration, we only get told how it went
+bool WINAPI SendResultListener(char * msg, int len, void * data)
+{
+	if (len < 6)
+		return false;
+	unsigned char attempts = (unsigned char)msg[5];
+	if (msg[4])
+	{
+		LOG(PROTOCOL, "CProtocolJ1850VPW::SendResultListener - frame sent, %d attempt(s)", attempts);
+	}
+	else
+	{
+		LOG(ERR, "CProtocolJ1850VPW::SendResultListener - frame lost arbitration %d times, not sent", attempts);
+	}
+	return true;
+}
+
+bool WINAPI StreamListener(char * msg, int len, void * data)
+{
+	return ((CProtocolJ1850VPW*)data)->StreamRecord(msg, len);
+}
 
 CProtocolJ1850VPW::CProtocolJ1850VPW(int ProtocolID)
 	:CProtocol(ProtocolID)
 {
+	streamLen = 0;
+	streamSeq = 0;
+	streamValid = false;
+
+	ListenTo(KEPLER_NET_VPW);
+	Kepler::RegisterListener((LPKEPLERLISTENER)SendResultListener, this, KEPLER_SEND_RESULT, KEPLER_NET_NONE);
+	Kepler::RegisterListener((LPKEPLERLISTENER)StreamListener, this, KEPLER_NETWORK_MESSAGE, KEPLER_NET_VPW_STREAM);
 }
 
 
 CProtocolJ1850VPW::~CProtocolJ1850VPW(void)
 {
+	Kepler::RemoveListener((LPKEPLERLISTENER)SendResultListener, this);
+	Kepler::RemoveListener((LPKEPLERLISTENER)StreamListener, this);
+}
+
+// START_BYTE LenH LenL KEPLER_NETWORK_MESSAGE KEPLER_NET_VPW_STREAM <record seq> <status> <data>
+// Records of a frame are numbered from 0, the last one has the CRC verdict. The whole frame is handed to
+// ParseMsg as if it had been received in one piece.
+bool CProtocolJ1850VPW::StreamRecord(char * msg, int len)
+{
+	if (!IsListening())
+		return false;
+	if (len < 7)
+	{
+		LOG(ERR, "CProtocolJ1850VPW::StreamRecord - invalid record length %d", len);
+		return false;
+	}
+
+	unsigned char seq = (unsigned char)msg[5];
+	unsigned char status = (unsigned char)msg[6];
+	if (seq == 0)
+	{
+		streamLen = 0;
+		streamValid = true;
+	}
+	else if (seq != (unsigned char)(streamSeq + 1))
+	{
+		if (streamValid)
+			LOG(ERR, "CProtocolJ1850VPW::StreamRecord - record %d missing, frame dropped", (unsigned char)(streamSeq + 1));
+		streamValid = false;
+	}
+	streamSeq = seq;
+	if (!streamValid)
+		return false;
+
+	switch (status)
+	{
+	case KEPLER_STREAM_MORE:
+		if (streamLen + (len - 7) > (int)sizeof(((PASSTHRU_MSG*)0)->Data))
+		{
+			LOG(ERR, "CProtocolJ1850VPW::StreamRecord - frame too long, dropped");
+			streamValid = false;
+			return false;
+		}
+		memcpy(streamFrame + 5 + streamLen, msg + 7, len - 7);
+		streamLen += len - 7;
+		return true;
+
+	case KEPLER_STREAM_END_OK:
+	{
+		int frameLen = streamLen + 2;	// command and network type
+		streamFrame[0] = 0x02;
+		streamFrame[1] = (char)(frameLen >> 8);
+		streamFrame[2] = (char)(frameLen & 0xFF);
+		streamFrame[3] = (char)KEPLER_NETWORK_MESSAGE;
+		streamFrame[4] = KEPLER_NET_VPW;
+		streamValid = false;
+		return ParseMsg(streamFrame, streamLen + 5);
+	}
+
+	case KEPLER_STREAM_END_BAD_CRC:
+		LOG(PROTOCOL, "CProtocolJ1850VPW::StreamRecord - streamed frame of %d bytes had a bad CRC", streamLen);
+		break;
+
+	case KEPLER_STREAM_ABORTED:
+		LOG(PROTOCOL, "CProtocolJ1850VPW::StreamRecord - streamed frame cut short after %d bytes", streamLen);
+		break;
+
+	default:
+		LOG(ERR, "CProtocolJ1850VPW::StreamRecord - unknown record status 0x%02x", status);
+	}
+	streamValid = false;
+	return false;
 }
 
 bool CProtocolJ1850VPW::HandleMsg(PASSTHRU_MSG * pMsg, char * flags)
@@ -52,6 +154,22 @@ int CProtocolJ1850VPW::Connect(unsigned long channelId, unsigned long Flags, uns
 		Kepler::Send(HighSpeedMode, 4,10000);
 	}
 
+	// retries after lost arbitration, device default is used if not set
+	unsigned long retries;
+	if (DHPJ2534Registry::GetValueFromRegistry(NULL, TEXT("VPW_TX_RETRIES"), &retries))
+	{
+		unsigned char SetRetries[] = { 0x02, 0x00, 0x02, KEPLER_SET_VPW_RETRIES, (unsigned char)((retries > 0xFF) ? 0xFF : retries) };
+		Kepler::Send(SetRetries, 5, 1000);
+	}
+
+	// long frames (4x block transfers) can be streamed while they are received
+	unsigned long streaming;
+	if (DHPJ2534Registry::GetValueFromRegistry(NULL, TEXT("VPW_STREAMING"), &streaming))
+	{
+		unsigned char SetStreaming[] = { 0x02, 0x00, 0x02, KEPLER_SET_VPW_STREAMING, (unsigned char)(streaming ? 0x01 : 0x00) };
+		Kepler::Send(SetStreaming, 5, 1000);
+	}
+
 	// call base class implementation for general settings
 	return CProtocol::Connect(channelId,Flags, Baudrate);
 
@@ -65,14 +183,9 @@ int CProtocolJ1850VPW::Disconnect()
 }
 
 
-int CProtocolJ1850VPW::WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout)
+int CProtocolJ1850VPW::EncodeFrame(const PASSTHRU_MSG * pMsg, unsigned char * message, unsigned short * len)
 {
 	long tmpDataSize;
-	unsigned char* message;
-	
-	LOG(PROTOCOL_MSG, "CProtocolJ1850VPW::DoWriteMsg - timeout %d", Timeout);
-	LOG(ERR, "CProtocolJ1850VPW::DoWriteMsg  --- FIXME -- We ignore Timeout for now - call will be blocking");
-
 	
 	if (pMsg->ProtocolID != ProtocolID())
 	{
@@ -80,32 +193,22 @@ int CProtocolJ1850VPW::WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout)
 		return ERR_MSG_PROTOCOL_ID;
 	}
 
-	if (pMsg->DataSize < 4)
+	if ((pMsg->DataSize < 4) || (pMsg->DataSize > sizeof(pMsg->Data)))
 	{
 		LOG(ERR, "CProtocolJ1850VPW::DoWriteMsg - invalid data length: %d", pMsg->DataSize);
 		return ERR_INVALID_MSG;
 	}
 
-	LOG(PROTOCOL, "CProtocol::DoWriteMsg - timeout %d", Timeout);
-	LOG(ERR, "CProtocol::DoWriteMsg  --- FIXME -- We ignore Timeout for now - call will be blocking");
-
 	//dbug_printmsg(pMsg, _T("Msg"), 1, true);
 
 	//LogMessage(pMsg, SENT, channelId, "");
 
-	message = new (std::nothrow) unsigned char[pMsg->DataSize + 4];
-	if (!message)
-	{
-		LOG(ERR, "CProtocol:DoWriteMsg - Could no allocate memory for message");
-		return ERR_FAILED;
-	}
-
-
 	tmpDataSize = pMsg->DataSize + 1;
 
 	char LenH = (tmpDataSize & 0xFF00) >> 8;
 	char LenL = tmpDataSize & 0x00FF;
 
+	// START_BYTE, LenH, LenL, command + data
 	message[0] = 0x02;
 	message[1] = LenH;
 	message[2] = LenL;
@@ -113,14 +216,7 @@ int CProtocolJ1850VPW::WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout)
 
 	memcpy(message + 4, pMsg->Data, tmpDataSize - 1);
 	
-	if (Kepler::Send(message, tmpDataSize + 3, Timeout) != tmpDataSize + 3)
-	{
-		LOG(ERR, "CProtocol:DoWriteMsg - sending message failed!");
-		free(message);
-		return ERR_FAILED;
-	}
-
-	free(message);
+	*len = (unsigned short)(tmpDataSize + 3);
 	return STATUS_NOERROR;
 }
 
@@ -17,18 +17,26 @@ public:
 	int Connect(unsigned long channelId, unsigned long Flags, unsigned long Baudrate);
 	int Disconnect();
 	//int ReadMsgs(PASSTHRU_MSG * pMsg, unsigned long * pNumMsgs, unsigned long Timeout);
-	int WriteMsg(PASSTHRU_MSG * pMsg, unsigned long Timeout);
+	int EncodeFrame(const PASSTHRU_MSG * pMsg, unsigned char * frame, unsigned short * len);
 	bool HandleMsg(PASSTHRU_MSG * pMsg, char * flags);
 	//	int IOCTL(unsigned long IoctlID, void *pInput, void *pOutput);
 
 	int IOCTL(unsigned long IoctlID, void *pInput, void *pOutput);
 	//int GetIOCTLParam(SCONFIG * pConfig);
 	int SetIOCTLParam(SCONFIG * pConfig);
+
+	bool StreamRecord(char * msg, int len);	// record of a frame the device streams while receiving it
 protected:
 
 private:
 
 	baud_rate CurrBaudRate;
 
+	// streamed frame is reassembled here, with room for the frame header ParseMsg expects
+	char streamFrame[5 + sizeof(((PASSTHRU_MSG*)0)->Data)];
+	int streamLen;					// data bytes so far
+	unsigned char streamSeq;		// last record
+	bool streamValid;
+
 };
 
@@ -0,0 +1,117 @@
+#include "stdafx.h"
+#include "RxRing.h"
+#include "helper.h"
+#include <stddef.h>
+#include <string.h>
+#include <new>
+
+void CopyPassThruMsg(PASSTHRU_MSG * pDest, const PASSTHRU_MSG * pSrc)
+{
+	unsigned long size = pSrc->DataSize;
+	if (size > sizeof(pSrc->Data))
+		size = sizeof(pSrc->Data);
+	memcpy(pDest, pSrc, offsetof(PASSTHRU_MSG, Data) + size);
+}
+
+CRxRing::CRxRing(unsigned int depth)
+{
+	if (depth < MIN_RX_BUFFER_DEPTH)
+		depth = MIN_RX_BUFFER_DEPTH;
+	if (depth > MAX_RX_BUFFER_DEPTH)
+		depth = MAX_RX_BUFFER_DEPTH;
+
+	capacity = 1;
+	while (capacity < depth)
+		capacity <<= 1;
+	mask = capacity - 1;
+
+	slots = new (std::nothrow) PASSTHRU_MSG[capacity];
+	if (!slots)
+	{
+		LOG(ERR, "CRxRing::CRxRing - Could not allocate %d message slots. Out of memory!", capacity);
+		capacity = 0;
+		mask = 0;
+	}
+	LOG(HELPERFUNC, "CRxRing::CRxRing - %d message slots", capacity);
+
+	head = 0;
+	tail = 0;
+	overflow = false;
+}
+
+CRxRing::~CRxRing(void)
+{
+	delete[] slots;
+}
+
+PASSTHRU_MSG * CRxRing::Reserve()
+{
+	writer_lock.Lock();
+	unsigned int h = head.load(std::memory_order_relaxed);
+	if (h - tail.load(std::memory_order_acquire) >= capacity)
+	{
+		// we keep what the application hasn't read yet and lose the new message
+		LOG(ERR, "CRxRing::Reserve -- buffer overflow!---");
+		overflow.store(true, std::memory_order_relaxed);
+		writer_lock.Unlock();
+		return NULL;
+	}
+	return &slots[h & mask];
+}
+
+void CRxRing::Publish()
+{
+	head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	writer_lock.Unlock();
+}
+
+void CRxRing::Cancel()
+{
+	writer_lock.Unlock();
+}
+
+int CRxRing::Push(const PASSTHRU_MSG * pMsg)
+{
+	PASSTHRU_MSG * slot = Reserve();
+	if (!slot)
+		return ERR_BUFFER_OVERFLOW;
+	CopyPassThruMsg(slot, pMsg);
+	Publish();
+	return STATUS_NOERROR;
+}
+
+bool CRxRing::Pop(PASSTHRU_MSG * pDest)
+{
+	unsigned int t = tail.load(std::memory_order_relaxed);
+	if (t == head.load(std::memory_order_acquire))
+		return false;
+	CopyPassThruMsg(pDest, &slots[t & mask]);
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+}
+
+void CRxRing::Clear()
+{
+	tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+	overflow.store(false, std::memory_order_relaxed);
+}
+
+unsigned int CRxRing::Count()
+{
+	return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+}
+
+unsigned int CRxRing::Depth()
+{
+	return capacity;
+}
+
+bool CRxRing::IsOverflow()
+{
+	return overflow.load(std::memory_order_relaxed);
+}
+
+void CRxRing::SetOverflow(bool status)
+{
+	overflow.store(status, std::memory_order_relaxed);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "kepler_defs.h"
+#include "Benaphore.h"
+#include <atomic>
+
+#define DEFAULT_RX_BUFFER_DEPTH 256
+#define MIN_RX_BUFFER_DEPTH 16
+#define MAX_RX_BUFFER_DEPTH 16384
+
+// Fixed capacity receive ring. All message slots are allocated once when the channel is created, so receiving
+// a message never touches the heap: the producer fills a slot in place and publishes it, the reader copies it out.
+//
+// Reader side (PassThruReadMsgs) is lock free. Writer side is normally only the comm thread, but loopback
+// messages come from the channel's transmit thread, so writers are serialized with a Benaphore
+// (a single interlocked op when nobody else is writing).
+class CRxRing
+{
+public:
+	CRxRing(unsigned int depth);	// depth is rounded up to power of two
+	~CRxRing(void);
+
+	// --- writer side ---
+	PASSTHRU_MSG * Reserve();				// returns slot to be filled in place, or NULL if ring is full. Must be followed by Publish() or Cancel()
+	void Publish();							// makes the reserved slot visible to the reader
+	void Cancel();							// gives up the reserved slot
+	int Push(const PASSTHRU_MSG * pMsg);	// copies the message into the ring
+
+	// --- reader side ---
+	bool Pop(PASSTHRU_MSG * pDest);			// copies oldest message to pDest and frees the slot
+	void Clear();
+
+	unsigned int Count();
+	unsigned int Depth();
+	bool IsOverflow();
+	void SetOverflow(bool status);
+
+private:
+	PASSTHRU_MSG * slots;
+	unsigned int capacity;
+	unsigned int mask;
+
+	std::atomic<unsigned int> head;	// next slot to write, only advanced by writer
+	std::atomic<unsigned int> tail;	// next slot to read, only advanced by reader
+	std::atomic<bool> overflow;
+
+	Benaphore writer_lock;
+};
+
+// copies only the used part of the message instead of the whole 4 KB structure
+void CopyPassThruMsg(PASSTHRU_MSG * pDest, const PASSTHRU_MSG * pSrc);
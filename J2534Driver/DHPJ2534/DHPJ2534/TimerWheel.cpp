@@ -0,0 +1,272 @@
+// Built without the precompiled header (see the project file), so it also builds outside of the DLL
+#include "TimerWheel.h"
+#include <string.h>
+
+CWheelTimer::CWheelTimer(unsigned long IntervalUs)
+{
+	intervalUs = IntervalUs;
+	intervalTicks = (IntervalUs + TIMER_WHEEL_TICK_US - 1) / TIMER_WHEEL_TICK_US;
+	if (intervalTicks == 0)
+		intervalTicks = 1;
+	due = 0;
+	next = NULL;
+	prev = NULL;
+	level = 0;
+	slot = 0;
+	scheduled = false;
+	firing = false;
+	removed = false;
+	memset(&stats, 0, sizeof(stats));
+}
+
+CTimerWheel::CTimerWheel(CTimerWheelSink * Sink, unsigned long spinUs)
+	: sink(Sink), spin(spinUs)
+{
+	stop = false;
+	start = clock::now();
+	currentTick = 0;
+	count = 0;
+	memset(slots, 0, sizeof(slots));
+}
+
+CTimerWheel::~CTimerWheel()
+{
+	Stop();
+}
+
+void CTimerWheel::Start()
+{
+	std::lock_guard<std::mutex> guard(wheel_lock);
+	if (thread.joinable())
+		return;
+	stop = false;
+	thread = std::thread(&CTimerWheel::Run, this);
+}
+
+void CTimerWheel::Stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(wheel_lock);
+		stop = true;
+	}
+	wakeup.notify_all();
+	if (thread.joinable())
+		thread.join();
+}
+
+bool CTimerWheel::IsRunning()
+{
+	std::lock_guard<std::mutex> guard(wheel_lock);
+	return thread.joinable();
+}
+
+CTimerWheel::clock::time_point CTimerWheel::TickTime(unsigned long long tick)
+{
+	return start + std::chrono::microseconds(tick * TIMER_WHEEL_TICK_US);
+}
+
+unsigned long long CTimerWheel::NowTick()
+{
+	return (unsigned long long)std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count() / TIMER_WHEEL_TICK_US;
+}
+
+// wheel_lock must be held
+void CTimerWheel::Link(CWheelTimer * timer)
+{
+	unsigned long long delta = timer->due - currentTick;
+	int level = 0;
+	while ((level < TIMER_WHEEL_LEVELS - 1) && (delta >= (1ULL << (TIMER_WHEEL_SLOT_BITS * (level + 1)))))
+		level++;
+
+	timer->level = level;
+	timer->slot = (int)((timer->due >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+	timer->prev = NULL;
+	timer->next = slots[level][timer->slot];
+	if (timer->next)
+		timer->next->prev = timer;
+	slots[level][timer->slot] = timer;
+	timer->scheduled = true;
+}
+
+// wheel_lock must be held
+void CTimerWheel::Unlink(CWheelTimer * timer)
+{
+	if (timer->prev)
+		timer->prev->next = timer->next;
+	else
+		slots[timer->level][timer->slot] = timer->next;
+	if (timer->next)
+		timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->scheduled = false;
+}
+
+// moves the timers of the current slot of level one level down
+void CTimerWheel::Cascade(int level)
+{
+	int slot = (int)((currentTick >> (TIMER_WHEEL_SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+	CWheelTimer * timer = slots[level][slot];
+	slots[level][slot] = NULL;
+	while (timer)
+	{
+		CWheelTimer * next = timer->next;
+		Link(timer);
+		timer = next;
+	}
+}
+
+void CTimerWheel::Advance(unsigned long long toTick)
+{
+	while (currentTick < toTick)
+	{
+		currentTick++;
+		for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--)
+		{
+			if ((currentTick & ((1ULL << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) == 0)
+				Cascade(level);
+		}
+
+		int slot = (int)(currentTick & (TIMER_WHEEL_SLOTS - 1));
+		CWheelTimer * timer = slots[0][slot];
+		slots[0][slot] = NULL;
+		while (timer)
+		{
+			CWheelTimer * next = timer->next;
+			timer->next = NULL;
+			timer->prev = NULL;
+			timer->scheduled = false;
+			timer->firing = true;
+			due.push_back(timer);
+			timer = next;
+		}
+	}
+}
+
+// first tick that has timers in level 0, or the next cascade if level 0 is empty until then
+unsigned long long CTimerWheel::NextEventTick()
+{
+	unsigned long long tick = currentTick + 1;
+	while ((tick & (TIMER_WHEEL_SLOTS - 1)) != 0)
+	{
+		if (slots[0][tick & (TIMER_WHEEL_SLOTS - 1)])
+			return tick;
+		tick++;
+	}
+	return tick;
+}
+
+void CTimerWheel::Add(CWheelTimer * timer, unsigned long firstDelayUs)
+{
+	std::unique_lock<std::mutex> lock(wheel_lock);
+	if (count == 0)
+		currentTick = NowTick();	// wheel hasn't been turning while empty
+
+	timer->removed = false;
+	timer->due = NowTick() + (firstDelayUs + TIMER_WHEEL_TICK_US - 1) / TIMER_WHEEL_TICK_US;
+	if (timer->due <= currentTick)
+		timer->due = currentTick + 1;
+	Link(timer);
+	count++;
+	lock.unlock();
+	wakeup.notify_all();
+}
+
+void CTimerWheel::Remove(CWheelTimer * timer)
+{
+	std::unique_lock<std::mutex> lock(wheel_lock);
+	if (timer->firing)
+	{
+		timer->removed = true;
+		while (timer->firing)
+			fired.wait(lock);
+		count--;
+	}
+	else if (timer->scheduled)
+	{
+		Unlink(timer);
+		count--;
+	}
+}
+
+int CTimerWheel::Count()
+{
+	std::lock_guard<std::mutex> guard(wheel_lock);
+	return count;
+}
+
+void CTimerWheel::GetJitterStats(CWheelTimer * timer, TIMER_JITTER_STATS * stats)
+{
+	std::lock_guard<std::mutex> guard(wheel_lock);
+	*stats = timer->stats;
+}
+
+void CTimerWheel::Run()
+{
+	std::unique_lock<std::mutex> lock(wheel_lock);
+	while (!stop)
+	{
+		if (count == 0)
+		{
+			wakeup.wait(lock);
+			continue;
+		}
+
+		unsigned long long nextTick = NextEventTick();
+		clock::time_point target = TickTime(nextTick);
+		if (clock::now() < target - spin)
+		{
+			// re-evaluated after waking up, timers may have been added in the meantime
+			wakeup.wait_until(lock, target - spin);
+			continue;
+		}
+
+		if (clock::now() < target)
+		{
+			lock.unlock();
+			while (clock::now() < target)
+				std::this_thread::yield();
+			lock.lock();
+			if (stop)
+				break;
+		}
+
+		Advance(NowTick());
+		if (due.empty())
+			continue;	// just a cascade
+
+		clock::time_point now = clock::now();
+		for (size_t i = 0; i < due.size(); i++)
+		{
+			CWheelTimer * timer = due[i];
+			long long late = std::chrono::duration_cast<std::chrono::microseconds>(now - TickTime(timer->due)).count();
+			if ((timer->stats.count == 0) || (late < timer->stats.minLateUs))
+				timer->stats.minLateUs = late;
+			if ((timer->stats.count == 0) || (late > timer->stats.maxLateUs))
+				timer->stats.maxLateUs = late;
+			timer->stats.totalLateUs += late;
+			timer->stats.count++;
+		}
+
+		lock.unlock();
+		sink->TimersDue(due.data(), (int)due.size());
+		lock.lock();
+
+		for (size_t i = 0; i < due.size(); i++)
+		{
+			CWheelTimer * timer = due[i];
+			timer->firing = false;
+			if (timer->removed)
+				continue;
+			timer->due += timer->intervalTicks;
+			while (timer->due <= currentTick)
+			{
+				timer->due += timer->intervalTicks;
+				timer->stats.missed++;
+			}
+			Link(timer);
+		}
+		due.clear();
+		fired.notify_all();
+	}
+}
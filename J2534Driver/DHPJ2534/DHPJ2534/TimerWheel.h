@@ -0,0 +1,107 @@
+#pragma once
+
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+// Hierarchical timer wheel running periodic timers on a single thread. Only uses the standard library, so it can
+// be built and benchmarked outside of the DLL.
+//
+// Level 0 has one slot per tick, each higher level one slot per full turn of the level below. Timers are moved
+// (cascaded) down a level when its slot comes up. With 250 us ticks and 3 levels of 256 slots the wheel covers
+// ~70 minutes; J2534 periodic intervals are at most 65535 ms.
+//
+// All timers due at the same tick (or missed ticks, if the thread was late) are handed to the sink in one call,
+// so that the owner can send them together. Next due time is always advanced from the previous due time, not
+// from when the timer actually fired, so lateness doesn't accumulate.
+
+#define TIMER_WHEEL_TICK_US 250
+#define TIMER_WHEEL_LEVELS 3
+#define TIMER_WHEEL_SLOT_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+typedef struct {
+	unsigned long long count;		// how many times the timer fired
+	unsigned long long missed;		// periods skipped because the thread was too late
+	long long minLateUs;			// lateness of firing compared to the exact due time
+	long long maxLateUs;
+	long long totalLateUs;			// average = totalLateUs / count
+} TIMER_JITTER_STATS;
+
+class CWheelTimer
+{
+public:
+	CWheelTimer(unsigned long intervalUs);
+	virtual ~CWheelTimer() {}
+
+	unsigned long IntervalUs() { return intervalUs; }
+
+private:
+	friend class CTimerWheel;
+
+	unsigned long intervalUs;
+	unsigned long long intervalTicks;
+	unsigned long long due;		// tick
+	CWheelTimer * next;
+	CWheelTimer * prev;
+	int level;
+	int slot;
+	bool scheduled;				// in the wheel
+	bool firing;				// handed to the sink right now
+	bool removed;				// removed while firing, not to be rescheduled
+	TIMER_JITTER_STATS stats;
+};
+
+class CTimerWheelSink
+{
+public:
+	// called on the wheel thread without the wheel lock held
+	virtual void TimersDue(CWheelTimer ** timers, int count) = 0;
+};
+
+class CTimerWheel
+{
+public:
+	// spinUs: the thread sleeps until this long before the due time and yields the rest, to get below the
+	// OS sleep granularity. 0 just sleeps.
+	CTimerWheel(CTimerWheelSink * sink, unsigned long spinUs);
+	~CTimerWheel();
+
+	void Start();
+	void Stop();		// waits for the thread to exit
+	bool IsRunning();
+
+	void Add(CWheelTimer * timer, unsigned long firstDelayUs);
+	void Remove(CWheelTimer * timer);	// timer isn't fired anymore after this returns
+	int Count();
+	void GetJitterStats(CWheelTimer * timer, TIMER_JITTER_STATS * stats);
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	void Run();
+	void Link(CWheelTimer * timer);
+	void Unlink(CWheelTimer * timer);
+	void Cascade(int level);
+	void Advance(unsigned long long toTick);	// fills the due list
+	unsigned long long NextEventTick();
+	unsigned long long NowTick();
+	clock::time_point TickTime(unsigned long long tick);
+
+	CTimerWheelSink * sink;
+	std::chrono::microseconds spin;
+
+	std::mutex wheel_lock;
+	std::condition_variable wakeup;		// timers added or stop requested
+	std::condition_variable fired;		// sink call finished
+	std::thread thread;
+	bool stop;
+
+	clock::time_point start;
+	unsigned long long currentTick;
+	CWheelTimer * slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	int count;
+	std::vector<CWheelTimer *> due;
+};
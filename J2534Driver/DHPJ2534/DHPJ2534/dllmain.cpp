@@ -2,10 +2,13 @@
 #include "stdafx.h"
 #include "SerialCommunication.h"
 #include "helper.h"
+#include "MsgCapture.h"
 
 bool setup()
 {
+	debug::StartLog();
 	LOG(INIT, "DHPJ2534 Kepler: setup");
+	capture::StartCapture();
 	
 	return SerialCommunication::CreateCommThread();
 }
@@ -14,7 +17,8 @@ void exitdll()
 {
 	LOG(INIT, "DHPJ2534 Kepler: Exitdll");
 	SerialCommunication::CloseCommThread();
-	
+	capture::StopCapture();
+	debug::StopLog();
 }
 
 BOOL APIENTRY DllMain( HMODULE hModule,
@@ -3,11 +3,11 @@
 #include "helper.h"
 #include "kepler_defs.h"
 #include "shim_debug.h"
+#include "MsgCapture.h"
 #include <stdio.h>
 
 namespace debug {
-	// FIXME: load default values from Windows registry, and add DLL functions to change these settings
-	unsigned long debug_fields = ERR | INIT | MAINFUNC | HELPERFUNC | KEPLER_MSG | PROTOCOL | PROTOCOL_VERBOSE | PROTOCOL_MSG | PROTOCOL_MSG_VERBOSE | KEPLER_MSG_VERBOSE;
+	unsigned long debug_fields = LOG_DEFAULT_FIELDS;
 }
 
 void PrintError(int error)
@@ -58,118 +58,7 @@ char* ConvertLPWSTRToLPSTR(LPWSTR lpwszStrIn)
 void LogMessage(PASSTHRU_MSG * pMsg, LogMessageType msgType, unsigned long channelId, char * comment)
 {
 #ifdef ENABLE_MSG_LOGGING
-	char szMessageBuffer[4128] = { 0 };
-	SYSTEMTIME systemTime;
-	GetSystemTime(&systemTime);
-	sprintf_s(szMessageBuffer, 4128, "[%02d:%02d:%02d.%03d] ", systemTime.wHour, systemTime.wMinute, systemTime.wSecond, systemTime.wMilliseconds);
-	std::ofstream handle;
-	handle.open(KEPLER_MSG_LOG_FILE, std::ios_base::app);
-	handle << szMessageBuffer;
-
-	switch (msgType)
-	{
-	case LogMessageType::RECEIVED:
-		handle << ">>>>";
-		break;
-	case LogMessageType::SENT:
-		handle << "<<<<";
-		break;
-	case LogMessageType::ISO15765_RECV:
-		handle << "ISO>";
-		break;
-	case LogMessageType::ISO15765_SENT:
-		handle << "<ISO";
-		break;
-	case LogMessageType::LOOP_BACK:
-		handle << "LOOP";
-		break;
-	default:
-		handle << "UDEF";
-	}
-
-	sprintf_s(szMessageBuffer, 4128, " Ch#%02d", channelId);
-	handle << szMessageBuffer;
-
-	unsigned long pid = pMsg->ProtocolID;
-	if (pid >= 0x8000)
-	{
-		handle << " PS ";	// pin switching
-		pid -= 0x8000 - 1;  // PS ids start from 0x8000, normal (without pin switching) from 0x0001
-	}
-	else
-		handle << "    ";
-	switch (pid)
-	{
-	case J1850VPW:
-		handle << "J1850VPW ";
-		break;
-	case J1850PWM:
-		handle << "J1850PWM ";
-		break;
-	case ISO9141:
-		handle << "ISO9141  ";
-		break;
-	case ISO14230:
-		handle << "ISO14230 ";
-		break;
-	case CAN:
-		handle << "CAN      ";
-		break;
-	case ISO15765:
-		handle << "ISO15765 ";
-		break;
-	default:
-		handle << "UNKNOWN  ";
-	}
-	if ((msgType == RECEIVED) || (msgType == ISO15765_RECV) || (msgType == LOOP_BACK))
-	{
-		if ((pid == CAN) || (pid == ISO15765))
-		{
-			if (pMsg->RxStatus & CAN_29BIT_ID)
-				handle << "29b ";
-			else
-				handle << "11b ";
-			if (pMsg->RxStatus & ISO15765_ADDR_TYPE)
-				handle << "EXT ADDR ";
-			else
-				handle << "STD ADDR ";
-		}
-
-	}
-	else
-		if ((msgType == SENT) || (msgType == ISO15765_SENT))
-		{
-			if ((pid == CAN) || (pid == ISO15765))
-			{
-				if (pMsg->TxFlags & CAN_29BIT_ID)
-					handle << "29b ";
-				else
-					handle << "11b ";
-				if (pMsg->TxFlags & ISO15765_ADDR_TYPE)
-					handle << "EXT ADDR ";
-				else
-					handle << "STD ADDR ";
-			}
-		}
-
-	sprintf_s(szMessageBuffer, 4128, "DS:%02d EDI:%02d :: ", pMsg->DataSize, pMsg->ExtraDataIndex);
-	handle << szMessageBuffer;
-	sprintf_s(szMessageBuffer, 4128, "%02x %02x %02x %02x | ",
-		pMsg->Data[0],
-		pMsg->Data[1],
-		pMsg->Data[2],
-		pMsg->Data[3]);
-	handle << szMessageBuffer;
-	for (unsigned int i = 4; i<pMsg->DataSize; i++)
-	{
-		sprintf_s(szMessageBuffer, 4128, "%02x ", pMsg->Data[i]);
-		handle << szMessageBuffer;
-	}
-
-	if (comment)
-		handle << comment;
-
-	handle << "\n" << std::flush;
+	capture::Capture(pMsg, (unsigned char)msgType, channelId, comment);
 #endif
 }
 
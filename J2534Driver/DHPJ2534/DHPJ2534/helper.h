@@ -8,14 +8,15 @@
 #include "kepler_defs.h"
 #include "shim_debug.h"
 #include "j2534_v0404.h"
+#include "DebugLog.h"
 #include <string>
 #define ENABLE_LOGGING
 #define ENABLE_MSG_LOGGING
 
 #ifdef ENABLE_LOGGING
 
-#define KEPLER_LOG_FILE "c:\\DHP\\Logs\\kepler-j2534.log"
-#define KEPLER_MSG_LOG_FILE "c:\\DHP\\Logs\\kepler-msg.log"
+// file name in the log directory (LOG_PATH setting, see DebugLog.h). Messages are captured to KEPLER_MSG_CAPTURE_FILE, see MsgCapture.h
+#define KEPLER_LOG_FILE L"kepler-j2534.log"
 
 // debug fields. 
 // God damn, wasted few minutes of my life figuring out what's wrong, only to realize that binary literals don't exist in Visual C++...
@@ -31,97 +32,40 @@
 #define KEPLER_MSG_VERBOSE		256	// 0b0100000000
 #define PROTOCOL_MSG_VERBOSE	512	// 0b1000000000
 
+// fields compiled into the DLL at all. The rest are enabled at runtime with the LOG_FIELDS setting
+#ifdef _DEBUG
+#define LOG_COMPILED_FIELDS		(ERR | INIT | MAINFUNC | PROTOCOL | HELPERFUNC | KEPLER_MSG | PROTOCOL_MSG | PROTOCOL_VERBOSE | KEPLER_MSG_VERBOSE | PROTOCOL_MSG_VERBOSE)
+#else
+#define LOG_COMPILED_FIELDS		(ERR | INIT | MAINFUNC | PROTOCOL | KEPLER_MSG | PROTOCOL_MSG)
+#endif
+
+#define LOG_DEFAULT_FIELDS		(ERR | INIT | MAINFUNC | PROTOCOL | KEPLER_MSG | PROTOCOL_MSG)
+
+#define LOG_ENABLED(debug_field) ((LOG_COMPILED_FIELDS & (debug_field)) && (debug::debug_fields & (debug_field)))
+
 namespace debug {
-	// FIXME: load default values from Windows registry, and add DLL functions to change these settings
-	extern unsigned long debug_fields;
+	extern unsigned long debug_fields;	// LOG_FIELDS setting, LOG_DEFAULT_FIELDS if not set
 }
 
 
+// LogMessage() records the message in the binary capture file (MsgCapture.h)
 typedef enum { UNDEFINED, RECEIVED, SENT, LOOP_BACK, J1850VPW_RECV, J1850VPW_SENT, ISO15765_RECV, ISO15765_SENT, FILTER } LogMessageType;
 void LogMessage(PASSTHRU_MSG * pMsg, LogMessageType msgType, unsigned long channelId, char * comment);
 
 
-#define INDENT_AND_DECORATE(handle,debug_field) { \
-	if (debug_field==ERR)	\
-		handle << "==>";	\
-	if (debug_field>INIT)	\
-		handle << " ";		\
-	if (debug_field>MAINFUNC)	\
-		handle << " ";		\
-	if ( (debug_field==PROTOCOL_VERBOSE) \
-		|| (debug_field==PROTOCOL_MSG_VERBOSE)	\
-		|| (debug_field==KEPLER_MSG_VERBOSE) )	\
-		handle << " ";	\
-}
-
-
 #define LOG(debug_field,message, ...){	\
-	if (debug::debug_fields & debug_field)	\
-	{									\
-		char szMessageBuffer[1024] = {0};	\
-		SYSTEMTIME systemTime;				\
-		GetSystemTime( &systemTime );		\
-		sprintf_s(szMessageBuffer, 1024, "[%2d:%2d:%2d.%3d] ",systemTime.wHour,systemTime.wMinute,systemTime.wSecond,systemTime.wMilliseconds);\
-		std::ofstream handle;				\
-		try { \
-		handle.open(KEPLER_LOG_FILE,std::ios_base::app); \
-		handle << szMessageBuffer;			\
-		INDENT_AND_DECORATE(handle,debug_field)	\
-		sprintf_s(szMessageBuffer, 1024, message, __VA_ARGS__);\
-		handle << szMessageBuffer;			\
-		handle << "\n" << std::flush;					\
-		handle.close(); \
-		} \
-		catch(std::ofstream::failure e) {}\
-	}									\
+	if (LOG_ENABLED(debug_field))	\
+		debug::Log(debug_field, message, __VA_ARGS__);	\
 }
 
 #define LOG_BYTES(debug_field,count,bytes){	\
-	if (debug::debug_fields & debug_field)	\
-	{									\
-		char szMessageBuffer[64] = {0};	\
-		char szValBuffer[16] = {0};	\
-		SYSTEMTIME systemTime;				\
-		GetSystemTime( &systemTime );		\
-		sprintf_s(szMessageBuffer, 64, "[%2d:%2d:%2d.%3d] %d bytes: ",systemTime.wHour,systemTime.wMinute,systemTime.wSecond,systemTime.wMilliseconds,count);\
-		std::ofstream handle;				\
-		try { \
-			handle.open(KEPLER_LOG_FILE,std::ios_base::app); \
-			handle << szMessageBuffer;			\
-			INDENT_AND_DECORATE(handle,debug_field)	\
-			for (unsigned int i=0;i<count;i++) {			\
-			sprintf_s(szValBuffer,16,"%2x ",bytes[i]); \
-			handle << szValBuffer;	}		\
-			handle << "\n" << std::flush;					\
-			handle.close(); \
-		} \
-		catch(std::ofstream::failure e) {}\
-	}									\
+	if (LOG_ENABLED(debug_field))	\
+		debug::LogBytes(debug_field, count, (const unsigned char *)(bytes));	\
 }
 
-
-
 #define LOGW( debug_field, message, ...){ \
-	if (debug::debug_fields & debug_field)	\
-	{									\
-		WCHAR szMessageBuffer[1024] = {0}; \
-		char szMessageBufferAsc[1024] = {0}; \
-		SYSTEMTIME systemTime; \
-		GetSystemTime( &systemTime ); \
-		sprintf_s(szMessageBufferAsc, 1024, "[%2d:%2d:%2d.%3d] ",systemTime.wHour,systemTime.wMinute,systemTime.wSecond,systemTime.wMilliseconds); \
-		std::ofstream handle;  \
-		try { \
-			handle.open(KEPLER_LOG_FILE,std::ios_base::app);  \
-			handle << szMessageBufferAsc; \
-			swprintf_s(szMessageBuffer, 1024, message, __VA_ARGS__); \
-			char * ascbuffer = ConvertLPWSTRToLPSTR( szMessageBuffer ) ; \
-			handle << ascbuffer; \
-			delete ascbuffer; \
-			handle << "\n" << std::flush; \
-			handle.close(); \
-		} \
-		catch(std::ofstream::failure e) {}\
-	}\
+	if (LOG_ENABLED(debug_field))	\
+		debug::LogW(debug_field, message, __VA_ARGS__);	\
 }
 
 #define  dtDebug(message, ...) LOGW(HELPERFUNC,message,__VA_ARGS__)
@@ -129,6 +73,8 @@ void LogMessage(PASSTHRU_MSG * pMsg, LogMessageType msgType, unsigned long chann
 
 #else
 #define LOG(message,...)
+#define LOGW(message,...)
+#define LOG_BYTES(debug_field,count,bytes)
 #define LOGT(message,...)
 #define dtDebug(message,...)
 #endif
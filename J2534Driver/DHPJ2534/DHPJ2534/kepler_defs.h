@@ -15,7 +15,8 @@
 #define KEPLER_DLL_VERSION	"00.10"
 #define KEPLER_J2534_API_VERSION "04.04"
 
-#define MAX_J2534_MESSAGES 10
+#define MAX_J2534_MESSAGES 128	// per WriteMsgs call. Batch is queued as a whole and coalesced into few USB writes
+#define MAX_TX_FRAME_SIZE (6 + 4128)	// encoded device frame: START_BYTE, LenH, LenL, command, network type, addressing + PASSTHRU_MSG Data
 
 #define IGNORE_SILENTLY_UNIMPLEMENTED_FEATURES
 //#define ENFORCE_PROTOCOL_IDS_IN_MSGS  // seen atleast once occasion where VIDA sends msgs with protocol id 5997 when protocol is ISO 15765 (id 6)
@@ -105,10 +106,12 @@ static const struct J2534_error_msg {
 
 typedef struct
 {
-	char* data;
+	char* data;				// encoded frame, START_BYTE included
 	char* flags;
 	unsigned short dataLength;
 	unsigned long timeout;
+	unsigned long sequence;	// assigned by the channel when queued
+	PASSTHRU_MSG* loopback;	// copy of the original message to be looped back once sent, NULL if loopback is off
 } TX_QUEUE_MESSAGE;
 //typedef struct {
 //	unsigned long ProtocolID; /* vehicle network protocol */
@@ -46,7 +46,7 @@ namespace DHPJ2534Registry {
 			return res;
 
 		// check the type
-		if (dwType != REG_SZ)
+		if ((dwType != REG_SZ) && (dwType != REG_EXPAND_SZ))
 			return ERROR_DATATYPE_MISMATCH;
 
 		dwBufSize = dwDataSize + (1 * sizeof(TCHAR));
@@ -213,6 +213,51 @@ namespace DHPJ2534Registry {
 		return true;
 	}
 
+	// string value (REG_SZ or REG_EXPAND_SZ, not expanded). Caller frees the returned string
+	bool GetStringFromRegistry(HKEY previousKey, TCHAR * valueName, LPTSTR * value)
+	{
+		HKEY hKeySoftware, hKeyPTS0404, hKeySardineCAN;
+		int ret;
+
+		if (previousKey == NULL)
+		{
+			if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, _T("Software"), 0, KEY_READ, &hKeySoftware) != ERROR_SUCCESS)
+			{
+				LOG(ERR, "GetSettingsFromRegistry: Cannot open registry key: SOFTWARE");
+				return FALSE;
+			}
+			if (RegOpenKeyEx(hKeySoftware, L"PassThruSupport.04.04", 0, KEY_READ, &hKeyPTS0404) != ERROR_SUCCESS)
+			{
+				LOG(ERR, "GetSettingsFromRegistry: Cannot open registry key: PassThruSupport.04.04!");
+				RegCloseKey(hKeySoftware);
+				return FALSE;
+			}
+			RegCloseKey(hKeySoftware);
+
+			if (RegOpenKeyEx(hKeyPTS0404, L"Kepler", 0, KEY_READ, &hKeySardineCAN) != ERROR_SUCCESS)
+			{
+				LOG(ERR, "GetSettingsFromRegistry: Couldn't find Kepler entry in registry!");
+				RegCloseKey(hKeyPTS0404);
+				return FALSE;
+			}
+			RegCloseKey(hKeyPTS0404);
+		}
+		else
+			hKeySardineCAN = previousKey;
+
+		ret = Registry_GetString(hKeySardineCAN, valueName, value);
+		if (previousKey == NULL)
+			RegCloseKey(hKeySardineCAN);
+
+		if (ret != ERROR_SUCCESS)
+		{
+			*value = NULL;
+			LOGW(ERR, L"GetSettingsFromRegistry: No %s entry!", valueName);
+			return false;
+		}
+		return true;
+	}
+
 	std::list<LPTSTR> GetVirtualSerialPortName(const char * PID, const char * VID)
 	{
 		std::list<LPTSTR> ports;
@@ -8,5 +8,6 @@ namespace DHPJ2534Registry {
 
 	bool GetSettingsFromRegistry(const char * deviceName, int * ComPort, int * BaudRate, int * disableDTR, unsigned long * deviceId);
 	bool GetValueFromRegistry(HKEY previousKey, TCHAR * valueName, unsigned long * value);
+	bool GetStringFromRegistry(HKEY previousKey, TCHAR * valueName, LPTSTR * value);	// caller frees value
 	std::list<LPTSTR> GetVirtualSerialPortName(const char * PID, const char * VID);
 }
\ No newline at end of file
@@ -40,10 +40,16 @@ src\USB\USBCallbacks.c
 
 src\Vehicle\CAN\CanFilter.c
 
+src\Vehicle\CAN\CanIsoTp.c
+
+src\Vehicle\CAN\CanTimerWheel.c
+
 src\Vehicle\CAN\kcan.c
 
 src\Vehicle\J1850\VPW\j1850vpw.c
 
+src\Vehicle\Periodic\periodic.c
+
 src\ASF\common\services\sleepmgr\sam\sleepmgr.c
 
 src\ASF\common\services\usb\class\cdc\device\udi_cdc.c
@@ -30,11 +30,18 @@
 #define TP_TIMEOUT												0x0F
 #define MESSAGE_FILTER_INDEX_OUT_OF_BOUNDS						0x10
 #define INVALID_FILTER_TYPE_BYTE								0X11
+#define PERIODIC_INDEX_OUT_OF_BOUNDS							0x12
+#define INVALID_PERIODIC_MESSAGE								0x13
 #define INVALID_KEY												0x14
+#define CAN_RX_OVERFLOW											0x15
+#define VPW_RX_OVERFLOW											0x16
+#define VPW_TX_BUS_COLLISION									0x17
+#define TP_WRONG_SEQUENCE_NUMBER								0x18
 
 //Thrower IDs, used if message byte not applicable
 #define THROWER_ID_COMMAND_RESPONSE_SYSTEM						0x01
 #define THROWER_ID_FLASH_SERVICE								0x02
 #define THROWER_ID_ISO_TP										0x03
+#define THROWER_ID_CAN											0x04
 
 #endif /* ERRORS_H_ */
\ No newline at end of file
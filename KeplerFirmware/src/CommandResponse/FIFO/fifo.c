@@ -19,6 +19,12 @@
 	return f->tail == f-> head ? true : false;
  }
 
+ //True if fifo_write would fail
+ bool fifo_full(fifo_t * f){
+
+	return ( (f->head + 1 == f->tail) || ( (f->head + 1 == f->size) && (f->tail == 0) ) ) ? true : false;
+ }
+
 //Reads a message from the fifo
  Message_t * fifo_read(fifo_t * f){
 	 Message_t * msg;
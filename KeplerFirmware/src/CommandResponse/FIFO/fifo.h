@@ -22,6 +22,7 @@ typedef struct {
 
 void fifo_init(fifo_t * f);
 bool fifo_empty(fifo_t * f);
+bool fifo_full(fifo_t * f);
 bool fifo_write(fifo_t * f, Message_t * message);
 Message_t* fifo_read(fifo_t * f);
 #endif /* FIFO_H_ */
\ No newline at end of file
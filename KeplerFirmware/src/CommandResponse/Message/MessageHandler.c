@@ -7,56 +7,175 @@
 //USB Message Receive
 #include "MessageHandler.h"
 
-char MessageAvailable = 0;
-Message_t IncommingMessage;
-//Message in
+volatile char USBDataAvailable = 0;
+
+//Bytes from the CDC receive notification, parsed into commands in the main loop.
+//Head is only written by PullUSBData, tail only by ParseUSBData.
+static uint8_t USBRxRing[USB_RX_RING_SIZE];
+static volatile uint32_t USBRxHead = 0;
+static volatile uint32_t USBRxTail = 0;
+
+//Command parser state
+static CommandParseState_t ParseState = PARSE_START_BYTE;
+static uint16_t ParseLength = 0;
+static uint16_t ParseCount = 0;
+static bool StartByteErrorReported = false;
+
+//Complete commands waiting to run. Buffers are used in turn, a buffer is free again once its command has run.
+static unsigned char CommandBuffers[FIFO_DEPTH][MESSAGE_BUFFER_SIZE];
+static Message_t CommandMessages[FIFO_DEPTH];
+static int CommandSlot = 0;
+static fifo_t CommandFifo;
+
+static void PullUSBData(void);
+static void ParseUSBData(void);
+
+void InitalizeCommandParser()
+{
+	fifo_init(&CommandFifo);
+	for(int i = 0; i < FIFO_DEPTH; i++)
+	{
+		CommandMessages[i].buf = CommandBuffers[i];
+		CommandMessages[i].Size = 0;
+	}
+	ParseState = PARSE_START_BYTE;
+}
+
+//CDC receive notification (interrupt context). Data is moved to the receive ring right away, commands are
+//parsed and run from the main loop
 void ReceiveUSBMessage(uint8_t port)
 {
-	//Read a byte
-	int currByte = udi_cdc_getc();
+	PullUSBData();
+	USBDataAvailable = 1;
+}
 
-	if(currByte == START_BYTE )
+//Moves received data from the CDC buffer to the receive ring, as much as fits
+static void PullUSBData()
+{
+	while(udi_cdc_is_rx_ready())
 	{
-		//Set the LEDs
-		ui_com_rx_start();
-		//Get the lengths and the command
-		int LenA = udi_cdc_getc();
-		int LenB = udi_cdc_getc();
-		int CommandLength = (LenA << 8) | LenB;
-		int ByteCounter = 0;	
-		
-		//Make sure we have enough bytes available
-		if( (udi_cdc_get_available_rx_bytes() - 3) < CommandLength)
+		uint32_t Head = USBRxHead;
+		uint32_t Free = USB_RX_RING_SIZE - (Head - USBRxTail);
+		if(Free == 0)
 		{
-			Error_T InvalidLengthByteError;
-			InvalidLengthByteError.ThrowerID = THROWER_ID_COMMAND_RESPONSE_SYSTEM;
-			InvalidLengthByteError.ErrorMajor = INVALID_LENGTH_BYTES;
-			InvalidLengthByteError.ErrorMinor = ERROR_NO_MINOR_CODE;
-			ThrowError(&InvalidLengthByteError);
-			udi_cdc_flush_rx_buffer();
+			//The rest stays in the CDC buffer until the main loop has made room
+			USBDataAvailable = 1;
 			return;
 		}
-		//Set the buffer up and read the data
-		IncommingMessage.buf = IncomingMessageBuffer;
-		IncommingMessage.Size = CommandLength;
-		udi_cdc_read_buf(IncommingMessage.buf, IncommingMessage.Size);
-		udi_cdc_flush_rx_buffer();
-		//Set the LEDs
-		ui_com_rx_stop();
-		//We have a message available
-		MessageAvailable = 1;
-	}	
-	else
-	{
-		//Was not a start byte
-		Error_T InvalidLengthByteError;
-		InvalidLengthByteError.ThrowerID = THROWER_ID_COMMAND_RESPONSE_SYSTEM;
-		InvalidLengthByteError.ErrorMajor = INVALID_START_BYTE_EXCEPTION;
-		InvalidLengthByteError.ErrorMinor = currByte;
-		ThrowError(&InvalidLengthByteError);
-		udi_cdc_flush_rx_buffer();
+		uint32_t Index = Head & (USB_RX_RING_SIZE - 1);
+		uint32_t Size = USB_RX_RING_SIZE - Index;
+		if(Size > Free)
+		{
+			Size = Free;
+		}
+		iram_size_t Available = udi_cdc_read_no_polling(USBRxRing + Index, Size);
+		if(Available == 0)
+		{
+			return;
+		}
+		USBRxHead = Head + ((Available < Size) ? Available : Size);
 	}
+}
+
+//Runs every received command
+void ProcessUSBMessages()
+{
+	USBDataAvailable = 0;
+	
+	//Data that didn't fit in the ring when it arrived
+	irqflags_t flags = cpu_irq_save();
+	PullUSBData();
+	cpu_irq_restore(flags);
+	
+	do
+	{
+		ParseUSBData();
+		Message_t *Command;
+		while( (Command = fifo_read(&CommandFifo)) != NULL )
+		{
+			HandleMessage(Command);
+		}
+	} while(USBRxTail != USBRxHead);
+}
 
+//Assembles commands (START_BYTE, LenH, LenL, command...) from the receive ring. A command may arrive in several
+//USB packets and one packet may hold several commands. Stops when the command FIFO is full.
+static void ParseUSBData()
+{
+	uint32_t Tail = USBRxTail;
+	
+	while(Tail != USBRxHead)
+	{
+		uint8_t Byte = USBRxRing[Tail & (USB_RX_RING_SIZE - 1)];
+		
+		switch(ParseState)
+		{
+			case PARSE_START_BYTE:
+				//Don't start a command there is no room for
+				if(fifo_full(&CommandFifo))
+				{
+					USBRxTail = Tail;
+					return;
+				}
+				if(Byte != START_BYTE)
+				{
+					//Skip until the next start byte, report only the first bad byte
+					if(!StartByteErrorReported)
+					{
+						Error_T InvalidStartByteError;
+						InvalidStartByteError.ThrowerID = THROWER_ID_COMMAND_RESPONSE_SYSTEM;
+						InvalidStartByteError.ErrorMajor = INVALID_START_BYTE_EXCEPTION;
+						InvalidStartByteError.ErrorMinor = Byte;
+						ThrowError(&InvalidStartByteError);
+						StartByteErrorReported = true;
+					}
+					break;
+				}
+				StartByteErrorReported = false;
+				//Set the LEDs
+				ui_com_rx_start();
+				ParseState = PARSE_LENGTH_MSB;
+			break;
+			
+			case PARSE_LENGTH_MSB:
+				ParseLength = Byte << 8;
+				ParseState = PARSE_LENGTH_LSB;
+			break;
+			
+			case PARSE_LENGTH_LSB:
+				ParseLength |= Byte;
+				//Make sure the command fits
+				if( (ParseLength == 0) || (ParseLength > MESSAGE_BUFFER_SIZE) )
+				{
+					Error_T InvalidLengthByteError;
+					InvalidLengthByteError.ThrowerID = THROWER_ID_COMMAND_RESPONSE_SYSTEM;
+					InvalidLengthByteError.ErrorMajor = INVALID_LENGTH_BYTES;
+					InvalidLengthByteError.ErrorMinor = ERROR_NO_MINOR_CODE;
+					ThrowError(&InvalidLengthByteError);
+					ui_com_rx_stop();
+					ParseState = PARSE_START_BYTE;
+					break;
+				}
+				ParseCount = 0;
+				ParseState = PARSE_BODY;
+			break;
+			
+			case PARSE_BODY:
+				CommandBuffers[CommandSlot][ParseCount++] = Byte;
+				if(ParseCount == ParseLength)
+				{
+					CommandMessages[CommandSlot].Size = ParseLength;
+					fifo_write(&CommandFifo, &CommandMessages[CommandSlot]);
+					CommandSlot = (CommandSlot + 1) % FIFO_DEPTH;
+					//Set the LEDs
+					ui_com_rx_stop();
+					ParseState = PARSE_START_BYTE;
+				}
+			break;
+		}
+		Tail++;
+	}
+	USBRxTail = Tail;
 }
 
 
@@ -91,7 +210,7 @@ void HandleMessage(Message_t *message)
 		break;
 		
 		case ENTER_SECURE_MODE:
-			EnterSecureMode( (IncomingMessageBuffer[1] << 24) | (IncomingMessageBuffer[2] << 16) | (IncomingMessageBuffer[3] << 8) | (IncomingMessageBuffer[4] << 0)  );
+			EnterSecureMode( (message->buf[1] << 24) | (message->buf[2] << 16) | (message->buf[3] << 8) | (message->buf[4] << 0)  );
 		break;
 
 		case EXIT_SECURE_MODE:
@@ -105,6 +224,22 @@ void HandleMessage(Message_t *message)
 		case ENTER_VPW_4X:
 			VPWEnter4xMode();
 		break;
+		
+		case SET_VPW_RETRIES:
+			VPWSetRetries(message);
+		break;
+		
+		case SET_VPW_STREAMING:
+			VPWSetStreaming(message);
+		break;
+		
+		case SET_PERIODIC_MSG:
+			SetPeriodicMessage(message);
+		break;
+		
+		case SET_PERIODIC_TMR:
+			SetPeriodicTimer(message);
+		break;
 			
 		case FIRMWARE_UPDATE:
 			EnterBootloader();
@@ -119,8 +254,19 @@ void HandleMessage(Message_t *message)
 		break;
 		
 		case DELETE_CAN_FILTER:
-		//RemoveFilter(message->buf[1]);
-		RemoveMailbox(message->buf[1]); 		
+			DeleteCanFilter(message);
+		break;
+		
+		case SET_ISOTP_PARAMS:
+			SetIsoTpParameters(message);
+		break;
+		
+		case SET_CAN_RX_BATCHING:
+			SetCanRxBatching(message);
+		break;
+		
+		case CAN_FILTER_HITS:
+			SendCanFilterHits(message);
 		break;
 		
 		case READ_ADC_VALUE: 
@@ -139,8 +285,9 @@ void ResetDevice()
 	SystemConfiguration.in_secure_mode = 0;
 	SystemConfiguration.pc_com_mode = PC_COM_MODE_USB;
 	SystemConfiguration.vehicle_com_mode = NONE;
+	PeriodicSetVehicleMode(NONE);
 	VPWFilterEnable = true;
-	udi_cdc_flush_rx_buffer();
+	DeleteAllPeriodicMessages();
 	SendStatusReport(RESET_DEVICE);
 }
 
@@ -151,18 +298,106 @@ void ResetDevice()
 	uint16_t FilterLength; 
 	//Length of the filter
 	FilterLength = message->buf[1] << 8 | message->buf[2];	
-	//Creates the Filter
-	CreateFilter(message->buf[3],message->buf+5,message->buf+FilterLength+5,message->buf+FilterLength+FilterLength+5,FilterLength);
-	//Sets up a receiver mailbox (see CAN section of datasheet)
-	InitalizeReceiverMailbox(message->buf[1],message->buf+5,message->buf+FilterLength+5);
+	//Sets up the receiver mailboxes (see CAN section of datasheet)
+	uint8_t Handle = InitalizeReceiverMailbox(message->buf[4],message->buf+5,message->buf+FilterLength+5);
+	if( (Handle != CAN_RX_NO_FILTER) && (message->buf[3] == CAN_FLOW_CONTROL_FILTER) )
+	{
+		//The device answers first frames itself
+		IsoTpAddFlowControl(Handle, message->buf[4], message->buf+5, message->buf+FilterLength+5, message->buf+FilterLength+FilterLength+5, FilterLength);
+	}
+	if(Handle == CAN_RX_NO_FILTER)
+	{
+		//Thrown by the command, the error is the answer the host waits for
+		Error_T OutOfBoundsError;
+		OutOfBoundsError.ThrowerID = CREATE_CAN_FILTER;
+		OutOfBoundsError.ErrorMajor = MESSAGE_FILTER_INDEX_OUT_OF_BOUNDS;
+		OutOfBoundsError.ErrorMinor = ERROR_NO_MINOR_CODE;
+		ThrowError(&OutOfBoundsError);
+		return;
+	}
 	//Notify user we did it
-	char tmpRtn[] = {START_BYTE,0x00,0x03,CREATE_CAN_FILTER,0x01,rx_mailbox_num-1};
+	char tmpRtn[] = {START_BYTE,0x00,0x03,CREATE_CAN_FILTER,0x01,Handle};
 	Message_t CanRxSettingsAck;
 	CanRxSettingsAck.buf = tmpRtn;
 	CanRxSettingsAck.Size = 6;
 	WriteMessage(&CanRxSettingsAck);
  }
  
+ //Removes a CAN filter and the flow control of the device for it
+ void DeleteCanFilter(Message_t *message)
+ {
+	if(message->Size < 2)
+	{
+		Error_T InvalidLengthError;
+		InvalidLengthError.ThrowerID = DELETE_CAN_FILTER;
+		InvalidLengthError.ErrorMajor = INVALID_LENGTH_BYTES;
+		InvalidLengthError.ErrorMinor = message->Size;
+		ThrowError(&InvalidLengthError);
+		return;
+	}
+	IsoTpRemoveFlowControl(message->buf[1]);
+	bool Found = RemoveMailbox(message->buf[1]);
+	
+	uint8_t tmpRtn[] = {START_BYTE, 0x00, 0x03, DELETE_CAN_FILTER, Found ? 0x01 : 0x00, message->buf[1]};
+	Message_t DeleteFilterMessage;
+	DeleteFilterMessage.buf = tmpRtn;
+	DeleteFilterMessage.Size = sizeof(tmpRtn);
+	WriteMessage(&DeleteFilterMessage);
+ }
+
+ //Sets the block size and STmin of the flow control frames the device sends
+ void SetIsoTpParameters(Message_t *message)
+ {
+	if(message->Size < 3)
+	{
+		Error_T InvalidLengthError;
+		InvalidLengthError.ThrowerID = SET_ISOTP_PARAMS;
+		InvalidLengthError.ErrorMajor = INVALID_LENGTH_BYTES;
+		InvalidLengthError.ErrorMinor = message->Size;
+		ThrowError(&InvalidLengthError);
+		return;
+	}
+	IsoTpSetParameters(message->buf[1], message->buf[2]);
+	
+	uint8_t tmpRtn[] = {START_BYTE, 0x00, 0x02, SET_ISOTP_PARAMS, 0x01};
+	Message_t SetParametersMessage;
+	SetParametersMessage.buf = tmpRtn;
+	SetParametersMessage.Size = 5;
+	WriteMessage(&SetParametersMessage);
+ }
+ 
+ //<flags, bit 0 write at USB start of frame> <latency in us, 2 bytes>
+ void SetCanRxBatching(Message_t *message)
+ {
+	if(message->Size < 4)
+	{
+		Error_T InvalidLengthError;
+		InvalidLengthError.ThrowerID = SET_CAN_RX_BATCHING;
+		InvalidLengthError.ErrorMajor = INVALID_LENGTH_BYTES;
+		InvalidLengthError.ErrorMinor = message->Size;
+		ThrowError(&InvalidLengthError);
+		return;
+	}
+	CanSetRxBatching(message->buf[1] & 0x01, (message->buf[2] << 8) | message->buf[3]);
+	
+	uint8_t tmpRtn[] = {START_BYTE, 0x00, 0x02, SET_CAN_RX_BATCHING, 0x01};
+	Message_t SetBatchingMessage;
+	SetBatchingMessage.buf = tmpRtn;
+	SetBatchingMessage.Size = 5;
+	WriteMessage(&SetBatchingMessage);
+ }
+ 
+ //Reports how many frames matched a CAN filter
+ void SendCanFilterHits(Message_t *message)
+ {
+	uint32_t Hits = 0;
+	bool Found = GetCanFilterHits(message->buf[1], &Hits);
+	uint8_t tmpRtn[] = {START_BYTE,0x00,0x07,CAN_FILTER_HITS,Found ? 0x01 : 0x00,message->buf[1],(Hits >> 24) & 0xFF,(Hits >> 16) & 0xFF,(Hits >> 8) & 0xFF,Hits & 0xFF};
+	Message_t HitsMessage;
+	HitsMessage.buf = tmpRtn;
+	HitsMessage.Size = sizeof(tmpRtn);
+	WriteMessage(&HitsMessage);
+ }
 			
 //Writes a message out to the user depending on the mode the interface is in (Bluetooth or USB)
 void WriteMessage(Message_t *OutgoingMessage)
@@ -206,15 +441,16 @@ void WriteVehicleMessage(Message_t *OutgoingMessage)
 	switch(SystemConfiguration.vehicle_com_mode)
 	{
 		case VPW_MODE:
-			//Disable interrupts here do we dont accidently screw up the transmission
-			cpu_irq_disable();
-			VPWSendNetworkMessage(OutgoingMessage->buf + 1,	OutgoingMessage->Size-1);
-			//Re-enable interrupts
-			cpu_irq_enable();
+			//Wait for the bus, the frame itself is sent from the timer interrupt. Received frames and the
+			//result of the previous frame still have to go out meanwhile.
+			while(VPWSendNetworkMessage(OutgoingMessage->buf + 1, OutgoingMessage->Size-1, true) == VPW_RETURN_CODE_BUS_BUSY)
+			{
+				VPWProcessReceivedFrames();
+			}
 		break;
 		
 		case CAN_MODE:
-		 HandleSendCanRequest(OutgoingMessage);
+			HandleSendCanRequest(OutgoingMessage);
 		break;
 	}
 }
@@ -331,6 +567,7 @@ void SetInterfaceMode(Message_t *message)
 		break;
 	}
 	
+	PeriodicSetVehicleMode(SystemConfiguration.vehicle_com_mode);
 	SendStatusReport(SET_INTERFACE_MODE);
 }
 //Sets the boot flags to boot from ROM (Bootloader) for firmware update using SAM-BA (See Datasheet/SAM-BA documentation)
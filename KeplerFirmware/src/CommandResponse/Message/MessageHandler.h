@@ -22,20 +22,29 @@
 #include "adc.h"
 #include "CanFilter.h"
 #include "kcan.h"
+#include "fifo.h"
+#include "periodic.h"
 
 #define STATUS_MESSAGE_LENGTH 7
 #define MESSAGE_BYTES_TO_LENGTH_LSB 3
 
-//Message buffer for USB 
-static char IncomingMessageBuffer[MESSAGE_BUFFER_SIZE];
+#define USB_RX_RING_SIZE 2048	//Must be a power of two
+
+typedef enum {
+	PARSE_START_BYTE,
+	PARSE_LENGTH_MSB,
+	PARSE_LENGTH_LSB,
+	PARSE_BODY
+} CommandParseState_t;
+
 //Message buffer for vehicle communication
 static unsigned char VehicleMessageBuffer[MESSAGE_BUFFER_SIZE];
 
-extern Message_t IncommingMessage;
-
-extern char MessageAvailable;
+extern volatile char USBDataAvailable;
 
+void InitalizeCommandParser(void);
 void ReceiveUSBMessage(uint8_t port);
+void ProcessUSBMessages(void);
 void RunCommand(Message_t message);
 void HandleMessage(Message_t *message);
 void WriteMessage(Message_t *OutgoingMessage);
@@ -46,6 +55,10 @@ void WriteVehicleMessage(Message_t *OutgoingMessage);
 void SetCommunicationMode(Message_t *message);
 void SetInterfaceMode(Message_t *OutgoingMessage);
 void CreateCanFilter(Message_t *message);
+void DeleteCanFilter(Message_t *message);
+void SendCanFilterHits(Message_t *message);
+void SetIsoTpParameters(Message_t *message);
+void SetCanRxBatching(Message_t *message);
 void EnterBootloader(void);
 void ResetDevice(void);
 
@@ -19,10 +19,13 @@
 #define STATUS_REQUEST			/*|*/		0x00	/*|						N					|				Y			*/
 #define SET_INTERFACE_MODE		/*|*/		0xA0 	/*|						N					|				Y			*/
 #define SEND_MESSAGE			/*|*/		0xA1	/*|						N					|				Y			*/
+#define SEND_MESSAGE_RESULT		/*|*/		0xA2	/*|						N					|				Y			*/
 #define ENTER_VPW_1X			/*|*/		0xB0	/*|						N					|				Y			*/
 #define ENTER_VPW_4X			/*|*/		0xB1	/*|						N					|				Y			*/
-#define SET_PERIODIC_MSG		/*|*/		0xB4	/*|						N					|				N			*/
-#define SET_PERIODIC_TMR		/*|*/		0xB5	/*|						N					|				N			*/
+#define SET_VPW_RETRIES			/*|*/		0xB2	/*|						N					|				Y			*/
+#define SET_VPW_STREAMING		/*|*/		0xB3	/*|						N					|				Y			*/
+#define SET_PERIODIC_MSG		/*|*/		0xB4	/*|						N					|				Y			*/
+#define SET_PERIODIC_TMR		/*|*/		0xB5	/*|						N					|				Y			*/
 #define READ_ADC_VALUE			/*|*/		0xBD	/*|						N					|				Y			*/
 #define ENABLE_PERIODIC_ADC		/*|*/		0xBE	/*|						N					|				Y			*/
 #define DISABLE_PERIODIC_ADC	/*|*/		0xBF	/*|						N					|				Y			*/
@@ -34,6 +37,9 @@
 #define CREATE_CAN_FILTER		/*|*/		0xC5	/*|						N					|				Y			*/
 #define INIT_CAN_MAILBOX		/*|*/		0xC6	/*|						N					|				Y			*/
 #define SET_CAN_BAUD			/*|*/		0xC7	/*|						N					|				N			*/
+#define CAN_FILTER_HITS			/*|*/		0xC8	/*|						N					|				Y			*/
+#define SET_ISOTP_PARAMS		/*|*/		0xC9	/*|						N					|				Y			*/
+#define SET_CAN_RX_BATCHING		/*|*/		0xCA	/*|						N					|				Y			*/
 #define VERSION_REQUEST			/*|*/		0xE0	/*|						N					|				Y			*/
 #define READ_UNIQUE_ID			/*|*/		0xE1	/*|						N					|				Y			*/
 #define ENTER_SECURE_MODE		/*|*/		0xE2	/*|						N					|				Y			*/
@@ -46,7 +52,11 @@
 /*________________________________|___________________|_________________________________________|___________________________*/
 
 
+//Received frames: START_BYTE LenH LenL NETWORK_MESSAGE <network type> <time, 4 bytes> ...
+//Time is RunTimeMicroseconds() at the start of the frame on the bus, MSB first
 #define NETWORK_MESSAGE	0xAA
+#define NETWORK_TIME_SIZE 4
+#define NETWORK_BATCH	0xAB		//Several received frames in one container, see kcan.h
 
 
 
@@ -5,7 +5,13 @@
  *  Author: Aaron
  */ 
  #include "runtimer.h"
-//Starts a timer on boot up of the interface. The timer counts in Milliseconds. 
+ 
+//SAM4E TC counters are 32 bit (TC_CV), this counts their overflows for the bits above
+static volatile uint32_t RunTimerWraps = 0;
+
+static uint64_t RunTimerTicks(void);
+
+//Starts a timer on boot up of the interface. The counter runs free, only its overflow interrupts.
  void StartRunTimer()
  {
 	 sysclk_enable_peripheral_clock(RUN_TIMER_ID);
@@ -13,26 +19,53 @@
 	 tc_init(
 	 RUN_TIMER,
 	 RUN_TIMER_CHANNEL,
-	 TC_CMR_TCCLKS_TIMER_CLOCK4|
-	 TC_CMR_BURST_NONE|TC_CMR_CPCTRG
+	 TC_CMR_TCCLKS_TIMER_CLOCK3|
+	 TC_CMR_BURST_NONE
 	 );
-	 tc_write_rc(RUN_TIMER, RUN_TIMER_CHANNEL, cpu_ms_2_cy(1,96000000));
-	 tc_enable_interrupt(RUN_TIMER, RUN_TIMER_CHANNEL,  TC_IER_CPCS);
-	 NVIC_EnableIRQ(TC2_IRQn);
-	 NVIC_SetPriority(TC2_IRQn,0);
+	 tc_enable_interrupt(RUN_TIMER, RUN_TIMER_CHANNEL, TC_IER_COVFS);
+	 //Highest priority, so the receive interrupts always see the wrap count of the counter value they read
+	 NVIC_EnableIRQ(RUN_TIMER_IRQ);
+	 NVIC_SetPriority(RUN_TIMER_IRQ,0);
 	 tc_start(RUN_TIMER, RUN_TIMER_CHANNEL);
  }
+//Gets the current run time in microseconds
+ uint32_t RunTimeMicroseconds()
+ {
+	 return (uint32_t)(RunTimerTicks() / RUN_TIMER_TICKS_PER_US);
+ }
 //Gets the current run time in milliseconds
  unsigned long long millis()
  {
-	 return RunTimeMilliseconds;
+	 return RunTimerTicks() / (RUN_TIMER_HZ / 1000);
+ }
+ 
+ static uint64_t RunTimerTicks()
+ {
+	 uint32_t Wraps;
+	 uint32_t Ticks;
+	 uint32_t Pending;
+	 //Read again if the counter wrapped in between
+	 do
+	 {
+		 Wraps = RunTimerWraps;
+		 Ticks = tc_read_cv(RUN_TIMER, RUN_TIMER_CHANNEL);
+		 Pending = NVIC_GetPendingIRQ(RUN_TIMER_IRQ);
+	 } while(Wraps != RunTimerWraps);
+	 //The counter wrapped but the interrupt hasn't run yet (interrupts off, or called from one of the same
+	 //priority). Not TC_SR_COVFS, reading the status would clear it before the interrupt sees it. A small
+	 //count means the wrap came before the read, a large one that it came in between and isn't in Ticks.
+	 if(Pending && (Ticks < 0x80000000))
+	 {
+		 Wraps++;
+	 }
+	 return ((uint64_t)Wraps << 32) | Ticks;
  }
 //Timer interrupt.
- void TC2_Handler()
+ void RUN_TIMER_HANDLER()
  {
-	if ((tc_get_status(RUN_TIMER, RUN_TIMER_CHANNEL) & TC_SR_CPCS) == TC_SR_CPCS)
+	if ((tc_get_status(RUN_TIMER, RUN_TIMER_CHANNEL) & TC_SR_COVFS) == TC_SR_COVFS)
 	{
-		NVIC_ClearPendingIRQ(TC2_IRQn);
-		RunTimeMilliseconds++;
+		NVIC_ClearPendingIRQ(RUN_TIMER_IRQ);
+		RunTimerWraps++;
 	}
- }
\ No newline at end of file
+ }
@@ -12,8 +12,14 @@
 #include "Timers.h"
 #include <asf.h>
 
-static unsigned long long RunTimeMilliseconds = 0;
+//Free running, TIMER_CLOCK3. Received frames are stamped with it.
+#define RUN_TIMER_HZ (sysclk_get_peripheral_hz() / 32)
+#define RUN_TIMER_TICKS_PER_US (RUN_TIMER_HZ / 1000000)
+
 void StartRunTimer(void);
+//Time since StartRunTimer, wraps after about 71 minutes. Also right with interrupts off, as long as they are
+//not off for half a turn of the counter (about 12 minutes).
+uint32_t RunTimeMicroseconds(void);
 unsigned long long millis(void);
 
-#endif /* RUNTIMER_H_ */
\ No newline at end of file
+#endif /* RUNTIMER_H_ */
@@ -5,6 +5,7 @@
  *  Author: adeck
  */ 
 #include "USBCallbacks.h"
+#include "kcan.h"
 
 
 //ASF USB Callbacks. See ASF Documentation.
@@ -21,6 +22,8 @@ void main_resume_action(void)
 
 void main_sof_action(void)
 {
+	//Received CAN frames go out with this USB frame
+	CanRxStartOfFrame();
 #ifdef LED_USB_FRAME_COUNTER
 	//Flash USB LED
 	ui_com_process(udd_get_frame_number());
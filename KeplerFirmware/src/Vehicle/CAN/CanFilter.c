@@ -81,10 +81,9 @@ void DeleteAllFilters()
 	}
 	
 	FilterCounter = 0;
-	rx_mailbox_num = 1;
-	can_disable_interrupt(SYSTEM_CAN, CAN_DISABLE_ALL_INTERRUPT_MASK);
-	can_enable_interrupt(SYSTEM_CAN, CAN_IER_ERRA | CAN_IER_WARN | CAN_IER_ERRP | CAN_IER_BOFF | CAN_IER_BERR);
-	can_reset_all_mailbox(SYSTEM_CAN);
+	//Only the receive mailboxes, frames may still be waiting in the transmit ones
+	RemoveAllReceiverMailboxes();
+	IsoTpRemoveAllFlowControl();
 	
 	uint8_t DeleteFiltersSuccess[] = {START_BYTE, 0x00,0x02,DELETE_CAN_FILTER, 0x01};
 	Message_t tmpMsg;
@@ -11,8 +11,14 @@
 
 #include "asf.h"
 #include "kcan.h"
+#include "CanIsoTp.h"
 #define MAX_FILTERS 254
 
+//Filter types
+#define CAN_BLOCK_FILTER 0
+#define CAN_PASS_FILTER 1
+#define CAN_FLOW_CONTROL_FILTER 3
+
 static uint8_t FilterCounter = 1;
 static uint32_t FilterID = 1;
 
@@ -0,0 +1,723 @@
+/*
+ * CanIsoTp.c
+ *
+ * Everything up to IsoTpProcessReceivedMessages runs in the CAN interrupt, or at the same priority in the timer
+ * wheel callbacks, so none of it can interrupt the rest. The filter table is also changed from the main loop, with
+ * both interrupts off.
+ *
+ * The main loop only claims transmit sessions that are idle and frees the ones that failed, the interrupts leave
+ * sessions in those states alone.
+ */
+#include "CanIsoTp.h"
+
+static IsoTpFlowControl_t IsoTpFlowControls[CAN_MAX_RX_FILTERS];
+static volatile uint8_t IsoTpFlowControlCount = 0;
+
+static uint8_t IsoTpBlockSize = ISOTP_DEFAULT_BS;
+static uint8_t IsoTpSTmin = ISOTP_DEFAULT_STMIN;
+
+static IsoTpRxSession_t IsoTpRxSessions[ISOTP_RX_SESSIONS];
+static IsoTpTxSession_t IsoTpTxSessions[ISOTP_TX_SESSIONS];
+
+//Finished records, written to the host by the main loop. 0 is free, 1 is being filled, anything else is ready.
+static uint8_t IsoTpRxRecords[ISOTP_RX_BUFFERS][ISOTP_RX_RECORD_SIZE];
+static volatile uint16_t IsoTpRxRecordLength[ISOTP_RX_BUFFERS];
+static volatile uint32_t IsoTpRxRecordSeq[ISOTP_RX_BUFFERS];
+static uint32_t IsoTpRxSeq = 0;
+static volatile uint32_t IsoTpRxDropped = 0;
+static volatile uint32_t IsoTpRxBadSequence = 0;
+static volatile uint32_t IsoTpRxTimeouts = 0;
+
+#define ISOTP_RECORD_FREE 0
+#define ISOTP_RECORD_FILLING 1
+
+static IsoTpFlowControl_t *IsoTpFindFlowControl(uint32_t MID, const uint8_t *Data, uint8_t Length);
+static IsoTpRxSession_t *IsoTpFindRxSession(IsoTpFlowControl_t *Filter, uint32_t ID);
+static uint8_t *IsoTpClaimRecord(IsoTpFlowControl_t *Filter, uint32_t ID, uint8_t *Buffer);
+static void IsoTpFinishRecord(uint8_t Buffer, IsoTpFlowControl_t *Filter, uint16_t Length, uint32_t Time);
+static void IsoTpAbortSession(IsoTpRxSession_t *Session);
+static void IsoTpRxExpired(void *Context);
+static void IsoTpSendFlowControl(IsoTpFlowControl_t *Filter, uint8_t FlowStatus);
+static IsoTpTxSession_t *IsoTpFindTxSession(IsoTpFlowControl_t *Filter);
+static void IsoTpTxFlowControl(IsoTpTxSession_t *Tx, const uint8_t *Pci, uint8_t Available);
+static void IsoTpTxSendFrames(IsoTpTxSession_t *Tx);
+static void IsoTpTxExpired(void *Context);
+static void IsoTpTxFinish(IsoTpTxSession_t *Tx, uint8_t Error);
+static uint8_t IsoTpTxFrameHeader(IsoTpTxSession_t *Tx, uint8_t *Frame);
+static uint32_t IsoTpSTminToUs(uint8_t STmin);
+
+//Drops all sessions, called from InitalizeCanSystem after the timer wheel is set up
+void IsoTpInit()
+{
+	NVIC_DisableIRQ(SYSTEM_CAN_IRQ);
+	for(uint8_t i = 0; i < ISOTP_RX_SESSIONS; i++)
+	{
+		if(IsoTpRxSessions[i].Filter != NULL)
+		{
+			IsoTpRxRecordLength[IsoTpRxSessions[i].Buffer] = ISOTP_RECORD_FREE;
+			IsoTpRxSessions[i].Filter = NULL;
+		}
+		CanWheelTimerSetup(&IsoTpRxSessions[i].Timer, IsoTpRxExpired, &IsoTpRxSessions[i]);
+	}
+	for(uint8_t i = 0; i < ISOTP_TX_SESSIONS; i++)
+	{
+		IsoTpTxSessions[i].State = ISOTP_TX_IDLE;
+		CanWheelTimerSetup(&IsoTpTxSessions[i].Timer, IsoTpTxExpired, &IsoTpTxSessions[i]);
+	}
+	NVIC_EnableIRQ(SYSTEM_CAN_IRQ);
+}
+/*
+Adds a flow control filter. Mask and Pattern match the ECU's frames, FlowControl is the ID (and extended address)
+our flow control frames are sent with. Length is 4, or 5 for extended addressing.
+*/
+void IsoTpAddFlowControl(uint8_t Handle, uint8_t Extended29, uint8_t *Mask, uint8_t *Pattern, uint8_t *FlowControl, uint16_t Length)
+{
+	if( (Handle >= CAN_MAX_RX_FILTERS) || (Length < 4) )
+	{
+		return;
+	}
+
+	IsoTpFlowControl_t Filter;
+	Filter.Extended29 = Extended29 ? true : false;
+	Filter.ExtendedAddressing = (Length > 4);
+	//Same encoding as the acceptance filters in InitalizeReceiverMailbox
+	Filter.Mask = CAN_MID_MIDvA(Mask[2] << 8 | Mask[3]) | CAN_MID_MIDvB(Mask[0] << 8 | Mask[1]);
+	Filter.ID = CAN_MID_MIDvA(Pattern[2] << 8 | Pattern[3]) | CAN_MID_MIDvB(Pattern[0] << 8 | Pattern[1]);
+	if(Extended29)
+	{
+		Filter.ID |= CAN_MID_MIDE;
+		Filter.Mask |= CAN_MAM_MIDE;
+	}
+	Filter.ID &= Filter.Mask;
+	Filter.RxAddress = Filter.ExtendedAddressing ? Pattern[4] : 0;
+	Filter.RxAddressMask = Filter.ExtendedAddressing ? Mask[4] : 0;
+	memcpy(Filter.FlowControlID, FlowControl, 4);
+	Filter.TxAddress = Filter.ExtendedAddressing ? FlowControl[4] : 0;
+	Filter.Active = true;
+
+	NVIC_DisableIRQ(SYSTEM_CAN_IRQ);
+	if(!IsoTpFlowControls[Handle].Active)
+	{
+		IsoTpFlowControlCount++;
+	}
+	IsoTpFlowControls[Handle] = Filter;
+	NVIC_EnableIRQ(SYSTEM_CAN_IRQ);
+}
+//Removes a flow control filter, messages it is receiving are dropped
+void IsoTpRemoveFlowControl(uint8_t Handle)
+{
+	if( (Handle >= CAN_MAX_RX_FILTERS) || !IsoTpFlowControls[Handle].Active )
+	{
+		return;
+	}
+
+	NVIC_DisableIRQ(SYSTEM_CAN_IRQ);
+	NVIC_DisableIRQ(CAN_WHEEL_TIMER_IRQ);
+	for(uint8_t i = 0; i < ISOTP_RX_SESSIONS; i++)
+	{
+		if(IsoTpRxSessions[i].Filter == &IsoTpFlowControls[Handle])
+		{
+			IsoTpAbortSession(&IsoTpRxSessions[i]);
+		}
+	}
+	IsoTpFlowControls[Handle].Active = false;
+	IsoTpFlowControlCount--;
+	NVIC_EnableIRQ(CAN_WHEEL_TIMER_IRQ);
+	NVIC_EnableIRQ(SYSTEM_CAN_IRQ);
+}
+//Removes all flow control filters
+void IsoTpRemoveAllFlowControl()
+{
+	for(uint8_t Handle = 0; Handle < CAN_MAX_RX_FILTERS; Handle++)
+	{
+		IsoTpRemoveFlowControl(Handle);
+	}
+}
+//Block size and STmin we ask the ECU for in our flow control frames
+void IsoTpSetParameters(uint8_t BlockSize, uint8_t STmin)
+{
+	NVIC_DisableIRQ(SYSTEM_CAN_IRQ);
+	IsoTpBlockSize = BlockSize;
+	IsoTpSTmin = STmin;
+	NVIC_EnableIRQ(SYSTEM_CAN_IRQ);
+}
+
+bool IsoTpReceiveFrame(uint32_t MID, uint32_t ID, const uint8_t *Data, uint8_t Length, uint32_t Time)
+{
+	if(IsoTpFlowControlCount == 0)
+	{
+		return false;
+	}
+	IsoTpFlowControl_t *Filter = IsoTpFindFlowControl(MID, Data, Length);
+	if(Filter == NULL)
+	{
+		return false;
+	}
+
+	uint8_t Offset = Filter->ExtendedAddressing ? 1 : 0;
+	if(Length <= Offset)
+	{
+		//Nothing in it, not ours to pass on either
+		return true;
+	}
+	const uint8_t *Pci = Data + Offset;
+	uint8_t Available = Length - Offset;
+	IsoTpRxSession_t *Session;
+	uint8_t *Record;
+	uint8_t Buffer;
+
+	switch(Pci[0] & 0xF0)
+	{
+		case ISOTP_PCI_SF:
+		{
+			uint8_t SingleLength = Pci[0] & 0x0F;
+			if( (SingleLength == 0) || (SingleLength > Available - 1) )
+			{
+				break;
+			}
+			Record = IsoTpClaimRecord(Filter, ID, &Buffer);
+			if(Record == NULL)
+			{
+				IsoTpRxDropped++;
+				break;
+			}
+			memcpy(Record, Pci + 1, SingleLength);
+			IsoTpFinishRecord(Buffer, Filter, SingleLength, Time);
+		}
+		break;
+
+		case ISOTP_PCI_FF:
+		{
+			//First frames always have a DLC of 8, the extended address takes one of the bytes
+			if(Length < 8)
+			{
+				break;
+			}
+			//A new first frame replaces a message from the same ECU that wasn't finished
+			Session = IsoTpFindRxSession(Filter, ID);
+			if(Session != NULL)
+			{
+				IsoTpAbortSession(Session);
+			}
+
+			uint16_t MessageLength = ((Pci[0] & 0x0F) << 8) | Pci[1];
+			if(MessageLength < Available)
+			{
+				//FF_DL of 0 is the escape for lengths above 4095, anything else would have fit a single frame
+				//(7 bytes, 6 with extended addressing)
+				if(MessageLength == 0)
+				{
+					IsoTpSendFlowControl(Filter, ISOTP_FC_OVFLW);
+				}
+				break;
+			}
+			//Free session
+			Session = IsoTpFindRxSession(NULL, 0);
+			Record = (Session != NULL) ? IsoTpClaimRecord(Filter, ID, &Buffer) : NULL;
+			if(Record == NULL)
+			{
+				IsoTpRxDropped++;
+				IsoTpSendFlowControl(Filter, ISOTP_FC_OVFLW);
+				break;
+			}
+
+			Session->Filter = Filter;
+			Session->ID = ID;
+			Session->Buffer = Buffer;
+			Session->Length = MessageLength;
+			Session->Received = Available - 2;
+			Session->SequenceNumber = 1;
+			Session->BlockCount = IsoTpBlockSize;
+			memcpy(Record, Pci + 2, Session->Received);
+
+			IsoTpSendFlowControl(Filter, ISOTP_FC_CTS);
+			CanWheelTimerStart(&Session->Timer, ISOTP_N_CR_TIMEOUT_US);
+		}
+		break;
+
+		case ISOTP_PCI_CF:
+		{
+			Session = IsoTpFindRxSession(Filter, ID);
+			if(Session == NULL)
+			{
+				//Not for a message being received
+				break;
+			}
+			if( (Pci[0] & 0x0F) != Session->SequenceNumber )
+			{
+				IsoTpRxBadSequence++;
+				IsoTpAbortSession(Session);
+				break;
+			}
+
+			uint16_t Left = Session->Length - Session->Received;
+			uint8_t Copy = (Available - 1 < Left) ? Available - 1 : Left;
+			Record = IsoTpRxRecords[Session->Buffer] + ISOTP_RX_RECORD_HEADER + (Filter->ExtendedAddressing ? 1 : 0);
+			memcpy(Record + Session->Received, Pci + 1, Copy);
+			Session->Received += Copy;
+
+			if(Session->Received >= Session->Length)
+			{
+				CanWheelTimerStop(&Session->Timer);
+				IsoTpFinishRecord(Session->Buffer, Filter, Session->Length, Time);
+				Session->Filter = NULL;
+				break;
+			}
+
+			Session->SequenceNumber = (Session->SequenceNumber + 1) & 0x0F;
+			if( (Session->BlockCount != 0) && (--Session->BlockCount == 0) )
+			{
+				Session->BlockCount = IsoTpBlockSize;
+				IsoTpSendFlowControl(Filter, ISOTP_FC_CTS);
+			}
+			CanWheelTimerStart(&Session->Timer, ISOTP_N_CR_TIMEOUT_US);
+		}
+		break;
+
+		case ISOTP_PCI_FC:
+		{
+			//Flow control frames on a flow control filter are always ours, only used while sending
+			IsoTpTxSession_t *Tx = IsoTpFindTxSession(Filter);
+			if(Tx != NULL)
+			{
+				IsoTpTxFlowControl(Tx, Pci, Available);
+			}
+		}
+		break;
+
+		default:
+			return false;
+	}
+	return true;
+}
+uint8_t IsoTpSend(uint8_t Extended29, const uint8_t *ID, bool ExtendedAddressing, uint8_t Address, const uint8_t *Data, uint16_t Length)
+{
+	if( (Length == 0) || (Length > ISOTP_MAX_MESSAGE_SIZE) )
+	{
+		return ISOTP_TX_INVALID;
+	}
+
+	//Only one message at a time to an ID, the ECU couldn't tell them apart
+	IsoTpTxSession_t *Tx = NULL;
+	for(uint8_t i = 0; i < ISOTP_TX_SESSIONS; i++)
+	{
+		IsoTpTxSession_t *Session = &IsoTpTxSessions[i];
+		if(Session->State == ISOTP_TX_IDLE)
+		{
+			if(Tx == NULL)
+			{
+				Tx = Session;
+			}
+			continue;
+		}
+		if( (memcmp(Session->ID, ID, 4) == 0) && (Session->ExtendedAddressing == ExtendedAddressing) && (!ExtendedAddressing || (Session->Address == Address)) )
+		{
+			return ISOTP_TX_BUSY;
+		}
+	}
+	if(Tx == NULL)
+	{
+		return ISOTP_TX_BUSY;
+	}
+
+	Tx->Extended29 = Extended29;
+	Tx->ExtendedAddressing = ExtendedAddressing;
+	memcpy(Tx->ID, ID, 4);
+	Tx->Address = Address;
+
+	uint8_t Frame[4 + 8] = {0};
+	uint8_t Index = IsoTpTxFrameHeader(Tx, Frame);
+	if(Length < sizeof(Frame) - Index)
+	{
+		//Fits a single frame, nothing to wait for
+		Frame[Index++] = ISOTP_PCI_SF | Length;
+		memcpy(Frame + Index, Data, Length);
+		if(SendStandardCanMessage(Extended29, Frame, Index + Length) != CAN_MAILBOX_TRANSFER_OK)
+		{
+			//Transmit queue stayed full (N_As)
+			Error_T IsoTpTxFailed;
+			IsoTpTxFailed.ThrowerID = THROWER_ID_ISO_TP;
+			IsoTpTxFailed.ErrorMajor = TP_TIMEOUT;
+			IsoTpTxFailed.ErrorMinor = ERROR_NO_MINOR_CODE;
+			ThrowError(&IsoTpTxFailed);
+		}
+		return ISOTP_TX_OK;
+	}
+
+	Frame[Index++] = ISOTP_PCI_FF | (Length >> 8);
+	Frame[Index++] = Length & 0xFF;
+	memcpy(Frame + Index, Data, sizeof(Frame) - Index);
+	memcpy(Tx->Data, Data, Length);
+	Tx->Length = Length;
+	Tx->Sent = sizeof(Frame) - Index;
+	Tx->SequenceNumber = 1;
+	Tx->WaitCount = 0;
+
+	NVIC_DisableIRQ(SYSTEM_CAN_IRQ);
+	NVIC_DisableIRQ(CAN_WHEEL_TIMER_IRQ);
+	Tx->State = ISOTP_TX_WAIT_FC;
+	CanWheelTimerStart(&Tx->Timer, ISOTP_N_BS_TIMEOUT_US);
+	NVIC_EnableIRQ(CAN_WHEEL_TIMER_IRQ);
+	NVIC_EnableIRQ(SYSTEM_CAN_IRQ);
+	if(SendStandardCanMessage(Extended29, Frame, sizeof(Frame)) != CAN_MAILBOX_TRANSFER_OK)
+	{
+		//Transmit queue stayed full (N_As), nothing was sent so there is no flow control to wait for.
+		//Reported from the main loop like a consecutive frame that couldn't go out.
+		NVIC_DisableIRQ(SYSTEM_CAN_IRQ);
+		NVIC_DisableIRQ(CAN_WHEEL_TIMER_IRQ);
+		IsoTpTxFinish(Tx, TP_TIMEOUT);
+		NVIC_EnableIRQ(CAN_WHEEL_TIMER_IRQ);
+		NVIC_EnableIRQ(SYSTEM_CAN_IRQ);
+	}
+	return ISOTP_TX_OK;
+}
+//Writes the reassembled messages to the host, oldest first, and reports errors. Called from the main loop.
+void IsoTpProcessReceivedMessages()
+{
+	Message_t RecordMessage;
+
+	for(;;)
+	{
+		uint8_t Oldest = ISOTP_RX_BUFFERS;
+		for(uint8_t Buffer = 0; Buffer < ISOTP_RX_BUFFERS; Buffer++)
+		{
+			if( (IsoTpRxRecordLength[Buffer] > ISOTP_RECORD_FILLING) && ( (Oldest == ISOTP_RX_BUFFERS) || ((int32_t)(IsoTpRxRecordSeq[Buffer] - IsoTpRxRecordSeq[Oldest]) < 0) ) )
+			{
+				Oldest = Buffer;
+			}
+		}
+		if(Oldest == ISOTP_RX_BUFFERS)
+		{
+			break;
+		}
+
+		RecordMessage.buf = IsoTpRxRecords[Oldest];
+		RecordMessage.Size = IsoTpRxRecordLength[Oldest];
+		WriteMessage(&RecordMessage);
+		//Buffer can be filled again
+		__DMB();
+		IsoTpRxRecordLength[Oldest] = ISOTP_RECORD_FREE;
+	}
+
+	if(IsoTpRxDropped || IsoTpRxBadSequence || IsoTpRxTimeouts)
+	{
+		NVIC_DisableIRQ(SYSTEM_CAN_IRQ);
+		NVIC_DisableIRQ(CAN_WHEEL_TIMER_IRQ);
+		uint32_t Dropped = IsoTpRxDropped;
+		uint32_t BadSequence = IsoTpRxBadSequence;
+		uint32_t Timeouts = IsoTpRxTimeouts;
+		IsoTpRxDropped = 0;
+		IsoTpRxBadSequence = 0;
+		IsoTpRxTimeouts = 0;
+		NVIC_EnableIRQ(CAN_WHEEL_TIMER_IRQ);
+		NVIC_EnableIRQ(SYSTEM_CAN_IRQ);
+
+		Error_T IsoTpError;
+		IsoTpError.ThrowerID = THROWER_ID_ISO_TP;
+		if(Dropped)
+		{
+			IsoTpError.ErrorMajor = CAN_RX_OVERFLOW;
+			IsoTpError.ErrorMinor = (Dropped > 0xFF) ? 0xFF : Dropped;
+			ThrowError(&IsoTpError);
+		}
+		if(BadSequence)
+		{
+			IsoTpError.ErrorMajor = TP_WRONG_SEQUENCE_NUMBER;
+			IsoTpError.ErrorMinor = (BadSequence > 0xFF) ? 0xFF : BadSequence;
+			ThrowError(&IsoTpError);
+		}
+		if(Timeouts)
+		{
+			IsoTpError.ErrorMajor = TP_TIMEOUT;
+			IsoTpError.ErrorMinor = (Timeouts > 0xFF) ? 0xFF : Timeouts;
+			ThrowError(&IsoTpError);
+		}
+	}
+
+	for(uint8_t i = 0; i < ISOTP_TX_SESSIONS; i++)
+	{
+		IsoTpTxSession_t *Tx = &IsoTpTxSessions[i];
+		if(Tx->State != ISOTP_TX_FAILED)
+		{
+			continue;
+		}
+		Error_T IsoTpTxFailed;
+		IsoTpTxFailed.ThrowerID = THROWER_ID_ISO_TP;
+		IsoTpTxFailed.ErrorMajor = Tx->Error;
+		IsoTpTxFailed.ErrorMinor = ERROR_NO_MINOR_CODE;
+		//Session can be used again
+		Tx->State = ISOTP_TX_IDLE;
+		ThrowError(&IsoTpTxFailed);
+	}
+}
+
+static IsoTpFlowControl_t *IsoTpFindFlowControl(uint32_t MID, const uint8_t *Data, uint8_t Length)
+{
+	for(uint8_t Handle = 0; Handle < CAN_MAX_RX_FILTERS; Handle++)
+	{
+		IsoTpFlowControl_t *Filter = &IsoTpFlowControls[Handle];
+		if( !Filter->Active || (((MID ^ Filter->ID) & Filter->Mask) != 0) )
+		{
+			continue;
+		}
+		if( Filter->ExtendedAddressing && ( (Length == 0) || (((Data[0] ^ Filter->RxAddress) & Filter->RxAddressMask) != 0) ) )
+		{
+			continue;
+		}
+		return Filter;
+	}
+	return NULL;
+}
+//Session receiving from ID through Filter, or the first free one if Filter is NULL
+static IsoTpRxSession_t *IsoTpFindRxSession(IsoTpFlowControl_t *Filter, uint32_t ID)
+{
+	for(uint8_t i = 0; i < ISOTP_RX_SESSIONS; i++)
+	{
+		IsoTpRxSession_t *Session = &IsoTpRxSessions[i];
+		if( (Session->Filter == Filter) && ( (Filter == NULL) || (Session->ID == ID) ) )
+		{
+			return Session;
+		}
+	}
+	return NULL;
+}
+//Takes a free record and writes the ID into it. Returns where the data goes, NULL if all records are in use.
+static uint8_t *IsoTpClaimRecord(IsoTpFlowControl_t *Filter, uint32_t ID, uint8_t *Buffer)
+{
+	for(uint8_t i = 0; i < ISOTP_RX_BUFFERS; i++)
+	{
+		if(IsoTpRxRecordLength[i] != ISOTP_RECORD_FREE)
+		{
+			continue;
+		}
+		IsoTpRxRecordLength[i] = ISOTP_RECORD_FILLING;
+		uint8_t *Record = IsoTpRxRecords[i];
+		Record[9] = (ID >> 24) & 0xFF;
+		Record[10] = (ID >> 16) & 0xFF;
+		Record[11] = (ID >> 8) & 0xFF;
+		Record[12] = ID & 0xFF;
+		Record += ISOTP_RX_RECORD_HEADER;
+		if(Filter->ExtendedAddressing)
+		{
+			*Record++ = Filter->RxAddress;
+		}
+		*Buffer = i;
+		return Record;
+	}
+	return NULL;
+}
+//Fills in the header of a complete record and hands it to the main loop
+static void IsoTpFinishRecord(uint8_t Buffer, IsoTpFlowControl_t *Filter, uint16_t Length, uint32_t Time)
+{
+	uint8_t *Record = IsoTpRxRecords[Buffer];
+	uint16_t Size = ISOTP_RX_RECORD_HEADER + (Filter->ExtendedAddressing ? 1 : 0) + Length;
+	Record[0] = START_BYTE;
+	Record[1] = ((Size - 3) >> 8) & 0xFF;
+	Record[2] = (Size - 3) & 0xFF;
+	Record[3] = NETWORK_MESSAGE;
+	Record[4] = ISOTP_NETWORK_TYPE;
+	Record[5] = (Time >> 24) & 0xFF;
+	Record[6] = (Time >> 16) & 0xFF;
+	Record[7] = (Time >> 8) & 0xFF;
+	Record[8] = Time & 0xFF;
+	IsoTpRxRecordSeq[Buffer] = IsoTpRxSeq++;
+	//Record must be complete before the main loop can see it
+	__DMB();
+	IsoTpRxRecordLength[Buffer] = Size;
+}
+
+static void IsoTpAbortSession(IsoTpRxSession_t *Session)
+{
+	CanWheelTimerStop(&Session->Timer);
+	IsoTpRxRecordLength[Session->Buffer] = ISOTP_RECORD_FREE;
+	Session->Filter = NULL;
+}
+//N_Cr ran out, the ECU stopped sending consecutive frames
+static void IsoTpRxExpired(void *Context)
+{
+	IsoTpRxSession_t *Session = (IsoTpRxSession_t *)Context;
+	if(Session->Filter != NULL)
+	{
+		IsoTpAbortSession(Session);
+		IsoTpRxTimeouts++;
+	}
+}
+
+static void IsoTpSendFlowControl(IsoTpFlowControl_t *Filter, uint8_t FlowStatus)
+{
+	uint8_t Frame[4 + 8] = {0};
+	uint8_t Index = 4;
+
+	memcpy(Frame, Filter->FlowControlID, 4);
+	if(Filter->ExtendedAddressing)
+	{
+		Frame[Index++] = Filter->TxAddress;
+	}
+	Frame[Index++] = ISOTP_PCI_FC | FlowStatus;
+	Frame[Index++] = IsoTpBlockSize;
+	Frame[Index++] = IsoTpSTmin;
+	//Queued ahead of anything with a higher ID, the queue is full only if the bus is stuck
+	SendStandardCanMessage(Filter->Extended29, Frame, Index);
+}
+//Session sending to the ID the filter's flow control frames go to, so the ECU's flow control answers it
+static IsoTpTxSession_t *IsoTpFindTxSession(IsoTpFlowControl_t *Filter)
+{
+	for(uint8_t i = 0; i < ISOTP_TX_SESSIONS; i++)
+	{
+		IsoTpTxSession_t *Tx = &IsoTpTxSessions[i];
+		if( (Tx->State != ISOTP_TX_WAIT_FC) && (Tx->State != ISOTP_TX_SENDING) )
+		{
+			continue;
+		}
+		if( (Filter->ExtendedAddressing != Tx->ExtendedAddressing) || (Tx->ExtendedAddressing && (Filter->TxAddress != Tx->Address)) )
+		{
+			continue;
+		}
+		if(memcmp(Filter->FlowControlID, Tx->ID, 4) == 0)
+		{
+			return Tx;
+		}
+	}
+	return NULL;
+}
+
+static void IsoTpTxFlowControl(IsoTpTxSession_t *Tx, const uint8_t *Pci, uint8_t Available)
+{
+	if( (Tx->State != ISOTP_TX_WAIT_FC) || (Available < 3) )
+	{
+		return;
+	}
+
+	switch(Pci[0] & 0x0F)
+	{
+		case ISOTP_FC_CTS:
+			CanWheelTimerStop(&Tx->Timer);
+			Tx->BlockSize = Pci[1];
+			Tx->BlockCount = Pci[1];
+			Tx->STminUs = IsoTpSTminToUs(Pci[2]);
+			Tx->WaitCount = 0;
+			Tx->BlockedUs = 0;
+			Tx->State = ISOTP_TX_SENDING;
+			//The first consecutive frame of a block doesn't wait for STmin
+			IsoTpTxSendFrames(Tx);
+		break;
+
+		case ISOTP_FC_WAIT:
+			if(++Tx->WaitCount > ISOTP_MAX_WAIT_FRAMES)
+			{
+				IsoTpTxFinish(Tx, TP_EXCEEDED_MAX_ALLOW_WAIT_FRAMES);
+			}
+			else
+			{
+				CanWheelTimerStart(&Tx->Timer, ISOTP_N_BS_TIMEOUT_US);
+			}
+		break;
+
+		case ISOTP_FC_OVFLW:
+			IsoTpTxFinish(Tx, TP_RECEIVER_SIGNALED_OVERFLOW);
+		break;
+
+		default:
+			IsoTpTxFinish(Tx, TP_RECEIVED_UNEXPECTED_FC_TYPE);
+		break;
+	}
+}
+/*
+Sends consecutive frames until STmin has to pass, the block is done or the message is.
+STmin is timed from when a frame is queued, a busy bus can only make the gaps longer.
+*/
+static void IsoTpTxSendFrames(IsoTpTxSession_t *Tx)
+{
+	for(;;)
+	{
+		uint8_t Frame[4 + 8] = {0};
+		uint8_t Index = IsoTpTxFrameHeader(Tx, Frame);
+		uint16_t Left = Tx->Length - Tx->Sent;
+		uint8_t Copy = sizeof(Frame) - Index - 1;
+		if(Copy > Left)
+		{
+			Copy = Left;
+		}
+		Frame[Index++] = ISOTP_PCI_CF | Tx->SequenceNumber;
+		memcpy(Frame + Index, Tx->Data + Tx->Sent, Copy);
+		if(SendStandardCanMessage(Tx->Extended29, Frame, Index + Copy) != CAN_MAILBOX_TRANSFER_OK)
+		{
+			//Transmit queue is full, try again once some of it is on the bus (N_As)
+			Tx->BlockedUs += ISOTP_TX_RETRY_US;
+			if(Tx->BlockedUs > ISOTP_N_AS_TIMEOUT_US)
+			{
+				IsoTpTxFinish(Tx, TP_TIMEOUT);
+				return;
+			}
+			CanWheelTimerStart(&Tx->Timer, ISOTP_TX_RETRY_US);
+			return;
+		}
+		Tx->BlockedUs = 0;
+		Tx->Sent += Copy;
+		Tx->SequenceNumber = (Tx->SequenceNumber + 1) & 0x0F;
+
+		if(Tx->Sent >= Tx->Length)
+		{
+			Tx->State = ISOTP_TX_IDLE;
+			return;
+		}
+		if( (Tx->BlockSize != 0) && (--Tx->BlockCount == 0) )
+		{
+			Tx->State = ISOTP_TX_WAIT_FC;
+			CanWheelTimerStart(&Tx->Timer, ISOTP_N_BS_TIMEOUT_US);
+			return;
+		}
+		if(Tx->STminUs != 0)
+		{
+			CanWheelTimerStart(&Tx->Timer, Tx->STminUs);
+			return;
+		}
+	}
+}
+//STmin, the transmit queue retry or N_Bs ran out
+static void IsoTpTxExpired(void *Context)
+{
+	IsoTpTxSession_t *Tx = (IsoTpTxSession_t *)Context;
+	switch(Tx->State)
+	{
+		case ISOTP_TX_WAIT_FC:
+			//Only the first frame is out if this was the first flow control
+			IsoTpTxFinish(Tx, (Tx->Sent < 8) ? TP_NO_FIRST_FC_RESP_RCVD : TP_TIMEOUT);
+		break;
+
+		case ISOTP_TX_SENDING:
+			IsoTpTxSendFrames(Tx);
+		break;
+	}
+}
+//Stops sending, Error is reported from the main loop
+static void IsoTpTxFinish(IsoTpTxSession_t *Tx, uint8_t Error)
+{
+	CanWheelTimerStop(&Tx->Timer);
+	Tx->Error = Error;
+	Tx->State = ISOTP_TX_FAILED;
+}
+//Writes the ID and extended address, returns where the PCI goes
+static uint8_t IsoTpTxFrameHeader(IsoTpTxSession_t *Tx, uint8_t *Frame)
+{
+	uint8_t Index = 4;
+	memcpy(Frame, Tx->ID, 4);
+	if(Tx->ExtendedAddressing)
+	{
+		Frame[Index++] = Tx->Address;
+	}
+	return Index;
+}
+//0x00-0x7F are milliseconds, 0xF1-0xF9 100-900 microseconds. Reserved values are taken as the longest STmin.
+static uint32_t IsoTpSTminToUs(uint8_t STmin)
+{
+	if(STmin <= 0x7F)
+	{
+		return STmin * 1000UL;
+	}
+	if( (STmin >= 0xF1) && (STmin <= 0xF9) )
+	{
+		return (STmin - 0xF0) * 100UL;
+	}
+	return 127000UL;
+}
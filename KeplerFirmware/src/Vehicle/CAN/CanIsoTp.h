@@ -0,0 +1,128 @@
+/*
+ * CanIsoTp.h
+ *
+ * ISO 15765-2 reception on the device. Frames that match a J2534 flow control filter are taken out of the
+ * CAN receive path, flow control is sent straight from the CAN interrupt and the reassembled message goes
+ * to the host as one record.
+ *
+ * Transmission is also done here. The first frame goes out from the main loop, flow control from the ECU is
+ * handled in the CAN interrupt and consecutive frames are sent from the CAN timer wheel, so USB commands and CAN
+ * reception keep going while a long message is sent.
+ *
+ * Several messages can be received and sent at once, e.g. the answers of all ECUs to a functional request.
+ * Received messages are told apart by flow control filter and CAN ID, sent ones by CAN ID and target address.
+ * Sessions and buffers come from fixed pools, all N_As/N_Bs/N_Cr and STmin timing runs on the timer wheel.
+ */
+
+
+#ifndef CAN_ISOTP_H_
+#define CAN_ISOTP_H_
+
+#include "asf.h"
+#include "kcan.h"
+#include "CanTimerWheel.h"
+
+#define ISOTP_MAX_MESSAGE_SIZE 4095		//Largest FF_DL without the escape sequence, also the J2534 limit
+#define ISOTP_RX_SESSIONS 4				//Messages reassembled at the same time
+#define ISOTP_RX_BUFFERS (ISOTP_RX_SESSIONS + 1)	//One more for a finished message being written to the host
+#define ISOTP_TX_SESSIONS 2				//Messages sent at the same time
+#define ISOTP_RX_RECORD_HEADER 13		//START_BYTE, LenH, LenL, NETWORK_MESSAGE, network type, time, 4 byte ID
+#define ISOTP_RX_RECORD_SIZE (ISOTP_RX_RECORD_HEADER + 1 + ISOTP_MAX_MESSAGE_SIZE)
+#define ISOTP_NETWORK_TYPE 0x03
+
+#define ISOTP_N_AS_TIMEOUT_US 1000000	//Longest a consecutive frame waits for room in the CAN transmit queue
+#define ISOTP_N_BS_TIMEOUT_US 1000000	//Longest wait for a flow control frame
+#define ISOTP_N_CR_TIMEOUT_US 1000000	//Longest wait for the next consecutive frame
+#define ISOTP_MAX_WAIT_FRAMES 10		//FC.WAIT frames accepted in a row before giving up
+#define ISOTP_TX_RETRY_US 100			//Next try when the CAN transmit queue was full
+
+#define ISOTP_DEFAULT_BS 0
+#define ISOTP_DEFAULT_STMIN 0
+
+//IsoTpSend results
+#define ISOTP_TX_OK 0
+#define ISOTP_TX_BUSY 1					//A message to the same ID is still being sent, or all sessions are in use
+#define ISOTP_TX_INVALID 2				//Empty or longer than ISOTP_MAX_MESSAGE_SIZE
+
+//Transmitter states
+#define ISOTP_TX_IDLE 0
+#define ISOTP_TX_WAIT_FC 1				//Waiting for flow control, timer runs N_Bs
+#define ISOTP_TX_SENDING 2				//Timer runs STmin between consecutive frames
+#define ISOTP_TX_FAILED 3				//Error is reported from the main loop, then the session is free
+
+//Protocol control information, high nibble of the first byte
+#define ISOTP_PCI_SF 0x00
+#define ISOTP_PCI_FF 0x10
+#define ISOTP_PCI_CF 0x20
+#define ISOTP_PCI_FC 0x30
+
+//Flow status of a flow control frame
+#define ISOTP_FC_CTS 0x00
+#define ISOTP_FC_WAIT 0x01
+#define ISOTP_FC_OVFLW 0x02
+
+//Flow control filter, same handle as the acceptance filter it was created with
+typedef struct {
+	bool Active;
+	bool Extended29;				//29 bit IDs
+	bool ExtendedAddressing;		//First data byte is the target address
+	uint32_t ID;					//CAN_MID of the frames from the ECU
+	uint32_t Mask;
+	uint8_t RxAddress;				//Extended address in frames from the ECU
+	uint8_t RxAddressMask;
+	uint8_t FlowControlID[4];		//ID of our flow control frames, as given to SendStandardCanMessage
+	uint8_t TxAddress;				//Extended address of our flow control frames
+} IsoTpFlowControl_t;
+
+//Message being reassembled
+typedef struct {
+	IsoTpFlowControl_t *Filter;		//NULL when idle
+	uint32_t ID;
+	uint8_t Buffer;
+	uint16_t Length;				//FF_DL
+	uint16_t Received;
+	uint8_t SequenceNumber;			//Expected in the next consecutive frame
+	uint8_t BlockCount;				//Consecutive frames left before the next flow control, 0 for no limit
+	CanWheelTimer_t Timer;			//N_Cr
+} IsoTpRxSession_t;
+
+//Message being sent
+typedef struct {
+	volatile uint8_t State;
+	uint8_t Extended29;
+	bool ExtendedAddressing;
+	uint8_t ID[4];					//As given to SendStandardCanMessage
+	uint8_t Address;				//Target address for extended addressing
+	uint16_t Length;
+	uint16_t Sent;
+	uint8_t SequenceNumber;			//Of the next consecutive frame
+	uint8_t BlockSize;				//From the ECU's last flow control, 0 for no limit
+	uint8_t BlockCount;				//Consecutive frames left in this block
+	uint32_t STminUs;				//From the ECU's last flow control
+	uint8_t WaitCount;				//FC.WAIT frames received in a row
+	uint32_t BlockedUs;				//How long the current frame has waited for the transmit queue
+	uint8_t Error;					//TP_* error while ISOTP_TX_FAILED
+	CanWheelTimer_t Timer;
+	uint8_t Data[ISOTP_MAX_MESSAGE_SIZE];
+} IsoTpTxSession_t;
+
+void IsoTpInit(void);
+void IsoTpAddFlowControl(uint8_t Handle, uint8_t Extended29, uint8_t *Mask, uint8_t *Pattern, uint8_t *FlowControl, uint16_t Length);
+void IsoTpRemoveFlowControl(uint8_t Handle);
+void IsoTpRemoveAllFlowControl(void);
+void IsoTpSetParameters(uint8_t BlockSize, uint8_t STmin);
+/*
+* Called from CAN0_Handler for every received frame.
+* Returns true if the frame belongs to a flow control filter and was consumed. A message gets the Time of the
+* frame that completed it.
+*/
+bool IsoTpReceiveFrame(uint32_t MID, uint32_t ID, const uint8_t *Data, uint8_t Length, uint32_t Time);
+/*
+* Starts sending a message. ID is the 4 byte ID, Address the target address if ExtendedAddressing is set.
+* Returns once the first frame is queued, the rest is sent from interrupts.
+* Returns ISOTP_TX_BUSY if a message to the same ID isn't done yet or there is no free session.
+*/
+uint8_t IsoTpSend(uint8_t Extended29, const uint8_t *ID, bool ExtendedAddressing, uint8_t Address, const uint8_t *Data, uint16_t Length);
+void IsoTpProcessReceivedMessages(void);
+
+#endif /* CAN_ISOTP_H_ */
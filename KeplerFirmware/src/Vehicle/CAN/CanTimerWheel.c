@@ -0,0 +1,153 @@
+/*
+ * CanTimerWheel.c
+ *
+ * The handler runs at priority 7 like CAN0_Handler, so timers are never changed while a tick is being handled.
+ */
+#include "CanTimerWheel.h"
+#include "asf.h"
+#include "Timers.h"
+
+static CanWheelTimer_t *CanWheelSlots[CAN_WHEEL_SLOTS];
+static uint32_t CanWheelNow = 0;
+static uint16_t CanWheelArmed = 0;
+
+static void CanWheelLink(CanWheelTimer_t *Timer);
+static void CanWheelUnlink(CanWheelTimer_t *Timer);
+
+//Called from InitalizeCanSystem
+void CanTimerWheelInit()
+{
+	sysclk_enable_peripheral_clock(CAN_WHEEL_TIMER_ID);
+	tc_stop(CAN_WHEEL_TIMER, CAN_WHEEL_TIMER_CHANNEL);
+	tc_init(
+	CAN_WHEEL_TIMER,
+	CAN_WHEEL_TIMER_CHANNEL,
+	TC_CMR_TCCLKS_TIMER_CLOCK4|
+	TC_CMR_BURST_NONE|TC_CMR_CPCTRG
+	);
+	tc_write_rc(CAN_WHEEL_TIMER, CAN_WHEEL_TIMER_CHANNEL, (CAN_WHEEL_TIMER_HZ / 1000) * CAN_WHEEL_TICK_US / 1000);
+	tc_enable_interrupt(CAN_WHEEL_TIMER, CAN_WHEEL_TIMER_CHANNEL, TC_IER_CPCS);
+	NVIC_SetPriority(CAN_WHEEL_TIMER_IRQ, 7);
+	NVIC_EnableIRQ(CAN_WHEEL_TIMER_IRQ);
+
+	//Timers that were armed are forgotten, their owners are reset as well
+	memset(CanWheelSlots, 0, sizeof(CanWheelSlots));
+	CanWheelArmed = 0;
+}
+
+void CanWheelTimerSetup(CanWheelTimer_t *Timer, CanWheelCallback Expired, void *Context)
+{
+	Timer->Next = NULL;
+	Timer->Prev = NULL;
+	Timer->Armed = false;
+	Timer->Expired = Expired;
+	Timer->Context = Context;
+}
+
+void CanWheelTimerStart(CanWheelTimer_t *Timer, uint32_t TimeUs)
+{
+	uint32_t Ticks = (TimeUs + CAN_WHEEL_TICK_US - 1) / CAN_WHEEL_TICK_US;
+	if(Ticks == 0)
+	{
+		Ticks = 1;
+	}
+
+	if(Timer->Armed)
+	{
+		CanWheelUnlink(Timer);
+	}
+	if(CanWheelArmed == 0)
+	{
+		//Restarting the channel starts a whole tick now
+		tc_start(CAN_WHEEL_TIMER, CAN_WHEEL_TIMER_CHANNEL);
+	}
+	else
+	{
+		//Part of the current tick is gone already
+		Ticks++;
+	}
+	Timer->Due = CanWheelNow + Ticks;
+	CanWheelLink(Timer);
+}
+
+void CanWheelTimerStop(CanWheelTimer_t *Timer)
+{
+	if(!Timer->Armed)
+	{
+		return;
+	}
+	CanWheelUnlink(Timer);
+	if(CanWheelArmed == 0)
+	{
+		tc_stop(CAN_WHEEL_TIMER, CAN_WHEEL_TIMER_CHANNEL);
+		//A tick that already happened must not be handled afterwards
+		tc_get_status(CAN_WHEEL_TIMER, CAN_WHEEL_TIMER_CHANNEL);
+		NVIC_ClearPendingIRQ(CAN_WHEEL_TIMER_IRQ);
+	}
+}
+
+void CAN_WHEEL_TIMER_HANDLER()
+{
+	if( (tc_get_status(CAN_WHEEL_TIMER, CAN_WHEEL_TIMER_CHANNEL) & TC_SR_CPCS) != TC_SR_CPCS )
+	{
+		return;
+	}
+	CanWheelNow++;
+
+	//Timers in the slot that are due later are a whole turn or more away. Callbacks can start and stop any
+	//timer, so the list is searched again from the start after each one.
+	bool Fired;
+	do
+	{
+		Fired = false;
+		for(CanWheelTimer_t *Timer = CanWheelSlots[CanWheelNow & (CAN_WHEEL_SLOTS - 1)]; Timer != NULL; Timer = Timer->Next)
+		{
+			if(Timer->Due == CanWheelNow)
+			{
+				CanWheelUnlink(Timer);
+				Timer->Expired(Timer->Context);
+				Fired = true;
+				break;
+			}
+		}
+	} while(Fired);
+
+	if(CanWheelArmed == 0)
+	{
+		tc_stop(CAN_WHEEL_TIMER, CAN_WHEEL_TIMER_CHANNEL);
+	}
+}
+
+static void CanWheelLink(CanWheelTimer_t *Timer)
+{
+	CanWheelTimer_t **Slot = &CanWheelSlots[Timer->Due & (CAN_WHEEL_SLOTS - 1)];
+	Timer->Prev = NULL;
+	Timer->Next = *Slot;
+	if(Timer->Next != NULL)
+	{
+		Timer->Next->Prev = Timer;
+	}
+	*Slot = Timer;
+	Timer->Armed = true;
+	CanWheelArmed++;
+}
+
+static void CanWheelUnlink(CanWheelTimer_t *Timer)
+{
+	if(Timer->Prev != NULL)
+	{
+		Timer->Prev->Next = Timer->Next;
+	}
+	else
+	{
+		CanWheelSlots[Timer->Due & (CAN_WHEEL_SLOTS - 1)] = Timer->Next;
+	}
+	if(Timer->Next != NULL)
+	{
+		Timer->Next->Prev = Timer->Prev;
+	}
+	Timer->Next = NULL;
+	Timer->Prev = NULL;
+	Timer->Armed = false;
+	CanWheelArmed--;
+}
@@ -0,0 +1,43 @@
+/*
+ * CanTimerWheel.h
+ *
+ * Software timers for the CAN protocols, all run from one TC channel (CAN_WHEEL_TIMER). The channel ticks every
+ * CAN_WHEEL_TICK_US while any timer is armed and is stopped otherwise.
+ *
+ * Timers are kept in CAN_WHEEL_SLOTS lists by the tick they are due at, so a tick only looks at one short list
+ * however many timers are armed. A timer never fires early and at most one tick late.
+ *
+ * Callbacks run at the CAN interrupt priority. Timers may only be started and stopped from the CAN interrupt, a
+ * callback, or with both interrupts off.
+ */
+
+
+#ifndef CAN_TIMER_WHEEL_H_
+#define CAN_TIMER_WHEEL_H_
+
+//Not asf.h, it includes this through conf_usb.h before the types below exist
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CAN_WHEEL_TICK_US 100
+#define CAN_WHEEL_TIMER_HZ (sysclk_get_peripheral_hz() / 128)		//TIMER_CLOCK4, only used in CanTimerWheel.c
+#define CAN_WHEEL_SLOTS 64						//Power of two
+
+typedef void (*CanWheelCallback)(void *Context);
+
+typedef struct CanWheelTimer {
+	struct CanWheelTimer *Next;
+	struct CanWheelTimer *Prev;
+	uint32_t Due;					//Tick it fires at
+	bool Armed;
+	CanWheelCallback Expired;
+	void *Context;
+} CanWheelTimer_t;
+
+void CanTimerWheelInit(void);
+void CanWheelTimerSetup(CanWheelTimer_t *Timer, CanWheelCallback Expired, void *Context);
+//Starts the timer, or restarts it if it is armed already
+void CanWheelTimerStart(CanWheelTimer_t *Timer, uint32_t TimeUs);
+void CanWheelTimerStop(CanWheelTimer_t *Timer);
+
+#endif /* CAN_TIMER_WHEEL_H_ */
@@ -8,14 +8,56 @@
 //See the ASF documentation for the CAN controller.
 
 #include "kcan.h"
- #include "isotp.h"
-
- IsoTpShims shims;
- IsoTpReceiveHandle rx_handle;
- TimeoutCallback TimeoutCB;
+#include "CanIsoTp.h"
+#include "runtimer.h"
  
  
-uint32_t rx_mailbox_num = CAN_COMM_RXMB_ID;
+
+//Received frames, filled by CAN0_Handler and emptied by the main loop. Each index is only written by one side.
+static CanRxFrame_t CanRxRing[CAN_RX_RING_SIZE];
+static volatile uint32_t CanRxHead = 0;
+static volatile uint32_t CanRxTail = 0;
+static volatile uint32_t CanRxDropped = 0;
+
+//Container being filled by the main loop
+static uint8_t CanRxContainer[CAN_RX_CONTAINER_SIZE];
+static uint16_t CanRxContainerLength = 0;		//0 when empty
+static uint32_t CanRxLastID;
+static uint32_t CanRxLastTime;
+static bool CanRxFlushAtSof = true;
+static uint16_t CanRxLatencyUs = CAN_RX_DEFAULT_LATENCY_US;
+static volatile bool CanRxFlushDue = false;		//Start of frame or the latency deadline
+static CanWheelTimer_t CanRxDeadline;
+static uint32_t CanBitRateKbps = CAN_BPS_500K;
+
+//Frames waiting for a transmit mailbox, sorted by arbitration order. Frames with the same ID stay in the order
+//they were queued. Used from the main loop, the periodic timer and CAN0_Handler, so only touched with interrupts off.
+static CanTxFrame_t CanTxQueue[CAN_TX_QUEUE_SIZE];
+static uint32_t CanTxCount = 0;
+//Key of the frame in each transmit mailbox
+static uint32_t CanTxMailboxKey[CAN_TX_MAILBOXES];
+
+static void CanTxReset(void);
+static bool CanTxEnqueue(const CanTxFrame_t *Frame);
+static void CanTxRefill(void);
+
+//Filters set by the host and the mailbox chains they are merged into. Only used from the main loop, the interrupt
+//just reads whatever the mailboxes accept.
+static CanRxFilter_t CanRxFilters[CAN_MAX_RX_FILTERS];
+static CanRxGroup_t CanRxGroups[CAN_RX_MAILBOXES];
+static uint8_t CanRxGroupCount = 0;
+
+static uint32_t CanRxMergedMask(uint32_t ID, uint32_t Mask, uint32_t OtherID, uint32_t OtherMask);
+static void CanRxRegroup(uint8_t Group);
+static void CanRxRebuild(void);
+static void CanRxLoadGroup(uint8_t Group);
+static void CanRxLayout(void);
+static bool CanRxAccept(uint32_t MID);
+static void CanRxReadMailbox(uint8_t Mailbox);
+static uint32_t CanRxFrameTime(uint16_t Timestamp);
+static void CanRxAddRecord(const CanRxFrame_t *Frame);
+static void CanRxFlush(void);
+static void CanRxDeadlineExpired(void *Context);
   uint32_t ErrorCount = 0;
   
 void InitalizeCanSystem(uint8_t DataRate, uint32_t ul_sysclk)
@@ -84,28 +126,17 @@ void InitalizeCanSystem(uint8_t DataRate, uint32_t ul_sysclk)
 	ioport_set_pin_level(HSC_NEN, IOPORT_PIN_LEVEL_LOW);
 	ioport_set_pin_level(HSC_NRM, IOPORT_PIN_LEVEL_HIGH);
 	
-	//Init Timer 
-	sysclk_enable_peripheral_clock(TP_TIMEOUT_TIMER_ID);
-	
-	tc_stop(TP_TIMEOUT_TIMER, TP_TIMEOUT_TIMER_CHANNEL);
-	
-	tc_init(
-	TP_TIMEOUT_TIMER,
-	TP_TIMEOUT_TIMER_CHANNEL,
-	TC_CMR_TCCLKS_TIMER_CLOCK4|
-	TC_CMR_BURST_NONE|TC_CMR_CPCTRG
-	);
 	//Enable can interrupts
 	can_enable_interrupt(SYSTEM_CAN, CAN_IER_ERRA | CAN_IER_WARN | CAN_IER_ERRP | CAN_IER_BOFF | CAN_IER_BERR);
-	//Set the ISO15765 Shims
-	shims = isotp_init_shims( NULL, SendStandardCanMessage, RunTimer, delayms);
-	//Set the rx handle for iso15765
-	rx_handle = isotp_receive(&shims,0x00,message_received);
-}
-//Delay shim
-void delayms(uint32_t delay)
-{
-	delay_ms(delay);
+	//Transmit mailboxes are refilled from the interrupt
+	CanTxReset();
+	NVIC_EnableIRQ(SYSTEM_CAN_IRQ);
+	NVIC_SetPriority(SYSTEM_CAN_IRQ, 7);
+	//ISO15765 and receive batching timing
+	CanBitRateKbps = _DataRate;
+	CanTimerWheelInit();
+	CanWheelTimerSetup(&CanRxDeadline, CanRxDeadlineExpired, NULL);
+	IsoTpInit();
 }
 //Send a can message to the network
 void HandleSendCanRequest(Message_t *OutgoingMessage)
@@ -119,15 +150,30 @@ void HandleSendCanRequest(Message_t *OutgoingMessage)
 		//Send the message with ISOTP processing
 		case MODE_ISOTP:
 		{
-			
-			if(OutgoingMessage->buf[2] == 0)
+			uint8_t Result;
+			//buf[2] is the addressing type, the extended address comes before the ID
+			bool ExtendedAddressing = (OutgoingMessage->buf[2] != 0);
+			uint8_t Offset = ExtendedAddressing ? 4 : 3;
+			if(OutgoingMessage->Size < Offset + 4)
+			{
+				Result = ISOTP_TX_INVALID;
+			}
+			else
 			{
-				isotp_send(&shims, (OutgoingMessage->buf[5] << 8) | OutgoingMessage->buf[6], OutgoingMessage->buf+5, OutgoingMessage->Size-5, NULL);
-			} else
+				//Frames are sent from interrupts, only wait here if the previous message is still going out
+				while( (Result = IsoTpSend(0, OutgoingMessage->buf + Offset, ExtendedAddressing, OutgoingMessage->buf[3], OutgoingMessage->buf + Offset + 4, OutgoingMessage->Size - Offset - 4)) == ISOTP_TX_BUSY )
+				{
+					CanProcessReceivedFrames();
+				}
+			}
+			if(Result == ISOTP_TX_INVALID)
 			{
-				isotp_send_ext(&shims, (OutgoingMessage->buf[6] << 8) | OutgoingMessage->buf[7], OutgoingMessage->buf+6, OutgoingMessage->Size-6, NULL, OutgoingMessage->buf[3]);	
+				Error_T InvalidLengthError;
+				InvalidLengthError.ThrowerID = THROWER_ID_ISO_TP;
+				InvalidLengthError.ErrorMajor = INVALID_LENGTH_BYTES;
+				InvalidLengthError.ErrorMinor = ERROR_NO_MINOR_CODE;
+				ThrowError(&InvalidLengthError);
 			}
-			
 		}
 		break;
 	}
@@ -172,115 +218,424 @@ void DisableAllTransceivers()
 }
 /*
 This function is called when a standard can message must be sent to the network. 
-It waits for the transmit mailbox to become available, sets it up, and sends the message. 
+It queues the message for the transmit mailboxes, which are loaded in priority order as they become free.
+From the main loop it waits for room in the queue, from an interrupt it fails if the queue is full.
 Any response is handled by the CAN receiver logic.
 */
 uint32_t SendStandardCanMessage(uint8_t arbitration_type, uint8_t *data, const uint8_t size)
 {
-	uint32_t retval = 0;
 	uint32_t arbitrationID = 0;
-	uint32_t CanStatusReg = CAN0->CAN_SR;
+	CanTxFrame_t Frame;
+	uint8_t Payload[8] = {0};
 	
-	if(size - 4 > 8)
+	if( (size < 4) || (size - 4 > 8) )
 	{
 		//TODO:ERROR
 		//Too much data for a standard frame!
-		return;
+		return CAN_MAILBOX_NOT_READY;
 	}
 	
-	//switch(channel)
-	//{
-		//case CHANNEL_HSC:
-			//DisableAllTransceivers();
-			//ioport_set_pin_level(HSC_NEN, IOPORT_PIN_LEVEL_LOW);
-			//ioport_set_pin_level(HSC_NRM, IOPORT_PIN_LEVEL_HIGH);
-		//break;
-		//
-		//default:
-		////Unsupported Error	
-		//return;
-		//break;
-	//}
-	
 	arbitrationID = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | (data[3] << 0);
+	
+	Frame.ID = CAN_MID_MIDvA(arbitrationID) | CAN_MID_MIDvB((arbitrationID >>16));
+	if(arbitration_type)
+	{
+		Frame.ID |= CAN_MID_MIDE;
+	}
+	//Base ID first, a standard frame wins over an extended one with the same base ID
+	Frame.Key = (((Frame.ID & CAN_MID_MIDvA_Msk) >> CAN_MID_MIDvA_Pos) << 19) | ((arbitration_type ? 1 : 0) << 18) | (Frame.ID & CAN_MID_MIDvB_Msk);
+	
+	//Frames are always sent with 8 bytes, padded with zeros
+	memcpy(Payload, data + 4, size - 4);
+	memcpy(&Frame.DataL, Payload, 4);
+	memcpy(&Frame.DataH, Payload + 4, 4);
+	
+	for(uint32_t Waited = 0; !CanTxEnqueue(&Frame); Waited += 10)
+	{
+		if( (__get_IPSR() != 0) || (Waited >= CAN_TX_QUEUE_TIMEOUT_US) )
+		{
+			return CAN_MAILBOX_NOT_READY;
+		}
+		delay_us(10);
+	}
+	return CAN_MAILBOX_TRANSFER_OK;
+}
+
+//Empties the transmit queue and sets up the transmit mailboxes
+static void CanTxReset()
+{
+	irqflags_t flags = cpu_irq_save();
+	CanTxCount = 0;
+	for(uint8_t Mailbox = 0; Mailbox < CAN_TX_MAILBOXES; Mailbox++)
+	{
+		can_disable_interrupt(SYSTEM_CAN, 0x1u << Mailbox);
+		reset_mailbox_conf(&tx_mailbox);
+		tx_mailbox.ul_mb_idx = Mailbox;
+		tx_mailbox.uc_obj_type = CAN_MB_TX_MODE;
+		can_mailbox_init(SYSTEM_CAN, &tx_mailbox);
+		CanTxMailboxKey[Mailbox] = CAN_TX_MAILBOX_FREE;
+	}
+	cpu_irq_restore(flags);
+}
 
-	reset_mailbox_conf(&tx_mailbox);
-	tx_mailbox.ul_mb_idx = CAN_COMM_TXMB_ID;
-	tx_mailbox.uc_obj_type = CAN_MB_TX_MODE;
+//Adds a frame to the transmit queue and starts it if a mailbox is free. False if the queue is full.
+static bool CanTxEnqueue(const CanTxFrame_t *Frame)
+{
+	irqflags_t flags = cpu_irq_save();
+	if(CanTxCount >= CAN_TX_QUEUE_SIZE)
+	{
+		cpu_irq_restore(flags);
+		return false;
+	}
+	//Behind every frame that goes out before it or has the same ID
+	uint32_t Index = CanTxCount;
+	while( (Index > 0) && (CanTxQueue[Index - 1].Key > Frame->Key) )
+	{
+		CanTxQueue[Index] = CanTxQueue[Index - 1];
+		Index--;
+	}
+	CanTxQueue[Index] = *Frame;
+	CanTxCount++;
+	CanTxRefill();
+	cpu_irq_restore(flags);
+	return true;
+}
 
-	tx_mailbox.ul_id = CAN_MID_MIDvA(arbitrationID) | CAN_MID_MIDvB((arbitrationID >>16));
-	if(arbitration_type)
+//Loads queued frames into the free transmit mailboxes. Interrupts must be off.
+static void CanTxRefill()
+{
+	for(uint8_t Mailbox = 0; (Mailbox < CAN_TX_MAILBOXES) && (CanTxCount > 0); Mailbox++)
 	{
-		tx_mailbox.ul_id |= CAN_MID_MIDE;
+		if(CanTxMailboxKey[Mailbox] != CAN_TX_MAILBOX_FREE)
+		{
+			continue;
+		}
+		
+		//First frame whose ID isn't in a mailbox already. The controller picks mailboxes by priority field
+		//and number, so two frames with the same ID could overtake each other.
+		uint32_t Index;
+		for(Index = 0; Index < CanTxCount; Index++)
+		{
+			uint8_t Loaded;
+			for(Loaded = 0; Loaded < CAN_TX_MAILBOXES; Loaded++)
+			{
+				if(CanTxMailboxKey[Loaded] == CanTxQueue[Index].Key)
+				{
+					break;
+				}
+			}
+			if(Loaded == CAN_TX_MAILBOXES)
+			{
+				break;
+			}
+		}
+		if(Index == CanTxCount)
+		{
+			return;
+		}
+		
+		CanTxFrame_t *Frame = &CanTxQueue[Index];
+		reset_mailbox_conf(&tx_mailbox);
+		tx_mailbox.ul_mb_idx = Mailbox;
+		tx_mailbox.uc_obj_type = CAN_MB_TX_MODE;
+		tx_mailbox.ul_id = Frame->ID;
+		//Top 4 bits of the base ID, lower goes first
+		tx_mailbox.uc_tx_prio = Frame->Key >> 26;
+		tx_mailbox.uc_length = 8;
+		tx_mailbox.ul_datal = Frame->DataL;
+		tx_mailbox.ul_datah = Frame->DataH;
+		can_mailbox_init(SYSTEM_CAN, &tx_mailbox);
+		if(can_mailbox_write(SYSTEM_CAN, &tx_mailbox) != CAN_MAILBOX_TRANSFER_OK)
+		{
+			continue;
+		}
+		CanTxMailboxKey[Mailbox] = Frame->Key;
+		can_enable_interrupt(SYSTEM_CAN, 0x1u << Mailbox);
+		can_global_send_transfer_cmd(SYSTEM_CAN, 0x1u << Mailbox);
+		
+		CanTxCount--;
+		for(; Index < CanTxCount; Index++)
+		{
+			CanTxQueue[Index] = CanTxQueue[Index + 1];
+		}
+	}
+}
+
+//Initalizes a receiver mailbox, see the datasheet/asf documentation for information on mailboxs
+/*
+Adds an acceptance filter. Each filter gets its own chain of receive mailboxes while there are enough of them. After
+that a new filter is merged into the chain whose mask it changes least, and the frames the merged mask lets through
+are matched exactly in CanProcessReceivedFrames.
+*/
+uint8_t InitalizeReceiverMailbox(uint8_t type, uint8_t * Mask, uint8_t* Pattern)
+{
+	uint8_t Handle;
+	for(Handle = 0; Handle < CAN_MAX_RX_FILTERS; Handle++)
+	{
+		if(!CanRxFilters[Handle].Active)
+		{
+			break;
+		}
+	}
+	if(Handle == CAN_MAX_RX_FILTERS)
+	{
+		return CAN_RX_NO_FILTER;
 	}
 	
-	tx_mailbox.uc_tx_prio = 2;
-	tx_mailbox.uc_id_ver = 0;
-	tx_mailbox.ul_id_msk = 0;
-	tx_mailbox.uc_length = 8;
-	can_mailbox_init(SYSTEM_CAN, &tx_mailbox);
+	CanRxFilter_t *Filter = &CanRxFilters[Handle];
+	Filter->Mask = CAN_MID_MIDvA(Mask[2] << 8 | Mask[3]) | CAN_MID_MIDvB(Mask[0] << 8 | Mask[1]);
+	Filter->ID = CAN_MID_MIDvA(Pattern[2] << 8 | Pattern[3]) | CAN_MID_MIDvB(Pattern[0] << 8 | Pattern[1]);
+	if(type)
+	{
+		Filter->ID |= CAN_MID_MIDE;
+		Filter->Mask |= CAN_MAM_MIDE;
+	}
+	Filter->ID &= Filter->Mask;
+	Filter->Hits = 0;
+	Filter->Active = true;
 	
-	memcpy(&tx_mailbox.ul_datal,data+4, 4*sizeof(Byte));
-	memcpy(&tx_mailbox.ul_datah,data+8, 4*sizeof(Byte));
-	//memset(&tx_mailbox.ul_datal+(size-3),0x00,8-(size - 4));
-	retval = can_mailbox_write(SYSTEM_CAN, &tx_mailbox);
+	if(CanRxGroupCount < CAN_RX_MAILBOXES)
+	{
+		//Room for a chain of its own, the chains are shared out again
+		Filter->Group = CanRxGroupCount++;
+		CanRxGroups[Filter->Group].Members = 0;
+		CanRxRegroup(Filter->Group);
+		CanRxLayout();
+		return Handle;
+	}
 	
-	int i =0;
-	if(data[4] == 0x00)
+	//Merge into the chain that keeps the most mask bits, only that chain is loaded again
+	uint8_t Best = 0;
+	int BestBits = -1;
+	for(uint8_t Group = 0; Group < CanRxGroupCount; Group++)
 	{
-		i++;
+		int Bits = __builtin_popcount(CanRxMergedMask(CanRxGroups[Group].ID, CanRxGroups[Group].Mask, Filter->ID, Filter->Mask));
+		if(Bits > BestBits)
+		{
+			Best = Group;
+			BestBits = Bits;
+		}
 	}
+	Filter->Group = Best;
+	CanRxRegroup(Best);
+	CanRxLoadGroup(Best);
+	return Handle;
+}
+//Removes a filter, false if there is no such filter
+bool RemoveMailbox(uint8_t FilterID)
+{
+	if( (FilterID >= CAN_MAX_RX_FILTERS) || !CanRxFilters[FilterID].Active )
+	{
+		return false;
+	}
+	CanRxFilters[FilterID].Active = false;
 	
-	//TODO: Report TX error here
-	if(retval)
+	uint8_t Group = CanRxFilters[FilterID].Group;
+	CanRxRegroup(Group);
+	if(CanRxGroups[Group].Members)
 	{
-		return;
+		//The rest of the chain may fit a narrower mask now
+		CanRxLoadGroup(Group);
+	}
+	else
+	{
+		//A chain is free, split the merged ones up again
+		CanRxRebuild();
 	}
-	//can_mailbox_send_transfer_cmd(SYSTEM_CAN, &hsc_tx_mailbox);
-	can_global_send_transfer_cmd(CAN0,  (0x1u << CAN_COMM_TXMB_ID));
+	return true;
 }
-
-//Initalizes a receiver mailbox, see the datasheet/asf documentation for information on mailboxs
-void InitalizeReceiverMailbox(uint8_t type, uint8_t * Mask, uint8_t* Pattern)
+//Disables all receive mailboxes, the transmit ones keep sending
+void RemoveAllReceiverMailboxes()
 {
+	for(uint8_t Handle = 0; Handle < CAN_MAX_RX_FILTERS; Handle++)
+	{
+		CanRxFilters[Handle].Active = false;
+	}
+	CanRxGroupCount = 0;
+	CanRxLayout();
+}
+//Number of frames that matched a filter since it was created
+bool GetCanFilterHits(uint8_t FilterID, uint32_t *Hits)
+{
+	if( (FilterID >= CAN_MAX_RX_FILTERS) || !CanRxFilters[FilterID].Active )
+	{
+		return false;
+	}
+	*Hits = CanRxFilters[FilterID].Hits;
+	return true;
+}
+//Mask that accepts everything both masks accept: only bits both compare and both expect the same value in
+static uint32_t CanRxMergedMask(uint32_t ID, uint32_t Mask, uint32_t OtherID, uint32_t OtherMask)
+{
+	return Mask & OtherMask & ~(ID ^ OtherID);
+}
+//Works out the mask of a chain from its filters
+static void CanRxRegroup(uint8_t Group)
+{
+	CanRxGroup_t *RxGroup = &CanRxGroups[Group];
+	RxGroup->Members = 0;
+	for(uint8_t Handle = 0; Handle < CAN_MAX_RX_FILTERS; Handle++)
+	{
+		CanRxFilter_t *Filter = &CanRxFilters[Handle];
+		if( !Filter->Active || (Filter->Group != Group) )
+		{
+			continue;
+		}
+		if(RxGroup->Members++ == 0)
+		{
+			RxGroup->ID = Filter->ID;
+			RxGroup->Mask = Filter->Mask;
+		}
+		else
+		{
+			RxGroup->Mask = CanRxMergedMask(RxGroup->ID, RxGroup->Mask, Filter->ID, Filter->Mask);
+			RxGroup->ID &= RxGroup->Mask;
+		}
+	}
+}
+//Groups all filters again from scratch: one chain each, then the two chains whose merge keeps the most mask bits are
+//merged until they fit the mailboxes
+static void CanRxRebuild()
+{
+	uint8_t Count = 0;
+	uint8_t Merged[CAN_MAX_RX_FILTERS];	//Filter groups before they are numbered
+	uint32_t IDs[CAN_MAX_RX_FILTERS];
+	uint32_t Masks[CAN_MAX_RX_FILTERS];
 	
-	//TODO: HANDLE MORE THAN 7 RX BOX
-	reset_mailbox_conf(&rx_mailbox);
+	for(uint8_t Handle = 0; Handle < CAN_MAX_RX_FILTERS; Handle++)
+	{
+		if(CanRxFilters[Handle].Active)
+		{
+			Merged[Handle] = Count;
+			IDs[Count] = CanRxFilters[Handle].ID;
+			Masks[Count] = CanRxFilters[Handle].Mask;
+			Count++;
+		}
+	}
 	
-	rx_mailbox.ul_mb_idx = rx_mailbox_num;
-	rx_mailbox.uc_obj_type = CAN_MB_RX_MODE;
-
-	rx_mailbox.ul_id = CAN_MID_MIDvA(Pattern[2] << 8 | Pattern[3]) | CAN_MID_MIDvB(Pattern[0] << 8 | Pattern[1]);
-	rx_mailbox.ul_id_msk = CAN_MID_MIDvA(Mask[2] << 8 | Mask[3]) | CAN_MID_MIDvB(Mask[0] << 8 | Mask[1]);
+	while(Count > CAN_RX_MAILBOXES)
+	{
+		uint8_t First = 0, Second = 1;
+		int BestBits = -1;
+		for(uint8_t i = 0; i < Count; i++)
+		{
+			for(uint8_t j = i + 1; j < Count; j++)
+			{
+				int Bits = __builtin_popcount(CanRxMergedMask(IDs[i], Masks[i], IDs[j], Masks[j]));
+				if(Bits > BestBits)
+				{
+					First = i;
+					Second = j;
+					BestBits = Bits;
+				}
+			}
+		}
+		Masks[First] = CanRxMergedMask(IDs[First], Masks[First], IDs[Second], Masks[Second]);
+		IDs[First] &= Masks[First];
+		//The last group takes the place of the second one
+		Count--;
+		IDs[Second] = IDs[Count];
+		Masks[Second] = Masks[Count];
+		for(uint8_t Handle = 0; Handle < CAN_MAX_RX_FILTERS; Handle++)
+		{
+			if(!CanRxFilters[Handle].Active)
+			{
+				continue;
+			}
+			if(Merged[Handle] == Second)
+			{
+				Merged[Handle] = First;
+			}
+			else if(Merged[Handle] == Count)
+			{
+				Merged[Handle] = Second;
+			}
+		}
+	}
 	
-	if(type)
+	for(uint8_t Handle = 0; Handle < CAN_MAX_RX_FILTERS; Handle++)
+	{
+		if(CanRxFilters[Handle].Active)
+		{
+			CanRxFilters[Handle].Group = Merged[Handle];
+		}
+	}
+	CanRxGroupCount = Count;
+	for(uint8_t Group = 0; Group < CanRxGroupCount; Group++)
 	{
-		rx_mailbox.ul_id |= CAN_MID_MIDE;
-		rx_mailbox.ul_id_msk |= CAN_MAM_MIDE;
+		CanRxRegroup(Group);
 	}
+	CanRxLayout();
+}
+//Loads the mask of a chain into its mailboxes. The last mailbox of a chain is in overwrite mode, so a full chain
+//loses the newest frame instead of stalling.
+static void CanRxLoadGroup(uint8_t Group)
+{
+	can_mb_conf_t MailboxConf;
+	CanRxGroup_t *RxGroup = &CanRxGroups[Group];
+	uint32_t Mailboxes = 0;
 	
-	can_mailbox_init(SYSTEM_CAN, &rx_mailbox);
+	for(uint8_t i = 0; i < RxGroup->Mailboxes; i++)
+	{
+		Mailboxes |= 0x1u << (RxGroup->FirstMailbox + i);
+	}
+	can_disable_interrupt(SYSTEM_CAN, Mailboxes);
 	
-	can_enable_interrupt(SYSTEM_CAN, (0x1u << rx_mailbox_num++));
-	NVIC_EnableIRQ(SYSTEM_CAN_IRQ);
-	NVIC_SetPriority(SYSTEM_CAN_IRQ, 7);
-	reset_mailbox_conf(&rx_mailbox);
+	for(uint8_t i = 0; i < RxGroup->Mailboxes; i++)
+	{
+		reset_mailbox_conf(&MailboxConf);
+		MailboxConf.ul_mb_idx = RxGroup->FirstMailbox + i;
+		MailboxConf.uc_obj_type = ( (RxGroup->Mailboxes > 1) && (i == RxGroup->Mailboxes - 1) ) ? CAN_MB_RX_OVER_WR_MODE : CAN_MB_RX_MODE;
+		MailboxConf.ul_id = RxGroup->ID;
+		MailboxConf.ul_id_msk = RxGroup->Mask;
+		can_mailbox_init(SYSTEM_CAN, &MailboxConf);
+	}
 	
+	can_enable_interrupt(SYSTEM_CAN, Mailboxes);
+}
+/*
+Shares the receive mailboxes out between the chains. The mailboxes of a chain form a hardware FIFO: they all have
+the same acceptance mask and the controller stores each frame in the lowest numbered free one.
+*/
+static void CanRxLayout()
+{
+	can_mb_conf_t MailboxConf;
+	uint8_t Mailbox = CAN_COMM_RXMB_ID;
+	
+	//No receive interrupts while the mailboxes are moved around
+	can_disable_interrupt(SYSTEM_CAN, CAN_RX_MAILBOX_MASK);
+	
+	for(uint8_t Group = 0; Group < CanRxGroupCount; Group++)
+	{
+		//Leftover mailboxes go to the first chains
+		CanRxGroups[Group].FirstMailbox = Mailbox;
+		CanRxGroups[Group].Mailboxes = (CAN_RX_MAILBOXES / CanRxGroupCount) + ((Group < (CAN_RX_MAILBOXES % CanRxGroupCount)) ? 1 : 0);
+		Mailbox += CanRxGroups[Group].Mailboxes;
+		CanRxLoadGroup(Group);
+	}
 	
+	for(; Mailbox < MAX_NUMBER_OF_MAILBOXES; Mailbox++)
+	{
+		reset_mailbox_conf(&MailboxConf);
+		MailboxConf.ul_mb_idx = Mailbox;
+		MailboxConf.uc_obj_type = CAN_MB_DISABLE_MODE;
+		can_mailbox_init(SYSTEM_CAN, &MailboxConf);
+	}
 }
-//Removes a mailbox
-void RemoveMailbox(uint8_t MailboxID)
+//Exact match of a received frame against the filters, a merged mailbox mask lets more through than was asked for
+static bool CanRxAccept(uint32_t MID)
 {
-	rx_mailbox.ul_mb_idx = MailboxID;
-	rx_mailbox.uc_obj_type = CAN_MB_DISABLE_MODE;
-	can_mailbox_init(SYSTEM_CAN, &rx_mailbox);	
-	can_disable_interrupt(SYSTEM_CAN, (0x1u << rx_mailbox_num));	
-	reset_mailbox_conf(&rx_mailbox);
-	rx_mailbox_num--;
-	if(rx_mailbox_num <= 0)
+	bool Accepted = false;
+	for(uint8_t Handle = 0; Handle < CAN_MAX_RX_FILTERS; Handle++)
 	{
-		rx_mailbox_num = 1;	
+		CanRxFilter_t *Filter = &CanRxFilters[Handle];
+		if( Filter->Active && (((MID ^ Filter->ID) & Filter->Mask) == 0) )
+		{
+			Filter->Hits++;
+			Accepted = true;
+		}
 	}
+	return Accepted;
 }
 //Resets the mailbox configuration vairables
 static void reset_mailbox_conf(can_mb_conf_t *p_mailbox)
@@ -297,27 +652,9 @@ static void reset_mailbox_conf(can_mb_conf_t *p_mailbox)
 	p_mailbox->ul_datal = 0;
 	p_mailbox->ul_datah = 0;
 }
-//Timer interuppty
-TC3_Handler()
-{
-	if ((tc_get_status(TP_TIMEOUT_TIMER, TP_TIMEOUT_TIMER_CHANNEL) & TC_SR_CPCS) == TC_SR_CPCS)
-	{
-		NVIC_ClearPendingIRQ(TC3_IRQn);
-		TimeoutCB();
-		
-		Error_T TPTImeoutError;
-		TPTImeoutError.ThrowerID = THROWER_ID_ISO_TP;
-		TPTImeoutError.ErrorMajor = TP_TIMEOUT;
-		TPTImeoutError.ErrorMinor = ERROR_NO_MINOR_CODE;
-		ThrowError(&TPTImeoutError);
-	}
-}
 //CAN interrupt
 CAN0_Handler()
  {
-	 uint8_t* FlowControlMessage;
-	 uint8_t FlowControlMessageSize;
-	 uint8_t retval;
 	 uint8_t Mailbox;
 	 uint32_t CanStatusReg;
 	 
@@ -327,140 +664,261 @@ CAN0_Handler()
 		  CanStatusReg = CAN0->CAN_SR;
 		  SYSTEM_CAN->CAN_MR = CAN_MR_CANEN;  
 	  }
-//Check each mailbox
-	 for(Mailbox = CAN_COMM_RXMB_ID; Mailbox < MAX_NUMBER_OF_MAILBOXES; Mailbox++)
-	 {
-		//IF one is ready handle it
-		 iram_size_t ready = SYSTEM_CAN->CAN_MB[Mailbox].CAN_MSR & CAN_MSR_MRDY;
-		 if (  ready == CAN_MSR_MRDY)
-		 {
-			 rx_mailbox.ul_mb_idx = Mailbox;
-			 //read the mailbox
-			 can_mailbox_read(SYSTEM_CAN, &rx_mailbox);			 		
-			 
-			 
-			 /*This code will attempt to process the isoTP messages in the driver software*/
-			 
-			 uint32_t MessageID = (( rx_mailbox.ul_id & 0x1FFC0000) >> 18) |  rx_mailbox.ul_fid;
-			 uint8_t MessageIDArr[5];
-			 
-			 MessageIDArr[0] = (MessageID >> 24) & 0xFF;
-			 MessageIDArr[1] = (MessageID >> 16) & 0xFF;
-			 MessageIDArr[2] = (MessageID >> 8) & 0xFF;
-			 MessageIDArr[3] = MessageID & 0xFF;
-			 
-			 uint8_t CANMessageReceived[17] = {START_BYTE, 0x00, 0x0E, NETWORK_MESSAGE, 0x02 ,MessageIDArr[0], MessageIDArr[1], MessageIDArr[2], MessageIDArr[3], 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa};
-			 //if(MessageIDArr[2] == 0x03)
-			 //{
-			 //return;
-			 //}
-			 memcpy(CANMessageReceived+9,&rx_mailbox.ul_datal,8);
-			 
-			 Message_t CanSfMessage;
-			 CanSfMessage.buf = CANMessageReceived;
-			 CanSfMessage.Size = 17;
-			 WriteMessage(&CanSfMessage);
-			 
-			 /*This code will filter it and run it against the firmware isotp processor. Uncomment it for that.*/
-			 /*Neither option works and this was the major hangup of this project. */
-			 
-			 //retval = RunFilters(MessageIDArr,4,&FlowControlMessage, &FlowControlMessageSize);
-			 //
-			 //if(retval == 0)
-			 //{
-				 ////No matching filters
-				 //return;
-			 //}
-			 //else if(retval == 1)
-			 //{
-				//uint8_t CANMessageReceived[17] = {START_BYTE, 0x00, 0x0E, NETWORK_MESSAGE, 0x02 ,MessageIDArr[0], MessageIDArr[1], MessageIDArr[2], MessageIDArr[3], 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa};
-					////if(MessageIDArr[2] == 0x03)
-					////{
-						////return;
-					////}
-				//memcpy(CANMessageReceived+9,&rx_mailbox.ul_datal,8);	
-				//
-				//Message_t CanSfMessage;
-				//CanSfMessage.buf = CANMessageReceived;
-				//CanSfMessage.Size = 17;
-				//WriteMessage(&CanSfMessage);
-				 //
-			 //}
-			 //else if(retval == 3)
-			 //{
-				 //
-				 ////uint8_t CANMessageReceived[17] = {START_BYTE, 0x00, 0x0E, NETWORK_MESSAGE, 0x03, MessageIDArr[0], MessageIDArr[1], MessageIDArr[2], MessageIDArr[3], 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa};
-				 //////if(MessageIDArr[2] == 0x03)
-				 //////{
-				 //////return;
-				 //////}
-				 ////memcpy(CANMessageReceived+9,&rx_mailbox.ul_datal,8);
-				 ////Message_t CanSfMessage;
-				 ////CanSfMessage.buf = CANMessageReceived;
-				 ////CanSfMessage.Size = 17;
-				 ////WriteMessage(&CanSfMessage);
-				 //
-				 ////Flow control filter passed, process with ISO15765
-				 //isotp_continue_receive(
-				 //&shims,
-				 //&rx_handle,
-				 //MessageID,
-				 //(FlowControlMessage[0] << 24) | (FlowControlMessage[1] << 16) | (FlowControlMessage[2] << 8) | FlowControlMessage[3],
-				 //FlowControlMessage[4],
-				 //&rx_mailbox.ul_datal,
-				 //7,
-				 //9
-				 //);
-			 //}
-		 } 
-	 }
- }
- 
- /* ISO-TP SHIMS*/
- bool RunTimer(uint16_t time_ms,bool stop, TimeoutCallback cb)
- {
-	 if(stop)
-	 {
-		 tc_stop(TP_TIMEOUT_TIMER, TP_TIMEOUT_TIMER_CHANNEL);
-		 NVIC_DisableIRQ(TC3_IRQn);
-		 return true;
-	 }
-	 //Run the timer for X milliseconds
-	 tc_write_rc(TP_TIMEOUT_TIMER, TP_TIMEOUT_TIMER_CHANNEL, cpu_ms_2_cy(time_ms,96000000));
-	 tc_enable_interrupt(TP_TIMEOUT_TIMER, TP_TIMEOUT_TIMER_CHANNEL,  TC_IER_CPCS);
-	 NVIC_EnableIRQ(TC3_IRQn);
-	 NVIC_SetPriority(TC3_IRQn,0);
-	 tc_start(TP_TIMEOUT_TIMER, TP_TIMEOUT_TIMER_CHANNEL);
-	 TimeoutCB = cb;
-	 return true;
- }
-
- //Called when a complete can message is received
- //TODO: Proper Formatting here
- void message_received( const IsoTpMessage* message) {
-	 Message_t CanMessageReceived;
-	  uint8_t MessageIDArr[5];
 	  
-	MessageIDArr[0] = (message->arbitration_id >> 24) & 0xFF;
-	MessageIDArr[1] = (message->arbitration_id >> 16) & 0xFF;
-	MessageIDArr[2] = (message->arbitration_id >> 8) & 0xFF;
-	MessageIDArr[3] = message->arbitration_id & 0xFF;
-	message->payload[0] = START_BYTE;
-	 
-	message->payload[1] = ( ((message->size) - 3) & 0xFF00) >> 8;
-	message->payload[2] = (message->size) - 3 & 0x00FF;
-	message->payload[3] = NETWORK_MESSAGE;
-	message->payload[4] = 3;
-	message->payload[5] = MessageIDArr[0];
-	message->payload[6] = MessageIDArr[1];
-	message->payload[7] = MessageIDArr[2]; 
-	message->payload[8] = MessageIDArr[3];
-	 
-	CanMessageReceived.buf = message->payload;
-	CanMessageReceived.Size = message->size;
-	WriteMessage(&CanMessageReceived);
+	//Transmit mailboxes are ready again once their frame is on the bus, load the next ones
+	irqflags_t flags = cpu_irq_save();
+	bool TxDone = false;
+	for(Mailbox = 0; Mailbox < CAN_TX_MAILBOXES; Mailbox++)
+	{
+		if( (CanTxMailboxKey[Mailbox] != CAN_TX_MAILBOX_FREE) && (SYSTEM_CAN->CAN_MB[Mailbox].CAN_MSR & CAN_MSR_MRDY) )
+		{
+			can_disable_interrupt(SYSTEM_CAN, 0x1u << Mailbox);
+			CanTxMailboxKey[Mailbox] = CAN_TX_MAILBOX_FREE;
+			TxDone = true;
+		}
+	}
+	if(TxDone)
+	{
+		CanTxRefill();
+	}
+	cpu_irq_restore(flags);
+	
+//Service the ready receive mailboxes oldest frame first, frames of one filter can be spread over its whole chain.
+	//CAN_SR is read again until nothing is left, more frames may have arrived meanwhile.
+	uint32_t Ready;
+	while( (Ready = SYSTEM_CAN->CAN_SR & SYSTEM_CAN->CAN_IMR & CAN_RX_MAILBOX_MASK) != 0 )
+	{
+		uint16_t Timestamps[MAX_NUMBER_OF_MAILBOXES];
+		for(Mailbox = CAN_COMM_RXMB_ID; Mailbox < MAX_NUMBER_OF_MAILBOXES; Mailbox++)
+		{
+			Timestamps[Mailbox] = SYSTEM_CAN->CAN_MB[Mailbox].CAN_MSR & CAN_MSR_MTIMESTAMP_Msk;
+		}
+		
+		while(Ready)
+		{
+			uint8_t Oldest = MAX_NUMBER_OF_MAILBOXES;
+			for(Mailbox = CAN_COMM_RXMB_ID; Mailbox < MAX_NUMBER_OF_MAILBOXES; Mailbox++)
+			{
+				//MTIMESTAMP wraps, compare the difference
+				if( (Ready & (0x1u << Mailbox)) && ( (Oldest == MAX_NUMBER_OF_MAILBOXES) || ((int16_t)(Timestamps[Mailbox] - Timestamps[Oldest]) < 0) ) )
+				{
+					Oldest = Mailbox;
+				}
+			}
+			Ready &= ~(0x1u << Oldest);
+			CanRxReadMailbox(Oldest);
+		}
+	}
  }
  
-
+//Reads a receive mailbox into the ring for the main loop
+static void CanRxReadMailbox(uint8_t Mailbox)
+{
+	can_mb_conf_t Received;
+	
+	Received.ul_mb_idx = Mailbox;
+	Received.ul_status = SYSTEM_CAN->CAN_MB[Mailbox].CAN_MSR;
+	uint32_t Time = CanRxFrameTime(Received.ul_status & CAN_MSR_MTIMESTAMP_Msk);
+	//read the mailbox, this also frees it for the next frame
+	if(can_mailbox_read(SYSTEM_CAN, &Received) & CAN_MAILBOX_RX_OVER)
+	{
+		//Mailbox was overwritten before we got to it
+		CanRxDropped++;
+	}
+	
+	uint32_t ID = (( Received.ul_id & 0x1FFC0000) >> 18) |  Received.ul_fid;
+	//ISO 15765 frames are reassembled here, flow control can't wait for the host
+	uint8_t Data[8];
+	memcpy(Data, &Received.ul_datal, 4);
+	memcpy(Data + 4, &Received.ul_datah, 4);
+	if(IsoTpReceiveFrame(Received.ul_id, ID, Data, Received.uc_length, Time))
+	{
+		return;
+	}
+	
+	//Queue the frame for the main loop, USB is much too slow to write from here
+	uint32_t Head = CanRxHead;
+	if(Head - CanRxTail >= CAN_RX_RING_SIZE)
+	{
+		CanRxDropped++;
+		return;
+	}
+	CanRxFrame_t *Frame = &CanRxRing[Head & (CAN_RX_RING_SIZE - 1)];
+	Frame->ID = ID;
+	Frame->DataL = Received.ul_datal;
+	Frame->DataH = Received.ul_datah;
+	Frame->MID = Received.ul_id;
+	Frame->Time = Time;
+	Frame->Length = (Received.uc_length > 8) ? 8 : Received.uc_length;
+	//Frame must be complete before the main loop can see it
+	__DMB();
+	CanRxHead = Head + 1;
+}
+//Run time of a mailbox timestamp. MTIMESTAMP is the CAN timer at the start of the frame, it counts bit times
+//and wraps after 65536 of them, so this must be done while the frame is fresh.
+static uint32_t CanRxFrameTime(uint16_t Timestamp)
+{
+	uint16_t Age = (uint16_t)(can_get_internal_timer_value(SYSTEM_CAN) - Timestamp);
+	return RunTimeMicroseconds() - (Age * 1000UL) / CanBitRateKbps;
+}
  
- /* ISO-TP SHIMS*/
\ No newline at end of file
+//Packs the frames queued by CAN0_Handler into containers for the host. Called from the main loop.
+void CanProcessReceivedFrames()
+{
+	while(CanRxTail != CanRxHead)
+	{
+		uint32_t Tail = CanRxTail;
+		uint32_t Head = CanRxHead;
+		
+		while(Tail != Head)
+		{
+			CanRxFrame_t *Frame = &CanRxRing[Tail & (CAN_RX_RING_SIZE - 1)];
+			Tail++;
+			if(CanRxAccept(Frame->MID))
+			{
+				CanRxAddRecord(Frame);
+			}
+		}
+		//Slots are free again once copied
+		__DMB();
+		CanRxTail = Tail;
+	}
+	
+	if( CanRxContainerLength && ( (CanRxLatencyUs == 0) || CanRxFlushDue ) )
+	{
+		CanRxFlush();
+	}
+	
+	if(CanRxDropped)
+	{
+		//Counter is also written by the interrupt
+		NVIC_DisableIRQ(SYSTEM_CAN_IRQ);
+		uint32_t Dropped = CanRxDropped;
+		CanRxDropped = 0;
+		NVIC_EnableIRQ(SYSTEM_CAN_IRQ);
+		
+		Error_T CanRxOverflowError;
+		CanRxOverflowError.ThrowerID = THROWER_ID_CAN;
+		CanRxOverflowError.ErrorMajor = CAN_RX_OVERFLOW;
+		CanRxOverflowError.ErrorMinor = (Dropped > 0xFF) ? 0xFF : Dropped;
+		ThrowError(&CanRxOverflowError);
+	}
+	
+	IsoTpProcessReceivedMessages();
+}
+
+void CanSetRxBatching(bool FlushAtSof, uint16_t LatencyUs)
+{
+	//Records already waiting go out with the old settings
+	if(CanRxContainerLength)
+	{
+		CanRxFlush();
+	}
+	CanRxFlushAtSof = FlushAtSof;
+	CanRxLatencyUs = LatencyUs;
+}
+//Called from main_sof_action, the container then goes out in the next USB frame
+void CanRxStartOfFrame()
+{
+	if(CanRxFlushAtSof)
+	{
+		CanRxFlushDue = true;
+	}
+}
+
+static void CanRxAddRecord(const CanRxFrame_t *Frame)
+{
+	//Largest size it can take, an ID delta is only known once there is a previous record
+	if( CanRxContainerLength && (CanRxContainerLength + CAN_RX_RECORD_HEADER + 4 + Frame->Length > CAN_RX_CONTAINER_SIZE) )
+	{
+		CanRxFlush();
+	}
+	
+	uint8_t *Record;
+	uint8_t IdMode = CAN_RX_ID_FULL;
+	uint32_t DeltaUs = 0;
+	if(CanRxContainerLength == 0)
+	{
+		CanRxContainer[0] = START_BYTE;
+		CanRxContainer[3] = NETWORK_BATCH;
+		CanRxContainer[4] = 0x02;
+		CanRxContainer[5] = (Frame->Time >> 24) & 0xFF;
+		CanRxContainer[6] = (Frame->Time >> 16) & 0xFF;
+		CanRxContainer[7] = (Frame->Time >> 8) & 0xFF;
+		CanRxContainer[8] = Frame->Time & 0xFF;
+		CanRxContainerLength = CAN_RX_CONTAINER_HEADER;
+		CanRxFlushDue = false;
+		if(CanRxLatencyUs)
+		{
+			NVIC_DisableIRQ(SYSTEM_CAN_IRQ);
+			NVIC_DisableIRQ(CAN_WHEEL_TIMER_IRQ);
+			CanWheelTimerStart(&CanRxDeadline, CanRxLatencyUs);
+			NVIC_EnableIRQ(CAN_WHEEL_TIMER_IRQ);
+			NVIC_EnableIRQ(SYSTEM_CAN_IRQ);
+		}
+	}
+	else
+	{
+		//Frames are queued oldest first, but make sure a tie can't look like a long gap
+		DeltaUs = ((int32_t)(Frame->Time - CanRxLastTime) > 0) ? Frame->Time - CanRxLastTime : 0;
+		int32_t IdDelta = (int32_t)(Frame->ID - CanRxLastID);
+		if(IdDelta == 0)
+		{
+			IdMode = CAN_RX_ID_SAME;
+		}
+		else if( (IdDelta >= -128) && (IdDelta <= 127) )
+		{
+			IdMode = CAN_RX_ID_DELTA;
+		}
+	}
+	
+	Record = CanRxContainer + CanRxContainerLength;
+	Record[0] = IdMode | Frame->Length;
+	Record[1] = (DeltaUs > 0xFFFF) ? 0xFF : (DeltaUs >> 8) & 0xFF;
+	Record[2] = (DeltaUs > 0xFFFF) ? 0xFF : DeltaUs & 0xFF;
+	uint8_t Index = CAN_RX_RECORD_HEADER;
+	switch(IdMode)
+	{
+		case CAN_RX_ID_FULL:
+			Record[Index++] = (Frame->ID >> 24) & 0xFF;
+			Record[Index++] = (Frame->ID >> 16) & 0xFF;
+			Record[Index++] = (Frame->ID >> 8) & 0xFF;
+			Record[Index++] = Frame->ID & 0xFF;
+		break;
+		
+		case CAN_RX_ID_DELTA:
+			Record[Index++] = (uint8_t)(Frame->ID - CanRxLastID);
+		break;
+	}
+	uint8_t Data[8];
+	memcpy(Data, &Frame->DataL, 4);
+	memcpy(Data + 4, &Frame->DataH, 4);
+	memcpy(Record + Index, Data, Frame->Length);
+	CanRxContainerLength += Index + Frame->Length;
+	
+	CanRxLastID = Frame->ID;
+	CanRxLastTime = Frame->Time;
+}
+
+static void CanRxFlush()
+{
+	Message_t ContainerMessage;
+	CanRxContainer[1] = ((CanRxContainerLength - 3) >> 8) & 0xFF;
+	CanRxContainer[2] = (CanRxContainerLength - 3) & 0xFF;
+	ContainerMessage.buf = CanRxContainer;
+	ContainerMessage.Size = CanRxContainerLength;
+	WriteMessage(&ContainerMessage);
+	CanRxContainerLength = 0;
+	CanRxFlushDue = false;
+	
+	NVIC_DisableIRQ(SYSTEM_CAN_IRQ);
+	NVIC_DisableIRQ(CAN_WHEEL_TIMER_IRQ);
+	CanWheelTimerStop(&CanRxDeadline);
+	NVIC_EnableIRQ(CAN_WHEEL_TIMER_IRQ);
+	NVIC_EnableIRQ(SYSTEM_CAN_IRQ);
+}
+
+static void CanRxDeadlineExpired(void *Context)
+{
+	CanRxFlushDue = true;
+}
\ No newline at end of file
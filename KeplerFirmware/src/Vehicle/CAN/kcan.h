@@ -12,7 +12,6 @@
 #include <asf.h>
 #include "Message.h"
 #include "KeplerConfiguration.h"
-#include "isotp_types.h"
 
 #define CHANNEL_HSC		0x00
 #define CHANNEL_MSC		0x01
@@ -26,12 +25,76 @@
 #define SYSTEM_CAN_ID ID_CAN0
 #define SYSTEM_CAN_IRQ CAN0_IRQn
 
-#define CAN_COMM_RXMB_ID 1
-#define CAN_COMM_TXMB_ID 0
+//Mailboxes 0 to CAN_TX_MAILBOXES-1 send, the rest receive
+#define CAN_TX_MAILBOXES 3
+#define CAN_COMM_RXMB_ID CAN_TX_MAILBOXES
+#define CAN_RX_MAILBOXES (MAX_NUMBER_OF_MAILBOXES - CAN_COMM_RXMB_ID)
+#define CAN_RX_MAILBOX_MASK (((0x1u << MAX_NUMBER_OF_MAILBOXES) - 1) & ~((0x1u << CAN_COMM_RXMB_ID) - 1))
+
+#define CAN_TX_QUEUE_SIZE 32			//Frames waiting for a transmit mailbox
+#define CAN_TX_QUEUE_TIMEOUT_US 100000	//How long the main loop waits for room in the queue
+#define CAN_TX_MAILBOX_FREE 0xFFFFFFFF
+
+#define CAN_RX_RING_SIZE 128			//Must be a power of two
+
+/*
+* Received frames go to the host packed in NETWORK_BATCH containers:
+*	START_BYTE LenH LenL NETWORK_BATCH <network type> <time, 4 bytes> <record> <record> ...
+* Record:
+*	<header> <dT H> <dT L> [ID] <data>
+* Time is that of the first record, as in NETWORK_MESSAGE frames. Header bits 0-3 are the data length, bits 4-5
+* how the ID is sent (CAN_RX_ID_*). dT is the time since the previous record in microseconds, 0 for the first
+* one and 0xFFFF if longer.
+* A container is written when the next record doesn't fit, when the oldest record in it is LatencyUs old, or
+* at the USB start of frame so it goes out with that frame.
+*/
+#define CAN_RX_CONTAINER_SIZE 64		//One full speed USB packet
+#define CAN_RX_CONTAINER_HEADER 9
+#define CAN_RX_RECORD_HEADER 3
+#define CAN_RX_ID_FULL 0x00				//4 byte ID
+#define CAN_RX_ID_SAME 0x10				//Same ID as the previous record, nothing sent
+#define CAN_RX_ID_DELTA 0x20			//1 byte, signed difference to the previous record's ID
+#define CAN_RX_DEFAULT_LATENCY_US 1000
+
+#define CAN_MAX_RX_FILTERS 16		//More than there are receive mailboxes, filters are merged to fit
+#define CAN_RX_NO_FILTER 0xFF
+
+typedef struct {
+	uint32_t ID;
+	uint32_t DataL;
+	uint32_t DataH;
+	uint32_t MID;					//CAN_MID of the mailbox, for the exact filter match
+	uint32_t Time;					//RunTimeMicroseconds() at the start of the frame
+	uint8_t Length;					//DLC
+} CanRxFrame_t;
+
+typedef struct {
+	uint32_t Key;					//Bus arbitration order, lowest goes out first
+	uint32_t ID;					//CAN_MID value
+	uint32_t DataL;
+	uint32_t DataH;
+} CanTxFrame_t;
+
+//Acceptance filter set by the host
+typedef struct {
+	bool Active;
+	uint8_t Group;					//Mailbox chain it was merged into
+	uint32_t ID;					//CAN_MID value
+	uint32_t Mask;					//CAN_MAM value
+	uint32_t Hits;					//Frames that matched it
+} CanRxFilter_t;
+
+//Merged acceptance mask of one or more filters, loaded into a chain of receive mailboxes
+typedef struct {
+	uint32_t ID;
+	uint32_t Mask;
+	uint8_t Members;
+	uint8_t FirstMailbox;
+	uint8_t Mailboxes;
+} CanRxGroup_t;
 
 static can_mb_conf_t tx_mailbox;
 static can_mb_conf_t rx_mailbox;
-extern uint32_t rx_mailbox_num;
 
 void InitalizeCanSystem(uint8_t DataRate, uint32_t ul_sysclk);
 void HandleSendCanRequest(Message_t *OutgoingMessage);
@@ -44,11 +107,18 @@ void DisableAllTransceivers();
 * Mask is the message mask
 * Pattern is the message pattern
 * Length is the length of the mask and pattern. These must be the same length.
+* Returns the filter handle, CAN_RX_NO_FILTER if there is no room.
+*/
+uint8_t InitalizeReceiverMailbox(uint8_t type, uint8_t * Mask, uint8_t* Pattern);
+bool RemoveMailbox(uint8_t FilterID);
+bool GetCanFilterHits(uint8_t FilterID, uint32_t *Hits);
+void RemoveAllReceiverMailboxes(void);
+void CanProcessReceivedFrames(void);
+/*
+* FlushAtSof writes the container at every USB start of frame.
+* LatencyUs is how long a record may wait for more to fill the container, 0 writes as soon as no more frames
+* are waiting.
 */
-void InitalizeReceiverMailbox(uint8_t type, uint8_t * Mask, uint8_t* Pattern);
-bool RunTimer(uint16_t time_ms,bool stop, TimeoutCallback cb);
-void ReceiveNormalMessage(can_mb_conf_t *mb);
-void message_received(const IsoTpMessage* message);
-void delayms(uint32_t delay);
-void RemoveMailbox(uint8_t MailboxID);
+void CanSetRxBatching(bool FlushAtSof, uint16_t LatencyUs);
+void CanRxStartOfFrame(void);
 #endif /* CAN_H_ */
\ No newline at end of file
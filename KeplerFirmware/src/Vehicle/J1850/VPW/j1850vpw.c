@@ -6,8 +6,86 @@
  */ 
 
 #include "j1850vpw.h"
-
-static void VPWNetworkMessageStartDetect(const uint32_t id, const uint32_t index);
+#include "runtimer.h"
+
+static void VPWRxEdge(const uint32_t id, const uint32_t index);
+static void VPWRxSetTimeout(uint32_t Now, uint16_t Timeout);
+static void VPWRxComplete(void);
+static void VPWRxAbort(void);
+static void VPWStreamLiveFrame(void);
+static void VPWStreamRecord(uint8_t Status, const uint8_t *Data, uint16_t Length);
+static void VPWTxStart(void);
+static void VPWTxNextSymbol(void);
+static void VPWTxBackoff(void);
+static void VPWTxFinish(uint8_t Result);
+
+//Receive pulse width limits. The receive timer runs at the same clock in both modes, so 4x just has a quarter of the widths
+static const VPWRxThresholds_t VPWRxThresholdTable[2] = {
+	{RX_SHORT_MAX, RX_LONG_MIN, RX_LONG_MAX, RX_SOF_MIN, RX_SOF_MAX, RX_EOD_MIN},
+	{RX_SHORT_MAX / 4, RX_LONG_MIN / 4, RX_LONG_MAX / 4, RX_SOF_MIN / 4, RX_SOF_MAX / 4, RX_EOD_MIN / 4}
+};
+static const VPWRxThresholds_t *VPWRxTiming = &VPWRxThresholdTable[0];
+
+//Received frames, data starts after room for the KAVI header. Filled by the receive interrupts and sent out by
+//the main loop, a buffer is free when its length is 0
+static uint8_t VPWRxFrames[VPW_RX_FRAME_BUFFERS][VPW_BUF_SIZE];
+static volatile uint16_t VPWRxFrameLength[VPW_RX_FRAME_BUFFERS];
+static uint8_t VPWRxFill = 0;
+static uint8_t VPWRxSend = 0;
+static volatile uint32_t VPWRxDropped = 0;
+static volatile uint32_t VPWRxErrors = 0;
+
+//Frames are numbered at SOF so the main loop can follow the one being received for streaming
+static volatile uint32_t VPWRxFrameSeq = 0;
+static volatile uint16_t VPWRxLiveCount = 0;		//bytes of frame VPWRxFrameSeq in VPWRxFrames[VPWRxFill] so far
+static volatile uint32_t VPWRxAbortedSeq = 0;
+static uint32_t VPWRxFrameSeqs[VPW_RX_FRAME_BUFFERS];
+//Run time at the start of the SOF of frame VPWRxFrameSeq, and of the frames in the buffers
+static volatile uint32_t VPWRxFrameTime = 0;
+static uint32_t VPWRxFrameTimes[VPW_RX_FRAME_BUFFERS];
+
+//Streaming of long frames to the host while they are received, main loop only
+static bool VPWStreamEnabled = false;
+static uint32_t VPWStreamSeq = 0;			//frame the stream state is for
+static bool VPWStreamActive = false;		//chunks of it have been sent
+static bool VPWStreamFiltered = false;		//it didn't pass the filters
+static uint16_t VPWStreamSent = 0;
+static uint32_t VPWStreamTime = 0;
+static uint8_t VPWStreamRecordSeq = 0;
+
+//Decoder state, only used by the receive interrupts
+static VPWRxState_t VPWRxState = VPW_RX_IDLE;
+static uint32_t VPWRxLastEdge = 0;
+static uint16_t VPWRxByteCount = 0;
+static uint8_t VPWRxBitCount = 0;
+static uint8_t VPWRxCurrentByte = 0;
+static uint32_t VPWRxSofStart = 0;
+
+//Transmit symbol widths
+static const VPWTxTiming_t VPWTxTimingTable[2] = {
+	{TX_SOF, TX_EOF, TX_IFS, {{TX_SHORT, TX_LONG}, {TX_LONG, TX_SHORT}}},
+	{TX_SOF / 4, TX_EOF / 4, TX_IFS / 4, {{TX_SHORT / 4, TX_LONG / 4}, {TX_LONG / 4, TX_SHORT / 4}}}
+};
+static const VPWTxTiming_t *VPWTxTiming = &VPWTxTimingTable[0];
+
+//Frame being sent, written before the transmit interrupt is enabled and only read by it afterwards
+static uint8_t VPWTxFrame[VPW_BUF_SIZE];
+static uint16_t VPWTxLength = 0;
+static uint16_t VPWTxByte = 0;
+static uint8_t VPWTxBit = 0;
+static uint32_t VPWTxCompare = 0;
+static volatile VPWTxState_t VPWTxState = VPW_TX_IDLE;
+static uint8_t VPWTxRetries = VPW_TX_DEFAULT_RETRIES;
+static uint8_t VPWTxAttempts = 0;
+static bool VPWTxReport = false;
+
+//Result of the last reported frame, sent to the host by the main loop
+static volatile bool VPWTxReportReady = false;
+static uint8_t VPWTxReportResult = 0;
+static uint8_t VPWTxReportAttempts = 0;
+
+//Frames given up on that weren't reported
+static volatile uint32_t VPWTxCollisions = 0;
 
 
 void VPWEnable()
@@ -17,173 +95,361 @@ void VPWEnable()
 	sysclk_enable_peripheral_clock(VPW_PIO_CHANNEL_ID);
 	
 	pio_set_input(VPW_PIO_CHANNEL,J1850_VPW_RX,PIO_DEFAULT);
-	pio_handler_set(VPW_PIO_CHANNEL, VPW_PIO_CHANNEL_ID, J1850_VPW_RX, PIO_IT_FALL_EDGE, VPWNetworkMessageStartDetect);
+	//Every edge of the receive line is timestamped with the free running receive timer
+	pio_handler_set(VPW_PIO_CHANNEL, VPW_PIO_CHANNEL_ID, J1850_VPW_RX, PIO_IT_EDGE, VPWRxEdge);
 	pio_enable_interrupt(PIOA, J1850_VPW_RX);
 	
+	//J1850_P_TX is TIOA1, so one free running channel does both directions. RA compares toggle the
+	//transmit pin, RC compares are the receive timeouts. A software trigger clears TIOA to passive.
 	tc_stop(VPW_TIMER, VPW_RX_TIMER_CHANNEL);
 	tc_init(
 	VPW_TIMER,
 	VPW_RX_TIMER_CHANNEL,
 	TC_CMR_TCCLKS_TIMER_CLOCK2|
-	TC_CMR_BURST_NONE 
+	TC_CMR_BURST_NONE|
+	TC_CMR_WAVE|
+	TC_CMR_WAVSEL_UP|
+	TC_CMR_EEVT_XC0|
+	TC_CMR_ACPA_TOGGLE|
+	TC_CMR_ASWTRG_CLEAR
 	);
 	tc_start(VPW_TIMER, VPW_RX_TIMER_CHANNEL);
+	VPWRxAbort();
+	
+	//The PIO drives the pin unless a frame is being sent
+	ioport_set_pin_mode(J1850_P_TX, IOPORT_MODE_MUX_B);
+	GO_PASSIVE
+	TX_PIN_TO_PIO
 	
+	//Edge and timeout interrupts share the decoder state, so they must have the same priority
 	NVIC_EnableIRQ(PIOA_IRQn);
 	NVIC_SetPriority(PIOA_IRQn,5);
-	GO_PASSIVE
+	NVIC_EnableIRQ(VPW_RX_TIMER_IRQ);
+	NVIC_SetPriority(VPW_RX_TIMER_IRQ,5);
 	VPWEnter1xMode();
 	VPWInitalizeCRCLUT();
 }
 
 void VPWDisable()
 {
+	if(VPWTxState != VPW_TX_IDLE)
+	{
+		VPWTxFinish(VPW_RETURN_CODE_UNKNOWN);
+	}
 	pio_disable_interrupt(PIOA, J1850_VPW_RX);
 	NVIC_DisableIRQ(PIOA_IRQn);
+	VPWRxAbort();
+	NVIC_DisableIRQ(VPW_RX_TIMER_IRQ);
 	sysclk_disable_peripheral_clock(VPW_TX_TIMER_ID);
 	sysclk_disable_peripheral_clock(VPW_RX_TIMER_ID);
 	sysclk_disable_peripheral_clock(VPW_PIO_CHANNEL_ID);
 	
 }
 
-static void VPWNetworkMessageStartDetect(const uint32_t id, const uint32_t index)
+//Both edges of the receive line. Measures the pulse that just ended and decodes it
+static void VPWRxEdge(const uint32_t id, const uint32_t index)
 {
-	if(id == VPW_PIO_CHANNEL_ID && index == J1850_VPW_RX)
+	if(id != VPW_PIO_CHANNEL_ID || index != J1850_VPW_RX)
+	{
+		return;
+	}
+	
+	if( (VPWTxState == VPW_TX_SOF) || (VPWTxState == VPW_TX_DATA) )
 	{
-		//Possible SOF, lets check that!
-		cpu_irq_disable();
-		VPWReceiveNetworkMessage(VehicleMessageBuffer, VPW_BUF_SIZE);	
-		cpu_irq_enable();
-	}	
+		//Edges of our own frame. The bus going active while we drive it passive means another node
+		//won arbitration.
+		if( (CURRENT_BUS_RX_STATE != VPW_RX_ACTIVE) || (CURRENT_BUS_STATE == VPW_ACTIVE) )
+		{
+			return;
+		}
+		if(VPWTxAttempts > VPWTxRetries)
+		{
+			VPWTxFinish(VPW_RETURN_CODE_BUS_ERROR);
+		}
+		else
+		{
+			VPWTxBackoff();
+		}
+		//This edge starts a pulse of the other node, let the receiver have it
+	}
+	
+	//SAM4E TC counters are 32 bit, widths and compares use the full counter
+	uint32_t Now = tc_read_cv(VPW_TIMER, VPW_RX_TIMER_CHANNEL);
+	uint32_t Width = Now - VPWRxLastEdge;
+	VPWRxLastEdge = Now;
+	//Level of the pulse that just ended
+	bool WasActive = (CURRENT_BUS_RX_STATE != VPW_RX_ACTIVE);
+	
+	//A passive pulse this long ends the frame. Normally the timeout does that, but it may still be pending
+	if( (VPWRxState == VPW_RX_DATA) && !WasActive && (Width >= VPWRxTiming->EodMin) )
+	{
+		VPWRxComplete();
+	}
+	
+	switch(VPWRxState)
+	{
+		case VPW_RX_IDLE:
+			if(!WasActive)
+			{
+				//Possible SOF, the frame time if it is one
+				VPWRxSofStart = RunTimeMicroseconds();
+				VPWRxState = VPW_RX_SOF;
+				VPWRxSetTimeout(Now, VPWRxTiming->SofMax);
+			}
+			else if(VPWTxState == VPW_TX_BACKOFF)
+			{
+				//Retry once the bus has been passive for IFS
+				VPWRxSetTimeout(Now, VPWTxTiming->Ifs);
+			}
+		break;
+		
+		case VPW_RX_SOF:
+			if( (Width < VPWRxTiming->SofMin) || (Width > VPWRxTiming->SofMax) )
+			{
+				VPWRxAbort();
+				break;
+			}
+			if(VPWRxFrameLength[VPWRxFill] != 0)
+			{
+				//Main loop hasn't sent the previous frame from this buffer yet
+				VPWRxDropped++;
+				VPWRxAbort();
+				break;
+			}
+			VPWRxByteCount = 0;
+			VPWRxBitCount = 0;
+			VPWRxCurrentByte = 0;
+			VPWRxLiveCount = 0;
+			VPWRxFrameTime = VPWRxSofStart;
+			VPWRxFrameSeq++;
+			VPWRxState = VPW_RX_DATA;
+			VPWRxSetTimeout(Now, VPWRxTiming->EodMin);
+		break;
+		
+		case VPW_RX_DATA:
+		{
+			bool Long;
+			if(Width <= VPWRxTiming->ShortMax)
+			{
+				Long = false;
+			}
+			else if( (Width >= VPWRxTiming->LongMin) && (Width <= VPWRxTiming->LongMax) )
+			{
+				Long = true;
+			}
+			else
+			{
+				VPWRxErrors++;
+				VPWRxAbort();
+				break;
+			}
+			//Passive short and active long are 0, passive long and active short are 1
+			VPWRxCurrentByte = (VPWRxCurrentByte << 1) | (Long != WasActive);
+			if(++VPWRxBitCount == 8)
+			{
+				if(VPWRxByteCount >= VPW_BUF_SIZE - VPW_RX_HEADER_SIZE)
+				{
+					VPWRxDropped++;
+					VPWRxAbort();
+					break;
+				}
+				VPWRxFrames[VPWRxFill][VPW_RX_HEADER_SIZE + VPWRxByteCount++] = VPWRxCurrentByte;
+				//Byte must be in the buffer before the main loop can see it
+				__DMB();
+				VPWRxLiveCount = VPWRxByteCount;
+				VPWRxBitCount = 0;
+				VPWRxCurrentByte = 0;
+			}
+			//Passive pulse may end the frame, an active one must not get too long
+			VPWRxSetTimeout(Now, WasActive ? VPWRxTiming->EodMin : VPWRxTiming->LongMax);
+		}
+		break;
+	}
 }
 
-void VPWReceiveNetworkMessage(unsigned char *mbuf, uint32_t MaxBytes)
+//Raises the timeout interrupt if there is no edge within Timeout counts from Now
+static void VPWRxSetTimeout(uint32_t Now, uint16_t Timeout)
 {
-	uint32_t TimerValue = 0;
-	uint32_t ByteCount = 0;
-	uint8_t CurrentByte = 0;
-	uint8_t ShiftValue = 0;
-	uint32_t BusState = 0;
-	uint32_t *MessageBufferStartAddress = mbuf;
-	Message_t NetworkMessage;
-	//Advance the buffer by 4 to leave room for KAVI Header
-	mbuf += 5;
-
-	//Start the timer
-	tc_start(VPW_TIMER, VPW_RX_TIMER_CHANNEL);
+	tc_write_rc(VPW_TIMER, VPW_RX_TIMER_CHANNEL, Now + Timeout);
+	//Clear a compare from before this edge. Never called while transmitting, so no RA compare is lost
+	tc_get_status(VPW_TIMER, VPW_RX_TIMER_CHANNEL);
+	tc_enable_interrupt(VPW_TIMER, VPW_RX_TIMER_CHANNEL, TC_IER_CPCS);
+}
 
-	//Time the possible SOF
-	while(CURRENT_BUS_RX_STATE == VPW_RX_ACTIVE)
+//Hands the frame over to the main loop if it ended on a byte boundary
+static void VPWRxComplete()
+{
+	if( (VPWRxByteCount > 1) && (VPWRxBitCount == 0) )
 	{
-		if(tc_read_cv(VPW_TIMER, VPW_RX_TIMER_CHANNEL) > (RX_SOF_MAX / PulseWidthDivisor) )
-		{
-			Error_T InvalidLengthByteError;
-			InvalidLengthByteError.ThrowerID = NETWORK_MESSAGE;
-			InvalidLengthByteError.ErrorMajor = VPW_RETURN_CODE_SOF_TOO_LONG_EXCEPTION;
-			InvalidLengthByteError.ErrorMinor = ERROR_NO_MINOR_CODE;
-			ThrowError(&InvalidLengthByteError);
+		VPWRxFrameSeqs[VPWRxFill] = VPWRxFrameSeq;
+		VPWRxFrameTimes[VPWRxFill] = VPWRxFrameTime;
+		VPWRxFrameLength[VPWRxFill] = VPWRxByteCount;
+		VPWRxFill = (VPWRxFill + 1) % VPW_RX_FRAME_BUFFERS;
+		VPWRxLiveCount = 0;
+		VPWRxState = VPW_RX_IDLE;
+	}
+	VPWRxAbort();
+}
 
-			return;
+//Back to waiting for SOF
+static void VPWRxAbort()
+{
+	if(VPWRxState == VPW_RX_DATA)
+	{
+		//Tell the main loop in case it was streaming this frame
+		VPWRxAbortedSeq = VPWRxFrameSeq;
+		VPWRxLiveCount = 0;
+	}
+	VPWRxState = VPW_RX_IDLE;
+	if(VPWTxState == VPW_TX_BACKOFF)
+	{
+		//Retry once the bus has been passive for IFS
+		VPWRxSetTimeout(VPWRxLastEdge, VPWTxTiming->Ifs);
+	}
+	else
+	{
+		tc_disable_interrupt(VPW_TIMER, VPW_RX_TIMER_CHANNEL, TC_IDR_CPCS);
+	}
+}
+
+//RA compare: the transmit pin just toggled, load the next symbol.
+//RC compare: receive timeout, end of data or SOF / active pulse too long. Or the bus has been idle
+//long enough to send a frame again after losing arbitration.
+void TC1_Handler()
+{
+	uint32_t Status = tc_get_status(VPW_TIMER, VPW_RX_TIMER_CHANNEL) & tc_get_interrupt_mask(VPW_TIMER, VPW_RX_TIMER_CHANNEL);
+	NVIC_ClearPendingIRQ(VPW_RX_TIMER_IRQ);
+	
+	if ((Status & TC_SR_CPAS) == TC_SR_CPAS)
+	{
+		VPWTxNextSymbol();
+	}
+	if ((Status & TC_SR_CPCS) == TC_SR_CPCS)
+	{
+		if( (VPWRxState == VPW_RX_DATA) && (CURRENT_BUS_RX_STATE != VPW_RX_ACTIVE) )
+		{
+			VPWRxComplete();
+		}
+		else if( (VPWRxState == VPW_RX_IDLE) && (VPWTxState == VPW_TX_BACKOFF) && (CURRENT_BUS_RX_STATE != VPW_RX_ACTIVE) )
+		{
+			tc_disable_interrupt(VPW_TIMER, VPW_RX_TIMER_CHANNEL, TC_IDR_CPCS);
+			VPWTxStart();
+		}
+		else
+		{
+			VPWRxAbort();
 		}
 	}
-	//Check possible SOF Length and handle accordingly
-	TimerValue = tc_read_cv(VPW_TIMER, VPW_RX_TIMER_CHANNEL);
+}
 
-	if( TimerValue > (RX_SOF_MIN/ PulseWidthDivisor))
+//Checks and sends out the frames received by the interrupts. Called from the main loop.
+void VPWProcessReceivedFrames()
+{
+	while(VPWRxFrameLength[VPWRxSend] != 0)
 	{
-		//It was an SOF, start receiving the message
-		while (ByteCount < MaxBytes)
+		unsigned char *mbuf = VPWRxFrames[VPWRxSend];
+		uint32_t ByteCount = VPWRxFrameLength[VPWRxSend];
+		Message_t NetworkMessage;
+		
+		if(VPWStreamActive && (VPWRxFrameSeqs[VPWRxSend] == VPWStreamSeq))
 		{
-			//Reset current byte
-			CurrentByte = 0;
-			for(int bitNumber = 7; bitNumber >= 0; bitNumber--)
+			//Rest of a streamed frame, then the CRC verdict
+			while(VPWStreamSent < ByteCount)
 			{
-				//Log bus state and start timing the state
-				BusState = CURRENT_BUS_RX_STATE;
-				tc_start(VPW_TIMER, VPW_RX_TIMER_CHANNEL);
-
-				while(CURRENT_BUS_RX_STATE == BusState)
-				{
-					//Wait until the bus state changes, if we wait longer than EOD then were done!
-					if(tc_read_cv(VPW_TIMER, VPW_RX_TIMER_CHANNEL) > (RX_EOD_MIN/ PulseWidthDivisor) )
-					{
-						goto HitEOD;
-					}
-				}
-
-				//Get pulse width
-				TimerValue = tc_read_cv(VPW_TIMER, VPW_RX_TIMER_CHANNEL);
-				//Assign a value based on the length of the pulse
-				if(TimerValue >= (RX_SHORT_MIN/ PulseWidthDivisor) && TimerValue <= (RX_SHORT_MAX/ PulseWidthDivisor))
-				{
-					ShiftValue = 1;
-				}else if(TimerValue >= (RX_LONG_MIN/ PulseWidthDivisor) && TimerValue <= (RX_LONG_MAX/ PulseWidthDivisor))
-				{
-					ShiftValue = 0;
-				}
-				else
-				{
-					Error_T InvalidLengthByteError;
-					InvalidLengthByteError.ThrowerID = NETWORK_MESSAGE;
-					InvalidLengthByteError.ErrorMajor = VPW_RETURN_CODE_PULSE_TIMING_UNKOWN;
-					InvalidLengthByteError.ErrorMinor = ERROR_NO_MINOR_CODE;
-					ThrowError(&InvalidLengthByteError);
-				}
-				//Flip if assumed wrong state above
-				if(BusState)
+				uint16_t Length = ByteCount - VPWStreamSent;
+				if(Length > VPW_STREAM_CHUNK_SIZE)
 				{
-					ShiftValue = !ShiftValue;
+					Length = VPW_STREAM_CHUNK_SIZE;
 				}
-				//Shift the value into the current byte
-				CurrentByte |= (ShiftValue << bitNumber);
+				VPWStreamRecord(VPW_STREAM_MORE, mbuf + VPW_RX_HEADER_SIZE + VPWStreamSent, Length);
+				VPWStreamSent += Length;
 			}
-			//Add the current byte to the main recieve buffer and increment the byte counter.
-			*mbuf++ = CurrentByte;
-			ByteCount++;
-		
+			VPWStreamRecord((mbuf[VPW_RX_HEADER_SIZE + ByteCount - 1] == VPWFastCRC(mbuf + VPW_RX_HEADER_SIZE, ByteCount - 1)) ? VPW_STREAM_END_OK : VPW_STREAM_END_BAD_CRC, NULL, 0);
+			VPWStreamActive = false;
+			ui_vehicle_vpw_rx_notify_off();
 		}
+		//Check the CRCs to ensure we got a good message
+		else if( (mbuf[VPW_RX_HEADER_SIZE + ByteCount - 1] == VPWFastCRC(mbuf + VPW_RX_HEADER_SIZE, ByteCount - 1)) && RunFilters(mbuf + VPW_RX_HEADER_SIZE - 1, ByteCount, NULL, NULL) )
+		{
+			ui_vehicle_vpw_rx_notify_off();
+			
+			//It passed the filters prep message with KAVI header
+			//Increment ByteCount to account for command byte, network byte and time
+			ByteCount += 2 + NETWORK_TIME_SIZE;
+			
+			//Add KAVI header
+			mbuf[0] = 0x02;
+			mbuf[1] = (ByteCount >> 8) & 0xFF;
+			mbuf[2] = (ByteCount & 0xFF);
+			mbuf[3] = NETWORK_MESSAGE;
+			mbuf[4] = 0x01;
+			mbuf[5] = (VPWRxFrameTimes[VPWRxSend] >> 24) & 0xFF;
+			mbuf[6] = (VPWRxFrameTimes[VPWRxSend] >> 16) & 0xFF;
+			mbuf[7] = (VPWRxFrameTimes[VPWRxSend] >> 8) & 0xFF;
+			mbuf[8] = VPWRxFrameTimes[VPWRxSend] & 0xFF;
+			ByteCount += 3;
+			//Send it out USB/BT
+			NetworkMessage.buf = mbuf;
+			NetworkMessage.Size = ByteCount;
+			WriteMessage(&NetworkMessage);
+		}
+		
+		//Buffer can be received into again
+		VPWRxFrameLength[VPWRxSend] = 0;
+		VPWRxSend = (VPWRxSend + 1) % VPW_RX_FRAME_BUFFERS;
 	}
-	else
+	
+	if(VPWStreamEnabled)
 	{
-		return;
+		VPWStreamLiveFrame();
 	}
-
- HitEOD:
-	 //Reset buffer pointer to beginning
-	 mbuf = MessageBufferStartAddress;
-	 //Check the CRCs to ensure we got a good message
-	 char crc = mbuf[ByteCount+4];
-	 char actualCRC = VPWFastCRC(mbuf+5, ByteCount-1);
-	 if(mbuf[ByteCount+4] != VPWFastCRC(mbuf+5, ByteCount-1))
-	 {
-		// uint8_t errrtn[] = {START_BYTE, 0x00,0x03,ERROR_RESPONSE, 0x00, VPW_RETURN_CODE_DATA_EXCEPTION};
-		// WriteBufferOut(errrtn,6);
-		 return;
-	 }
-	 
-	ui_vehicle_vpw_rx_notify_off();
 	
-	if(RunFilters(mbuf+4, ByteCount, NULL, NULL))
+	if(VPWTxReportReady)
 	{
-		//It passed the filters prep message with KAVI header
-		
-		//Increment ByteCount to account for command byte and network byte
-		ByteCount++;
-		ByteCount++;
+		uint8_t tmpRtn[] = {START_BYTE, 0x00, 0x03, SEND_MESSAGE_RESULT, VPWTxReportResult, VPWTxReportAttempts};
+		Message_t SendResultMessage;
+		SendResultMessage.buf = tmpRtn;
+		SendResultMessage.Size = 6;
+		VPWTxReportReady = false;
+		WriteMessage(&SendResultMessage);
+	}
+	
+	if(VPWRxDropped || VPWRxErrors || VPWTxCollisions)
+	{
+		//Counters are also written by the receive interrupts
+		NVIC_DisableIRQ(PIOA_IRQn);
+		NVIC_DisableIRQ(VPW_RX_TIMER_IRQ);
+		uint32_t Dropped = VPWRxDropped;
+		uint32_t Errors = VPWRxErrors;
+		uint32_t Collisions = VPWTxCollisions;
+		VPWRxDropped = 0;
+		VPWRxErrors = 0;
+		VPWTxCollisions = 0;
+		NVIC_EnableIRQ(PIOA_IRQn);
+		NVIC_EnableIRQ(VPW_RX_TIMER_IRQ);
 		
-		//Add KAVI header
-		mbuf[0] = 0x02;
-		mbuf[1] = (ByteCount >> 8) & 0xFF;
-		mbuf[2] = (ByteCount & 0xFF);
-		mbuf[3] = NETWORK_MESSAGE;
-		mbuf[4] = 0x01;
-		ByteCount += 3;
-		//Send it out USB/BT
-		NetworkMessage.buf = MessageBufferStartAddress;
-		NetworkMessage.Size = ByteCount;
-		WriteMessage(&NetworkMessage);
+		Error_T VPWReceiveError;
+		VPWReceiveError.ThrowerID = NETWORK_MESSAGE;
+		if(Dropped)
+		{
+			VPWReceiveError.ErrorMajor = VPW_RX_OVERFLOW;
+			VPWReceiveError.ErrorMinor = (Dropped > 0xFF) ? 0xFF : Dropped;
+			ThrowError(&VPWReceiveError);
+		}
+		if(Errors)
+		{
+			VPWReceiveError.ErrorMajor = VPW_RETURN_CODE_PULSE_TIMING_UNKOWN;
+			VPWReceiveError.ErrorMinor = (Errors > 0xFF) ? 0xFF : Errors;
+			ThrowError(&VPWReceiveError);
+		}
+		if(Collisions)
+		{
+			VPWReceiveError.ErrorMajor = VPW_TX_BUS_COLLISION;
+			VPWReceiveError.ErrorMinor = (Collisions > 0xFF) ? 0xFF : Collisions;
+			ThrowError(&VPWReceiveError);
+		}
 	}
- }
+}
  
 
 
@@ -322,83 +588,142 @@ void VPWReceiveNetworkMessage(unsigned char *mbuf, uint32_t MaxBytes)
 }
 */
 
-uint8_t VPWSendNetworkMessage(unsigned char *mbuf, unsigned short n)
+//Starts sending a frame, the CRC is appended here. The bits are timed by the TC from the transmit
+//interrupt, so this returns right away and interrupts stay enabled while the frame goes out. If another
+//node wins arbitration the frame is sent again after IFS, up to the configured number of retries.
+//Report sends the result and number of attempts to the host once the frame is done.
+//Returns VPW_RETURN_CODE_BUS_BUSY if a frame is being sent or received.
+uint8_t VPWSendNetworkMessage(unsigned char *mbuf, unsigned short n, bool Report)
 {
+	if( (n == 0) || (n >= VPW_BUF_SIZE) )
+	{
+		return VPW_RETURN_CODE_DATA_ERROR;
+	}
 	
-	pio_disable_interrupt(PIOA, J1850_VPW_RX);
-	char bits, ch, mask;
-	unsigned int period;
-	tc_stop(VPW_TIMER, VPW_TX_TIMER_CHANNEL);
+	irqflags_t flags = cpu_irq_save();
+	if( (VPWTxState != VPW_TX_IDLE) || (VPWRxState != VPW_RX_IDLE) || (Report && VPWTxReportReady) )
+	{
+		cpu_irq_restore(flags);
+		return VPW_RETURN_CODE_BUS_BUSY;
+	}
+	
+	memcpy(VPWTxFrame, mbuf, n);
+	VPWTxFrame[n] = VPWFastCRC(mbuf, n);
+	VPWTxLength = n + 1;
+	VPWTxAttempts = 0;
+	VPWTxReport = Report;
+	VPWTxStart();
+	cpu_irq_restore(flags);
+	
+	ui_vehicle_vpw_tx_notify();
+	return VPW_RETURN_CODE_OK;
+}
+
+//Sends VPWTxFrame from the start. Interrupts must be disabled or this called from the VPW interrupts,
+//with the receiver idle.
+static void VPWTxStart()
+{
+	VPWTxAttempts++;
+	VPWTxByte = 0;
+	VPWTxBit = 7;
+	VPWTxState = VPW_TX_SOF;
+	
+	//First compare takes the pin active for SOF. The software trigger clears TIOA and restarts the
+	//counter, which the idle receiver doesn't mind.
+	VPWTxCompare = VPW_TX_START_DELAY;
+	tc_write_ra(VPW_TIMER, VPW_TX_TIMER_CHANNEL, VPWTxCompare);
 	tc_start(VPW_TIMER, VPW_TX_TIMER_CHANNEL);
-	//Append CRC
-	char crc = VPWFastCRC(mbuf,n);
-	mbuf[n] = crc;
-	n++;
-	// wait_vpw_idle();
-	//Resets timer
-	tc_sync_trigger(VPW_TIMER);
-	//Go Active on the J1850+ pin
-	//ToggleVehicleVPWSend();
-	GO_ACTIVE
-	while(tc_read_cv(VPW_TIMER,VPW_TX_TIMER_CHANNEL) < TX_SOF);
-
-	while(n != 0)
+	VPWRxLastEdge = 0;
+	TX_PIN_TO_TIMER
+	tc_enable_interrupt(VPW_TIMER, VPW_TX_TIMER_CHANNEL, TC_IER_CPAS);
+}
+
+//Called on each RA compare, the pin has just been toggled to the level of the next symbol
+static void VPWTxNextSymbol()
+{
+	uint16_t Duration;
+	
+	switch(VPWTxState)
 	{
-		ui_vehicle_vpw_tx_notify();
-		n--;
-		ch=*mbuf++;
-		bits = 8;
-		mask = 1;
-		while(bits)
-		{
-			bits--;
-			if(bits&1)
+		case VPW_TX_SOF:
+			Duration = VPWTxTiming->Sof;
+			VPWTxState = VPW_TX_DATA;
+		break;
+		
+		case VPW_TX_DATA:
+			if(VPWTxByte < VPWTxLength)
 			{
-				//Go passive on the J1850+ pin
-				GO_PASSIVE
-				tc_sync_trigger(VPW_TIMER);
-				period = ((ch & (mask << bits)) >> bits) ? TX_LONG : TX_SHORT;
-				while(tc_read_cv(VPW_TIMER,VPW_TX_TIMER_CHANNEL) <= period)
+				//MSB first, starting passive
+				bool Bit = (VPWTxFrame[VPWTxByte] >> VPWTxBit) & 0x01;
+				bool Active = !(VPWTxBit & 0x01);
+				Duration = VPWTxTiming->Bit[Active][Bit];
+				if(VPWTxBit-- == 0)
 				{
-					if(IS_VPW_ACTIVE_LEVEL)
-					{
-						//Need to reset pointers and resend here, this was a bus collision.
-						ui_vehicle_vpw_tx_notify_off();
-						return 0; //Bus collision :(
-					}
+					VPWTxBit = 7;
+					VPWTxByte++;
 				}
 			}
 			else
 			{
-				GO_ACTIVE
-				tc_sync_trigger(VPW_TIMER);
-				period = ((ch & (mask << bits)) >> bits) ? TX_SHORT : TX_LONG;
-				while(tc_read_cv(VPW_TIMER,VPW_TX_TIMER_CHANNEL) <= period);
+				//Last bit was active, the pin is passive again. Hold it there until EOF.
+				GO_PASSIVE
+				TX_PIN_TO_PIO
+				Duration = VPWTxTiming->Eof;
+				VPWTxState = VPW_TX_EOF;
 			}
-		}//while bits
-	}//while n
+		break;
+		
+		case VPW_TX_EOF:
+			VPWTxFinish(VPW_RETURN_CODE_OK);
+		return;
+		
+		default:
+			tc_disable_interrupt(VPW_TIMER, VPW_TX_TIMER_CHANNEL, TC_IDR_CPAS);
+		return;
+	}
+	
+	VPWTxCompare += Duration;
+	tc_write_ra(VPW_TIMER, VPW_TX_TIMER_CHANNEL, VPWTxCompare);
+}
+
+//Lost arbitration, stop driving the bus and wait for it to be idle. The receiver starts the retry.
+static void VPWTxBackoff()
+{
+	tc_disable_interrupt(VPW_TIMER, VPW_TX_TIMER_CHANNEL, TC_IDR_CPAS);
 	GO_PASSIVE
-	tc_sync_trigger(VPW_TIMER);
-	while(tc_read_cv(VPW_TIMER,VPW_TX_TIMER_CHANNEL) < TX_EOF);
+	TX_PIN_TO_PIO
+	VPWTxState = VPW_TX_BACKOFF;
+	VPWRxLastEdge = tc_read_cv(VPW_TIMER, VPW_RX_TIMER_CHANNEL);
+	VPWRxAbort();
+}
 
-	tc_stop(VPW_TIMER, VPW_TX_TIMER_CHANNEL);
-	pio_enable_interrupt(PIOA, J1850_VPW_RX);
+//Ends the transmission, Result is VPW_RETURN_CODE_OK or why it was cut short
+static void VPWTxFinish(uint8_t Result)
+{
+	tc_disable_interrupt(VPW_TIMER, VPW_TX_TIMER_CHANNEL, TC_IDR_CPAS);
+	GO_PASSIVE
+	TX_PIN_TO_PIO
+	VPWTxState = VPW_TX_IDLE;
+	if(VPWTxReport)
+	{
+		VPWTxReportResult = (Result == VPW_RETURN_CODE_OK) ? 0x01 : 0x00;
+		VPWTxReportAttempts = VPWTxAttempts;
+		VPWTxReportReady = true;
+	}
+	else if(Result != VPW_RETURN_CODE_OK)
+	{
+		VPWTxCollisions++;
+	}
+	VPWRxLastEdge = tc_read_cv(VPW_TIMER, VPW_RX_TIMER_CHANNEL);
+	VPWRxAbort();
 	ui_vehicle_vpw_tx_notify_off();
-	return VPW_RETURN_CODE_OK;
 }
 
 void VPWEnter1xMode(void)
 {
-	tc_stop(VPW_TIMER, VPW_TX_TIMER_CHANNEL);
-
-	tc_init(VPW_TIMER,VPW_TX_TIMER_CHANNEL,
-	TC_CMR_TCCLKS_TIMER_CLOCK2|
-	TC_CMR_BURST_NONE
-	);
-	tc_start(VPW_TIMER, VPW_TX_TIMER_CHANNEL);
-
 	Is4xMode = false;
-	PulseWidthDivisor = 1;
+	VPWRxTiming = &VPWRxThresholdTable[0];
+	VPWTxTiming = &VPWTxTimingTable[0];
 
 	uint8_t tmpRtn[] = {START_BYTE, 0x00,0x02,ENTER_VPW_1X, 0x01};
 	Message_t EnterLowSpeedMessage;
@@ -409,17 +734,9 @@ void VPWEnter1xMode(void)
 
 void VPWEnter4xMode(void)
 {
-	tc_stop(VPW_TIMER, VPW_TX_TIMER_CHANNEL);
-
-	tc_init(VPW_TIMER,VPW_TX_TIMER_CHANNEL,
-	TC_CMR_TCCLKS_TIMER_CLOCK1|
-	TC_CMR_BURST_NONE
-	);
-	
-	tc_start(VPW_TIMER, VPW_TX_TIMER_CHANNEL);
-
 	Is4xMode = true;
-	PulseWidthDivisor = 4;
+	VPWRxTiming = &VPWRxThresholdTable[1];
+	VPWTxTiming = &VPWTxTimingTable[1];
 	
 	uint8_t tmpRtn[] = {START_BYTE, 0x00,0x02,ENTER_VPW_4X, 0x01};
 	Message_t EnterHighSpeedMessage;
@@ -430,6 +747,130 @@ void VPWEnter4xMode(void)
 
 }
 
+//Sets how many times a frame is sent again after losing arbitration
+void VPWSetRetries(Message_t *message)
+{
+	if(message->Size < 2)
+	{
+		Error_T InvalidLengthError;
+		InvalidLengthError.ThrowerID = SET_VPW_RETRIES;
+		InvalidLengthError.ErrorMajor = INVALID_LENGTH_BYTES;
+		InvalidLengthError.ErrorMinor = message->Size;
+		ThrowError(&InvalidLengthError);
+		return;
+	}
+	VPWTxRetries = message->buf[1];
+	
+	uint8_t tmpRtn[] = {START_BYTE, 0x00, 0x02, SET_VPW_RETRIES, 0x01};
+	Message_t SetRetriesMessage;
+	SetRetriesMessage.buf = tmpRtn;
+	SetRetriesMessage.Size = 5;
+	WriteMessage(&SetRetriesMessage);
+}
+
+//Sends the complete chunks of the frame being received. Frames are only streamed once they are longer
+//than a chunk, shorter ones are sent whole when they are done.
+static void VPWStreamLiveFrame()
+{
+	irqflags_t flags = cpu_irq_save();
+	uint32_t Seq = VPWRxFrameSeq;
+	uint32_t Time = VPWRxFrameTime;
+	uint16_t Count = VPWRxLiveCount;
+	uint8_t *Frame = VPWRxFrames[VPWRxFill] + VPW_RX_HEADER_SIZE;
+	bool Aborted = (VPWRxAbortedSeq == VPWStreamSeq);
+	cpu_irq_restore(flags);
+	
+	if(VPWStreamActive && Aborted)
+	{
+		VPWStreamRecord(VPW_STREAM_ABORTED, NULL, 0);
+		VPWStreamActive = false;
+	}
+	
+	if(Seq != VPWStreamSeq)
+	{
+		if(Count < VPW_STREAM_CHUNK_SIZE)
+		{
+			return;
+		}
+		//New frame, the header is in the first chunk
+		VPWStreamSeq = Seq;
+		VPWStreamTime = Time;
+		VPWStreamSent = 0;
+		VPWStreamRecordSeq = 0;
+		VPWStreamFiltered = !RunFilters(Frame - 1, Count, NULL, NULL);
+	}
+	
+	while( !VPWStreamFiltered && (Count - VPWStreamSent >= VPW_STREAM_CHUNK_SIZE) )
+	{
+		uint8_t tmpRtn[VPW_STREAM_RECORD_HEADER_SIZE + VPW_STREAM_CHUNK_SIZE];
+		memcpy(tmpRtn + VPW_STREAM_RECORD_HEADER_SIZE, Frame + VPWStreamSent, VPW_STREAM_CHUNK_SIZE);
+		if(VPWRxFrameSeq != Seq)
+		{
+			//Frame ended meanwhile and the buffer may be reused, the rest goes out from where it is now
+			return;
+		}
+		if(!VPWStreamActive)
+		{
+			ui_vehicle_vpw_rx_notify();
+		}
+		VPWStreamActive = true;
+		VPWStreamRecord(VPW_STREAM_MORE, tmpRtn + VPW_STREAM_RECORD_HEADER_SIZE, VPW_STREAM_CHUNK_SIZE);
+		VPWStreamSent += VPW_STREAM_CHUNK_SIZE;
+	}
+}
+
+//Sends one stream record: START_BYTE LenH LenL NETWORK_MESSAGE 0x04 <time> <record seq> <status> <data>
+static void VPWStreamRecord(uint8_t Status, const uint8_t *Data, uint16_t Length)
+{
+	uint8_t tmpRtn[VPW_STREAM_RECORD_HEADER_SIZE + VPW_STREAM_CHUNK_SIZE];
+	uint16_t MessageLength = Length + VPW_STREAM_RECORD_HEADER_SIZE - 3;
+	
+	tmpRtn[0] = START_BYTE;
+	tmpRtn[1] = (MessageLength >> 8) & 0xFF;
+	tmpRtn[2] = MessageLength & 0xFF;
+	tmpRtn[3] = NETWORK_MESSAGE;
+	tmpRtn[4] = VPW_STREAM_NETWORK_TYPE;
+	tmpRtn[5] = (VPWStreamTime >> 24) & 0xFF;
+	tmpRtn[6] = (VPWStreamTime >> 16) & 0xFF;
+	tmpRtn[7] = (VPWStreamTime >> 8) & 0xFF;
+	tmpRtn[8] = VPWStreamTime & 0xFF;
+	tmpRtn[9] = VPWStreamRecordSeq++;
+	tmpRtn[10] = Status;
+	if(Length)
+	{
+		memmove(tmpRtn + VPW_STREAM_RECORD_HEADER_SIZE, Data, Length);
+	}
+	
+	Message_t StreamMessage;
+	StreamMessage.buf = tmpRtn;
+	StreamMessage.Size = Length + VPW_STREAM_RECORD_HEADER_SIZE;
+	WriteMessage(&StreamMessage);
+}
+
+//Turns streaming of long frames on (1) or off (0)
+void VPWSetStreaming(Message_t *message)
+{
+	if(message->Size < 2)
+	{
+		Error_T InvalidLengthError;
+		InvalidLengthError.ThrowerID = SET_VPW_STREAMING;
+		InvalidLengthError.ErrorMajor = INVALID_LENGTH_BYTES;
+		InvalidLengthError.ErrorMinor = message->Size;
+		ThrowError(&InvalidLengthError);
+		return;
+	}
+	VPWStreamEnabled = (message->buf[1] != 0);
+	//Don't pick up a frame that's half sent already
+	VPWStreamSeq = VPWRxFrameSeq;
+	VPWStreamActive = false;
+	
+	uint8_t tmpRtn[] = {START_BYTE, 0x00, 0x02, SET_VPW_STREAMING, 0x01};
+	Message_t SetStreamingMessage;
+	SetStreamingMessage.buf = tmpRtn;
+	SetStreamingMessage.Size = 5;
+	WriteMessage(&SetStreamingMessage);
+}
+
 void VPWInitalizeCRCLUT()
 {
     uint8_t  remainder;
@@ -41,6 +41,10 @@
 #define GO_ACTIVE ioport_set_pin_level(J1850_P_TX, VPW_ACTIVE);
 #define GO_PASSIVE ioport_set_pin_level(J1850_P_TX, VPW_PASSIVE);
 
+//J1850_P_TX is TIOA1, the timer drives it while a frame is sent
+#define TX_PIN_TO_TIMER ioport_disable_pin(J1850_P_TX);
+#define TX_PIN_TO_PIO ioport_enable_pin(J1850_P_TX);
+
 #define IS_VPW_ACTIVE_LEVEL	(ioport_get_pin_level(J1850_P_TX) == VPW_ACTIVE) ? VPW_ACTIVE : VPW_PASSIVE
 #define CURRENT_BUS_STATE ioport_get_pin_level(J1850_P_TX)
 #define CURRENT_BUS_RX_STATE ioport_get_pin_level(J1850_VPW_RX_IDX)
@@ -57,6 +61,8 @@
 #define TX_EOF		us2cnt(225)		// End Of Frame nominal time
 #define TX_BRK		us2cnt(300)		// Break nominal time
 #define TX_IFS		us2cnt(300)		// Inter Frame Separation nominal time
+#define VPW_TX_START_DELAY us2cnt(10)	// from starting the transmit timer to the SOF edge
+#define VPW_TX_DEFAULT_RETRIES 3		// times a frame is sent again after losing arbitration
 
 //See SAE J1850 chapter 6.6.2.5 for preferred use of In Frame Respond/Normalization pulse
 #define TX_IFR_SHORT_CRC	us2cnt(64)	// short In Frame Respond, IFR contain CRC
@@ -98,6 +104,52 @@
 #define VPW_RETURN_CODE_PULSE_TOO_LONG -10
 #define VPW_RETURN_CODE_HEADER_MISMATCH -11
 
+#define VPW_RX_FRAME_BUFFERS 2
+#define VPW_RX_HEADER_SIZE 9		//START_BYTE, LenH, LenL, NETWORK_MESSAGE, network type, time
+
+//Streaming: frames longer than a chunk go to the host in chunks while they are received, ending with a
+//record that has the CRC verdict. Records are START_BYTE LenH LenL NETWORK_MESSAGE 0x04 <time> <seq> <status> <data>,
+//all records of a frame have its time.
+#define VPW_STREAM_NETWORK_TYPE 0x04
+#define VPW_STREAM_CHUNK_SIZE 64
+#define VPW_STREAM_RECORD_HEADER_SIZE 11
+#define VPW_STREAM_MORE 0x00			//data, frame continues
+#define VPW_STREAM_END_OK 0x01			//no data, frame ended with a good CRC
+#define VPW_STREAM_END_BAD_CRC 0x02		//no data, frame ended with a bad CRC
+#define VPW_STREAM_ABORTED 0x03			//no data, frame was cut short
+
+//Receive pulse width limits in receive timer counts
+typedef struct {
+	uint16_t ShortMax;
+	uint16_t LongMin;
+	uint16_t LongMax;
+	uint16_t SofMin;
+	uint16_t SofMax;
+	uint16_t EodMin;
+} VPWRxThresholds_t;
+
+//Transmit symbol widths in timer counts. Bit is indexed [active][bit value].
+typedef struct {
+	uint16_t Sof;
+	uint16_t Eof;
+	uint16_t Ifs;
+	uint16_t Bit[2][2];
+} VPWTxTiming_t;
+
+typedef enum {
+	VPW_TX_IDLE,
+	VPW_TX_SOF,
+	VPW_TX_DATA,
+	VPW_TX_EOF,
+	VPW_TX_BACKOFF		//lost arbitration, waiting for IFS to send again
+} VPWTxState_t;
+
+typedef enum {
+	VPW_RX_IDLE,
+	VPW_RX_SOF,
+	VPW_RX_DATA
+} VPWRxState_t;
+
 #define  FILTER_TYPE_PASS true
 #define  FILTER_TYPE_BLOCK false
 
@@ -115,7 +167,6 @@ static uint8_t crcTable[CRC_TABLE_SIZE];
 
 
 
-static uint32_t PulseWidthDivisor = 1;
 static bool VPWFilterEnable = false;
 static Bool Is4xMode = false;
 
@@ -123,8 +174,10 @@ void VPWEnable(void);
 void VPWDisable(void);
 void VPWEnter4xMode(void);
 void VPWEnter1xMode(void);
-void VPWReceiveNetworkMessage(unsigned char *mbuf, uint32_t MaxBytes);
-uint8_t VPWSendNetworkMessage(unsigned char *mbuf, unsigned short n);
+void VPWProcessReceivedFrames(void);
+uint8_t VPWSendNetworkMessage(unsigned char *mbuf, unsigned short n, bool Report);
+void VPWSetRetries(Message_t *message);
+void VPWSetStreaming(Message_t *message);
 void VPWInitalizeCRCLUT(void);
 uint8_t VPWFastCRC(uint8_t const message[], int nBytes);
 
@@ -0,0 +1,269 @@
+/*
+ * periodic.c
+ *
+ * The periodic timer ticks every millisecond. Due messages are sent straight from the timer interrupt, the main loop
+ * only changes the table.
+ */ 
+
+#include "periodic.h"
+#include "MessageHandler.h"
+
+static PeriodicMessage_t PeriodicMessages[MAX_PERIODIC_MESSAGES];
+static bool PeriodicTimerRunning = false;
+static uint8_t VehicleMode = NONE;
+
+static void StartPeriodicTimer(void);
+static void StopPeriodicTimer(void);
+static void SendPeriodicAck(uint8_t Command, uint8_t ID);
+static void ThrowPeriodicError(uint8_t Command, uint8_t ErrorMajor, uint8_t ErrorMinor);
+static bool SendPeriodicMessage(PeriodicMessage_t *entry);
+
+void SetPeriodicMessage(Message_t *message)
+{
+	//Command, ID, network, arbitration type, period, count and at least one data byte
+	if(message->Size < 9)
+	{
+		ThrowPeriodicError(SET_PERIODIC_MSG, INVALID_PERIODIC_MESSAGE, ERROR_NO_MINOR_CODE);
+		return;
+	}
+	
+	uint8_t ID = message->buf[1];
+	uint8_t Network = message->buf[2];
+	uint16_t Period = (message->buf[4] << 8) | message->buf[5];
+	uint16_t Length = message->Size - 8;
+	
+	if(ID >= MAX_PERIODIC_MESSAGES)
+	{
+		ThrowPeriodicError(SET_PERIODIC_MSG, PERIODIC_INDEX_OUT_OF_BOUNDS, ID);
+		return;
+	}
+	//VPW needs one more byte for the CRC
+	if( (Period == 0) || ((Network == PERIODIC_NETWORK_CAN) && ((Length < 4) || (Length > 12)))
+		|| ((Network == PERIODIC_NETWORK_VPW) && (Length > PERIODIC_MAX_DATA - 1))
+		|| ((Network != PERIODIC_NETWORK_CAN) && (Network != PERIODIC_NETWORK_VPW)) )
+	{
+		ThrowPeriodicError(SET_PERIODIC_MSG, INVALID_PERIODIC_MESSAGE, ID);
+		return;
+	}
+	
+	PeriodicMessage_t *entry = &PeriodicMessages[ID];
+	PeriodicLock();
+	entry->Network = Network;
+	entry->ArbitrationType = message->buf[3];
+	entry->Period = Period;
+	entry->Count = (message->buf[6] << 8) | message->buf[7];
+	entry->Countdown = 0;
+	entry->Length = Length;
+	memcpy(entry->Data, message->buf + 8, Length);
+	entry->InUse = true;
+	entry->Enabled = true;
+	PeriodicUnlock();
+	
+	StartPeriodicTimer();
+	SendPeriodicAck(SET_PERIODIC_MSG, ID);
+}
+
+void SetPeriodicTimer(Message_t *message)
+{
+	if(message->Size < 3)
+	{
+		ThrowPeriodicError(SET_PERIODIC_TMR, INVALID_PERIODIC_MESSAGE, ERROR_NO_MINOR_CODE);
+		return;
+	}
+	
+	uint8_t ID = message->buf[1];
+	uint8_t Operation = message->buf[2];
+	
+	if( (ID == PERIODIC_DELETE_ALL) && (Operation == PERIODIC_TMR_DELETE) )
+	{
+		DeleteAllPeriodicMessages();
+		SendPeriodicAck(SET_PERIODIC_TMR, ID);
+		return;
+	}
+	if( (ID >= MAX_PERIODIC_MESSAGES) || !PeriodicMessages[ID].InUse )
+	{
+		ThrowPeriodicError(SET_PERIODIC_TMR, PERIODIC_INDEX_OUT_OF_BOUNDS, ID);
+		return;
+	}
+	
+	PeriodicMessage_t *entry = &PeriodicMessages[ID];
+	switch(Operation)
+	{
+		case PERIODIC_TMR_STOP:
+			entry->Enabled = false;
+		break;
+		
+		case PERIODIC_TMR_START:
+			PeriodicLock();
+			if(message->Size >= 5)
+			{
+				uint16_t Period = (message->buf[3] << 8) | message->buf[4];
+				if(Period != 0)
+				{
+					entry->Period = Period;
+				}
+			}
+			if(message->Size >= 7)
+			{
+				entry->Count = (message->buf[5] << 8) | message->buf[6];
+			}
+			entry->Countdown = 0;
+			entry->Enabled = true;
+			PeriodicUnlock();
+			StartPeriodicTimer();
+		break;
+		
+		case PERIODIC_TMR_DELETE:
+			entry->Enabled = false;
+			entry->InUse = false;
+		break;
+		
+		default:
+			ThrowPeriodicError(SET_PERIODIC_TMR, INVALID_PERIODIC_MESSAGE, Operation);
+		return;
+	}
+	SendPeriodicAck(SET_PERIODIC_TMR, ID);
+}
+
+void DeleteAllPeriodicMessages()
+{
+	StopPeriodicTimer();
+	for(int i = 0; i < MAX_PERIODIC_MESSAGES; i++)
+	{
+		PeriodicMessages[i].Enabled = false;
+		PeriodicMessages[i].InUse = false;
+	}
+}
+
+void PeriodicSetVehicleMode(uint8_t Mode)
+{
+	VehicleMode = Mode;
+}
+
+void PeriodicLock()
+{
+	NVIC_DisableIRQ(PERIODIC_TIMER_IRQ);
+}
+
+void PeriodicUnlock()
+{
+	if(PeriodicTimerRunning)
+	{
+		NVIC_EnableIRQ(PERIODIC_TIMER_IRQ);
+	}
+}
+
+//Starts the 1ms periodic tick, if not already running
+static void StartPeriodicTimer()
+{
+	if(PeriodicTimerRunning)
+	{
+		return;
+	}
+	sysclk_enable_peripheral_clock(PERIODIC_TIMER_ID);
+	tc_stop(PERIODIC_TIMER, PERIODIC_TIMER_CHANNEL);
+	tc_init(
+	PERIODIC_TIMER,
+	PERIODIC_TIMER_CHANNEL,
+	TC_CMR_TCCLKS_TIMER_CLOCK4|
+	TC_CMR_BURST_NONE|TC_CMR_CPCTRG
+	);
+	tc_write_rc(PERIODIC_TIMER, PERIODIC_TIMER_CHANNEL, PERIODIC_TIMER_HZ / 1000);
+	tc_enable_interrupt(PERIODIC_TIMER, PERIODIC_TIMER_CHANNEL, TC_IER_CPCS);
+	//Below the run timer, above CAN and VPW receive
+	NVIC_SetPriority(PERIODIC_TIMER_IRQ, 3);
+	PeriodicTimerRunning = true;
+	NVIC_EnableIRQ(PERIODIC_TIMER_IRQ);
+	tc_start(PERIODIC_TIMER, PERIODIC_TIMER_CHANNEL);
+}
+
+static void StopPeriodicTimer()
+{
+	if(!PeriodicTimerRunning)
+	{
+		return;
+	}
+	NVIC_DisableIRQ(PERIODIC_TIMER_IRQ);
+	tc_stop(PERIODIC_TIMER, PERIODIC_TIMER_CHANNEL);
+	tc_disable_interrupt(PERIODIC_TIMER, PERIODIC_TIMER_CHANNEL, TC_IDR_CPCS);
+	PeriodicTimerRunning = false;
+}
+
+//Sends the message on the bus it was set up for. Returns false if the bus is not in that mode or the transmitter is busy
+static bool SendPeriodicMessage(PeriodicMessage_t *entry)
+{
+	bool Sent = false;
+	
+	switch(entry->Network)
+	{
+		case PERIODIC_NETWORK_CAN:
+			if(VehicleMode == CAN_MODE)
+			{
+				Sent = (SendStandardCanMessage(entry->ArbitrationType, entry->Data, entry->Length) == CAN_MAILBOX_TRANSFER_OK);
+			}
+		break;
+		
+		case PERIODIC_NETWORK_VPW:
+			if(VehicleMode == VPW_MODE)
+			{
+				//Only starts the transmission, a busy bus is retried on the next tick
+				Sent = (VPWSendNetworkMessage(entry->Data, entry->Length, false) == VPW_RETURN_CODE_OK);
+			}
+		break;
+	}
+	return Sent;
+}
+
+static void SendPeriodicAck(uint8_t Command, uint8_t ID)
+{
+	uint8_t tmpRtn[] = {START_BYTE, 0x00, 0x03, Command, 0x01, ID};
+	Message_t PeriodicAck;
+	PeriodicAck.buf = tmpRtn;
+	PeriodicAck.Size = 6;
+	WriteMessage(&PeriodicAck);
+}
+
+static void ThrowPeriodicError(uint8_t Command, uint8_t ErrorMajor, uint8_t ErrorMinor)
+{
+	Error_T PeriodicError;
+	PeriodicError.ThrowerID = Command;
+	PeriodicError.ErrorMajor = ErrorMajor;
+	PeriodicError.ErrorMinor = ErrorMinor;
+	ThrowError(&PeriodicError);
+}
+
+//Periodic timer interrupt, every 1ms
+void PERIODIC_TIMER_HANDLER()
+{
+	if ((tc_get_status(PERIODIC_TIMER, PERIODIC_TIMER_CHANNEL) & TC_SR_CPCS) == TC_SR_CPCS)
+	{
+		NVIC_ClearPendingIRQ(PERIODIC_TIMER_IRQ);
+		for(int i = 0; i < MAX_PERIODIC_MESSAGES; i++)
+		{
+			PeriodicMessage_t *entry = &PeriodicMessages[i];
+			if(!entry->Enabled)
+			{
+				continue;
+			}
+			if(entry->Countdown > 0)
+			{
+				entry->Countdown--;
+				continue;
+			}
+			//If the transmitter was busy, try again on the next tick
+			if(!SendPeriodicMessage(entry))
+			{
+				continue;
+			}
+			entry->Countdown = entry->Period - 1;
+			if(entry->Count > 0)
+			{
+				entry->Count--;
+				if(entry->Count == 0)
+				{
+					entry->Enabled = false;
+				}
+			}
+		}
+	}
+}
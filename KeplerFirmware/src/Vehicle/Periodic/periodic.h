@@ -0,0 +1,60 @@
+/*
+ * periodic.h
+ *
+ * Periodic vehicle messages sent by the interface itself (SET_PERIODIC_MSG / SET_PERIODIC_TMR), so keep-alive
+ * timing doesn't depend on the host and the USB link.
+ */ 
+
+
+#ifndef PERIODIC_H_
+#define PERIODIC_H_
+
+#include <asf.h>
+#include "Message.h"
+#include "Timers.h"
+
+#define MAX_PERIODIC_MESSAGES 16
+#define PERIODIC_TIMER_HZ (sysclk_get_peripheral_hz() / 128)		//TIMER_CLOCK4
+#define PERIODIC_MAX_DATA 16		//CAN: 4 byte ID + 8 data bytes, VPW: up to 12 bytes + room for the CRC
+
+#define PERIODIC_NETWORK_VPW 0x01	//Same as the network type of NETWORK_MESSAGE frames
+#define PERIODIC_NETWORK_CAN 0x02
+
+//SET_PERIODIC_TMR operations
+#define PERIODIC_TMR_STOP	0x00
+#define PERIODIC_TMR_START	0x01
+#define PERIODIC_TMR_DELETE	0x02
+
+#define PERIODIC_DELETE_ALL 0xFF	//Message ID for deleting every periodic message
+
+typedef struct {
+	bool InUse;
+	bool Enabled;
+	uint8_t Network;
+	uint8_t ArbitrationType;		//CAN only, 0 = 11 bit, 1 = 29 bit
+	uint16_t Period;				//ms
+	uint16_t Countdown;				//ms until next transmission
+	uint16_t Count;					//transmissions left, 0 = forever
+	uint8_t Length;
+	uint8_t Data[PERIODIC_MAX_DATA];
+} PeriodicMessage_t;
+
+/*
+* SET_PERIODIC_MSG: 0xB4 ID Network ArbitrationType PeriodH PeriodL CountH CountL Data...
+* Stores the message in slot ID and starts it, first transmission is right away. 
+* Data is the same as in SEND_MESSAGE: for CAN 4 ID bytes followed by the data bytes.
+*/
+void SetPeriodicMessage(Message_t *message);
+/*
+* SET_PERIODIC_TMR: 0xB5 ID Operation [PeriodH PeriodL [CountH CountL]]
+* Starts, stops or deletes the periodic message in slot ID. Start can also change the period and count.
+*/
+void SetPeriodicTimer(Message_t *message);
+void DeleteAllPeriodicMessages(void);
+//Messages are only sent while the interface is in the mode (VPW_MODE, CAN_MODE) of their network
+void PeriodicSetVehicleMode(uint8_t Mode);
+//Keeps the timer interrupt from sending while the main loop uses the same transmitter
+void PeriodicLock(void);
+void PeriodicUnlock(void);
+
+#endif /* PERIODIC_H_ */
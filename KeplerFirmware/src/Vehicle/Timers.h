@@ -12,16 +12,33 @@
 #define VPW_TIMER TC0
 #define RUN_TIMER TC0
 #define TP_TIMEOUT_TIMER TC1
+#define PERIODIC_TIMER TC1
 
-#define VPW_TX_TIMER_ID ID_TC0
+//J1850_P_TX is TIOA1 and J1850_VPW_RX is TIOB1, both directions use channel 1
+#define VPW_TX_TIMER_ID ID_TC1
 #define VPW_RX_TIMER_ID ID_TC1
 #define RUN_TIMER_ID ID_TC2
 #define TP_TIMEOUT_TIMER_ID ID_TC3
+#define PERIODIC_TIMER_ID ID_TC4
 
-#define VPW_TX_TIMER_CHANNEL 0
+#define VPW_TX_TIMER_CHANNEL 1
 #define VPW_RX_TIMER_CHANNEL 1
 #define RUN_TIMER_CHANNEL	 2
+#define RUN_TIMER_IRQ TC2_IRQn
+#define RUN_TIMER_HANDLER TC2_Handler
 
 #define TP_TIMEOUT_TIMER_CHANNEL	0
+#define PERIODIC_TIMER_CHANNEL		1
+
+#define VPW_RX_TIMER_IRQ TC1_IRQn
+#define PERIODIC_TIMER_IRQ TC4_IRQn
+#define PERIODIC_TIMER_HANDLER TC4_Handler
+
+//Ticks the CAN timer wheel, all ISO 15765 timing runs on it
+#define CAN_WHEEL_TIMER TC2
+#define CAN_WHEEL_TIMER_ID ID_TC6
+#define CAN_WHEEL_TIMER_CHANNEL 0
+#define CAN_WHEEL_TIMER_IRQ TC6_IRQn
+#define CAN_WHEEL_TIMER_HANDLER TC6_Handler
 
 #endif /* TIMERS_H_ */
\ No newline at end of file
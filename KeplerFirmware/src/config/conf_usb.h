@@ -91,8 +91,8 @@
  */
 // #define  UDC_VBUS_EVENT(b_vbus_high)      user_callback_vbus_action(b_vbus_high)
 // extern void user_callback_vbus_action(bool b_vbus_high);
-// #define  UDC_SOF_EVENT()                  user_callback_sof_action()
-// extern void user_callback_sof_action(void);
+#define  UDC_SOF_EVENT()                  main_sof_action()
+extern void main_sof_action(void);
 // #define  UDC_SUSPEND_EVENT()              user_callback_suspend_action()
 // extern void user_callback_suspend_action(void);
 // #define  UDC_RESUME_EVENT()               user_callback_resume_action()
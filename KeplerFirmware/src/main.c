@@ -32,6 +32,8 @@
 #include "KeplerConfiguration.h"
 #include "runtimer.h"
 #include "console.h"
+#include "kcan.h"
+#include "j1850vpw.h"
 
 
 int main (void)
@@ -49,6 +51,8 @@ int main (void)
 	//Debug console
 	WriteLine("Welcome - Kepler Debug Console - V1.0");
 	WriteLine("Board Initialization...OK");
+	//Time base of the received frame timestamps
+	StartRunTimer();
 
 	//Initialize Kepler Configuration
 	SystemConfiguration.pc_com_mode = 0;
@@ -56,6 +60,7 @@ int main (void)
 	SystemConfiguration.bluetooth_unlocked = false;
 	SystemConfiguration.in_secure_mode = false;
 	SystemConfiguration.isotp_mode = 0;
+	InitalizeCommandParser();
 	
 	WriteLine("System Configuration...OK");
 	WriteLine("System...RUNNING");
@@ -63,11 +68,13 @@ int main (void)
 	//Loop and handle commands forever
 	while(1)
 	{
-	 	if(MessageAvailable == 1)
+	 	if(USBDataAvailable == 1)
 		{
-			//Got a message, handle it
-			HandleMessage(&IncommingMessage);
-			MessageAvailable = 0;
+			//Got data, handle every command in it
+			ProcessUSBMessages();
 		}
+		//Send out frames received in the CAN and VPW interrupts
+		CanProcessReceivedFrames();
+		VPWProcessReceivedFrames();
 	}
 }